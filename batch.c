@@ -0,0 +1,503 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    Convert NMEA log files in one go.                                                                                                   */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+// For madvise()
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include "gpsread.h"
+
+
+// How much of a mapped file to convert before writing it out.
+#define BATCH_STEP 65536
+
+// How many OSGB conversions to do together.
+#define BATCH_OSGB 256
+
+// How far before its chunk a worker looks for the RMC, VTG and GSA that the chunk's first fixes carry on from.
+#define BATCH_PRIME 16384
+
+
+// Output text waiting to be written.
+typedef struct
+  {
+  char* buf ;
+  size_t len ;
+  size_t size ;
+  } textbuf_t ;
+
+// A piece of a mapped file, converted by one of the workers. When simplifying, they just parse it, and the writer does the rest.
+typedef struct
+  {
+  const char* data ;
+  size_t len ;
+  textbuf_t text ;
+  gpsfix_t* fixes ;
+  size_t nfixes ;
+  size_t maxfixes ;
+  int done ;
+  } chunk_t ;
+
+// Shared between the workers and the thread writing their results.
+typedef struct
+  {
+  const char* data ;            // The whole file.
+  chunk_t* chunks ;
+  int nchunks ;
+  int next ;
+  int written ;
+  int window ;
+  const format_t* fmt ;
+  pthread_mutex_t lock ;
+  pthread_cond_t cond ;
+  } pool_t ;
+
+
+// Make sure there's at least need bytes spare. Returns 0, or -1 if it ran out of memory.
+static int
+batch_room ( textbuf_t* text, size_t need )
+  {
+  char* bigger ;
+  if ( text->size - text->len >= need ) return 0 ;
+  bigger = realloc ( text->buf, text->size * 2 + need ) ;
+  if ( bigger == NULL ) return -1 ;
+  text->buf = bigger ;
+  text->size = text->size * 2 + need ;
+  return 0 ;
+  }
+
+
+// Convert and format a batch of OSGB points in one go.
+static int
+batch_osgb ( textbuf_t* text, size_t count, const double* lat, const double* lon )
+  {
+  char z[BATCH_OSGB][3] ;
+  long e[BATCH_OSGB], n[BATCH_OSGB] ;
+  size_t i ;
+  if ( batch_room ( text, count * 32 ) < 0 ) return -1 ;
+  LLtoOSGBv ( count, lat, lon, z, e, n ) ;
+  for ( i = 0 ; i < count ; i++ ) text->len += format_osgb ( text->buf + text->len, text->size - text->len, z[i], e[i], n[i] ) ;
+  return 0 ;
+  }
+
+
+// Fixes on their way out of a block.
+typedef struct
+  {
+  const format_t* fmt ;
+  textbuf_t* text ;
+  size_t k ;
+  double lat[BATCH_OSGB], lon[BATCH_OSGB] ;
+  int err ;
+  } batchout_t ;
+
+
+// Format a fix, or save it up if it's OSGB.
+static void
+batch_out ( const gpsfix_t* fix, void* user )
+  {
+  batchout_t* out = user ;
+  if ( out->err ) return ;
+  if ( out->fmt->posunit == OSGB )
+    {
+    out->lat[out->k] = fix_degrees ( fix->lat ) ;
+    out->lon[out->k] = fix_degrees ( fix->lon ) ;
+    if ( ++out->k == BATCH_OSGB )
+      {
+      out->err = batch_osgb ( out->text, out->k, out->lat, out->lon ) ;
+      out->k = 0 ;
+      }
+    return ;
+    }
+  // Make sure there's room for any format.
+  if ( ( out->err = batch_room ( out->text, FORMAT_MAX ) ) < 0 ) return ;
+  out->text->len += format_fix ( out->text->buf + out->text->len, out->text->size - out->text->len, fix, out->fmt ) ;
+  }
+
+
+// Frame, parse and format everything in a block, adding to text.
+// The fix carries on from block to block, with the date, speed and course from the latest RMC, VTG and GSA. OSGB is saved up and done
+// in batches. Fixes go through simp first if there is one, and if this is the last block, the fix it's still holding comes out too.
+// Returns 0, or -1 if it ran out of memory.
+static int
+batch_block ( nmea_framer_t* fr, gpsfix_t* fix, const char* data, size_t len, const format_t* fmt, gpssimplify_t* simp, int last,
+              textbuf_t* text )
+  {
+  const char* sentence ;
+  int slen ;
+  size_t used ;
+  batchout_t out ;
+  out.fmt = fmt ;
+  out.text = text ;
+  out.k = 0 ;
+  out.err = 0 ;
+  // The simplifier carries on from block to block, but what it passes on goes here.
+  if ( simp )
+    {
+    simp->onfix = batch_out ;
+    simp->user = &out ;
+    }
+  while ( len > 0 && !out.err )
+    {
+    used = nmea_frame ( fr, data, len, &sentence, &slen ) ;
+    data += used ;
+    len -= used ;
+    if ( sentence == NULL ) continue ;
+    if ( nmea_parse ( sentence, slen, fix ) != NMEA_GGA ) continue ;
+    if ( simp ) gpssimplify_push ( fix, simp ) ;
+    else batch_out ( fix, &out ) ;
+    }
+  if ( simp && last ) gpssimplify_flush ( simp ) ;
+  if ( out.err ) return -1 ;
+  return out.k ? batch_osgb ( text, out.k, out.lat, out.lon ) : 0 ;
+  }
+
+
+// Frame and parse a chunk, saving its fixes in order. Their raw sentences stay in the mapped file.
+// Returns 0, or -1 if it ran out of memory.
+static int
+batch_parse ( nmea_framer_t* fr, gpsfix_t* fix, chunk_t* chunk )
+  {
+  const char* data = chunk->data ;
+  const char* sentence ;
+  size_t len = chunk->len ;
+  size_t used ;
+  gpsfix_t* bigger ;
+  int slen ;
+  while ( len > 0 )
+    {
+    used = nmea_frame ( fr, data, len, &sentence, &slen ) ;
+    data += used ;
+    len -= used ;
+    if ( sentence == NULL ) continue ;
+    if ( nmea_parse ( sentence, slen, fix ) != NMEA_GGA ) continue ;
+    if ( chunk->nfixes == chunk->maxfixes )
+      {
+      bigger = realloc ( chunk->fixes, ( chunk->maxfixes * 2 + 1024 ) * sizeof ( gpsfix_t ) ) ;
+      if ( bigger == NULL ) return -1 ;
+      chunk->fixes = bigger ;
+      chunk->maxfixes = chunk->maxfixes * 2 + 1024 ;
+      }
+    chunk->fixes[chunk->nfixes++] = *fix ;
+    }
+  return 0 ;
+  }
+
+
+// Simplify and format a chunk's fixes, adding to text. The simplifier carries on from chunk to chunk, and lets go of the fix it's
+// holding after the last one. Returns 0, or -1 if it ran out of memory.
+static int
+batch_simplify ( const chunk_t* chunk, const format_t* fmt, gpssimplify_t* simp, int last, textbuf_t* text )
+  {
+  batchout_t out ;
+  size_t i ;
+  out.fmt = fmt ;
+  out.text = text ;
+  out.k = 0 ;
+  out.err = 0 ;
+  simp->onfix = batch_out ;
+  simp->user = &out ;
+  for ( i = 0 ; i < chunk->nfixes && !out.err ; i++ ) gpssimplify_push ( &chunk->fixes[i], simp ) ;
+  if ( last && !out.err ) gpssimplify_flush ( simp ) ;
+  // Nothing else gets passed on till the next chunk points it somewhere else.
+  simp->user = NULL ;
+  if ( out.err ) return -1 ;
+  return out.k ? batch_osgb ( text, out.k, out.lat, out.lon ) : 0 ;
+  }
+
+
+// Write out and empty a text buffer.
+static int
+batch_flush ( textbuf_t* text, FILE* out )
+  {
+  if ( text->len && fwrite ( text->buf, 1, text->len, out ) != text->len ) return -1 ;
+  text->len = 0 ;
+  return 0 ;
+  }
+
+
+// Find where the next sentence starts, at or after p. Prefers a '$' at the start of a line.
+static const char*
+batch_boundary ( const char* p, const char* start, const char* end )
+  {
+  const char* first = NULL ;
+  while ( p < end && ( p = memchr ( p, '$', end - p ) ) != NULL )
+    {
+    if ( p == start || p[-1] == '\n' ) return p ;
+    if ( first == NULL ) first = p ;
+    // Give up on line starts after a few sentences' worth.
+    if ( p - first > 4096 ) return first ;
+    p++ ;
+    }
+  return first ? first : end ;
+  }
+
+
+// Worker thread, takes chunks in order and converts them.
+static void*
+batch_worker ( void* arg )
+  {
+  pool_t* pool = arg ;
+  nmea_framer_t framer ;
+  gpsfix_t fix ;
+  chunk_t* chunk ;
+  const char* sentence ;
+  const char* p ;
+  int i, slen ;
+  while ( 1 )
+    {
+    // Next chunk, but don't get too far ahead of the writer.
+    pthread_mutex_lock ( &pool->lock ) ;
+    while ( pool->next < pool->nchunks && pool->next >= pool->written + pool->window ) pthread_cond_wait ( &pool->cond, &pool->lock ) ;
+    i = pool->next++ ;
+    pthread_mutex_unlock ( &pool->lock ) ;
+    if ( i >= pool->nchunks ) return NULL ;
+    // Catch up on the sentences just before the chunk, without showing anything, so its first fixes get the same date, speed and
+    // course as they would converted in one go. Only if the GPS goes more than BATCH_PRIME bytes without an RMC will they differ.
+    chunk = &pool->chunks[i] ;
+    gpsfix_init ( &fix ) ;
+    nmea_init ( &framer, NMEA_CHECK_PRESENT ) ;
+    p = ( chunk->data - pool->data > BATCH_PRIME ) ? batch_boundary ( chunk->data - BATCH_PRIME, pool->data, chunk->data ) : pool->data ;
+    while ( p < chunk->data )
+      {
+      p += nmea_frame ( &framer, p, chunk->data - p, &sentence, &slen ) ;
+      if ( sentence ) nmea_parse ( sentence, slen, &fix ) ;
+      }
+    // Chunks start on a '$', so a fresh framer is fine. Simplifying has to go through the whole track in order, so that's left to the
+    // writer, and the output doesn't depend on how the file was split up.
+    nmea_init ( &framer, NMEA_CHECK_PRESENT ) ;
+    if ( pool->fmt->simplify > 0 )
+      {
+      if ( batch_parse ( &framer, &fix, chunk ) < 0 ) chunk->done = -1 ;
+      }
+    else if ( batch_block ( &framer, &fix, chunk->data, chunk->len, pool->fmt, NULL, 1, &chunk->text ) < 0 ) chunk->done = -1 ;
+    pthread_mutex_lock ( &pool->lock ) ;
+    if ( chunk->done == 0 ) chunk->done = 1 ;
+    pthread_cond_broadcast ( &pool->cond ) ;
+    pthread_mutex_unlock ( &pool->lock ) ;
+    }
+  }
+
+
+// Convert a mapped file a block at a time on this thread, so the output doesn't grow with the file.
+// Returns 0, or -1 with errno set.
+static int
+batch_serial ( const char* data, size_t len, const format_t* fmt, FILE* out )
+  {
+  nmea_framer_t framer ;
+  gpssimplify_t simp ;
+  gpsfix_t fix ;
+  textbuf_t text = { NULL, 0, 0 } ;
+  size_t off, step ;
+  int err, ret = 0 ;
+  nmea_init ( &framer, NMEA_CHECK_PRESENT ) ;
+  gpsfix_init ( &fix ) ;
+  gpssimplify_init ( &simp, fmt->simplify, NULL, NULL ) ;
+  for ( off = 0 ; ret == 0 && off < len ; off += step )
+    {
+    step = ( len - off < BATCH_STEP ) ? len - off : BATCH_STEP ;
+    if ( batch_block ( &framer, &fix, data + off, step, fmt, fmt->simplify > 0 ? &simp : NULL, off + step == len, &text ) < 0 )
+      {
+      errno = ENOMEM ;
+      ret = -1 ;
+      }
+    else ret = batch_flush ( &text, out ) ;
+    }
+  err = errno ;
+  free ( text.buf ) ;
+  errno = err ;
+  return ret ;
+  }
+
+
+// Split a mapped file into chunks on sentence boundaries, convert them on jobs threads, and write the results in the original order.
+static int
+batch_parallel ( const char* data, size_t len, const format_t* fmt, int jobs, FILE* out )
+  {
+  pool_t pool ;
+  gpssimplify_t simp ;
+  pthread_t* threads ;
+  size_t chunksize ;
+  const char* p ;
+  const char* q ;
+  const char* end = data + len ;
+  int i, started, ret = 0 ;
+  // Enough chunks to keep everyone busy, not so small they're all overhead.
+  chunksize = len / ( jobs * 8 ) ;
+  if ( chunksize < 65536 ) chunksize = 65536 ;
+  if ( chunksize > 8388608 ) chunksize = 8388608 ;
+  memset ( &pool, 0, sizeof ( pool ) ) ;
+  pool.chunks = calloc ( len / chunksize + 2, sizeof ( chunk_t ) ) ;
+  threads = calloc ( jobs, sizeof ( pthread_t ) ) ;
+  if ( pool.chunks == NULL || threads == NULL )
+    {
+    free ( pool.chunks ) ;
+    free ( threads ) ;
+    return -1 ;
+    }
+  for ( p = data ; p < end ; p = q )
+    {
+    q = ( (size_t) ( end - p ) > chunksize ) ? batch_boundary ( p + chunksize, data, end ) : end ;
+    pool.chunks[pool.nchunks].data = p ;
+    pool.chunks[pool.nchunks].len = q - p ;
+    pool.nchunks++ ;
+    }
+  pool.data = data ;
+  pool.window = jobs * 4 ;
+  pool.fmt = fmt ;
+  pthread_mutex_init ( &pool.lock, NULL ) ;
+  pthread_cond_init ( &pool.cond, NULL ) ;
+  for ( started = 0 ; started < jobs ; started++ ) if ( pthread_create ( &threads[started], NULL, batch_worker, &pool ) ) break ;
+  // No threads at all, so do it all here, the plain way. The pool's worker would wait forever for this thread to write.
+  if ( started == 0 )
+    {
+    pthread_mutex_destroy ( &pool.lock ) ;
+    pthread_cond_destroy ( &pool.cond ) ;
+    free ( pool.chunks ) ;
+    free ( threads ) ;
+    return batch_serial ( data, len, fmt, out ) ;
+    }
+  // Write them out in order as they finish, simplifying them first if need be.
+  gpssimplify_init ( &simp, fmt->simplify, NULL, NULL ) ;
+  for ( i = 0 ; i < pool.nchunks ; i++ )
+    {
+    pthread_mutex_lock ( &pool.lock ) ;
+    while ( pool.chunks[i].done == 0 ) pthread_cond_wait ( &pool.cond, &pool.lock ) ;
+    pthread_mutex_unlock ( &pool.lock ) ;
+    if ( pool.chunks[i].done > 0 && fmt->simplify > 0 && ret == 0 )
+      {
+      if ( batch_simplify ( &pool.chunks[i], fmt, &simp, i == pool.nchunks - 1, &pool.chunks[i].text ) < 0 ) pool.chunks[i].done = -1 ;
+      }
+    if ( pool.chunks[i].done < 0 ) errno = ENOMEM ;
+    if ( pool.chunks[i].done < 0 || batch_flush ( &pool.chunks[i].text, out ) < 0 ) ret = -1 ;
+    free ( pool.chunks[i].text.buf ) ;
+    free ( pool.chunks[i].fixes ) ;
+    pthread_mutex_lock ( &pool.lock ) ;
+    pool.written++ ;
+    pthread_cond_broadcast ( &pool.cond ) ;
+    pthread_mutex_unlock ( &pool.lock ) ;
+    }
+  for ( i = 0 ; i < started ; i++ ) pthread_join ( threads[i], NULL ) ;
+  pthread_mutex_destroy ( &pool.lock ) ;
+  pthread_cond_destroy ( &pool.cond ) ;
+  free ( pool.chunks ) ;
+  free ( threads ) ;
+  return ret ;
+  }
+
+
+// Show every fix in a log file, or stdin if path is "-".
+// Files are mapped and framed in place, split over jobs threads if more than one. Pipes get read in blocks.
+// Returns 0, or -1 with errno set.
+int
+batch_file ( const char* path, const format_t* fmt, int jobs, FILE* out )
+  {
+  int fd ;
+  struct stat st ;
+  nmea_framer_t framer ;
+  gpssimplify_t simp ;
+  gpssimplify_t* simpp = ( fmt->simplify > 0 ) ? &simp : NULL ;
+  gpsfix_t fix ;
+  textbuf_t text = { NULL, 0, 0 } ;
+  char* map ;
+  char rxbuf[65536] ;
+  ssize_t got ;
+  int err, ret = 0 ;
+  char header[128] ;
+  size_t hlen = format_header ( header, sizeof ( header ), fmt ) ;
+  if ( hlen && fwrite ( header, 1, hlen, out ) != hlen ) return -1 ;
+  nmea_init ( &framer, NMEA_CHECK_PRESENT ) ;
+  gpssimplify_init ( &simp, fmt->simplify, NULL, NULL ) ;
+  gpsfix_init ( &fix ) ;
+  // Open it.
+  if ( !strcmp ( path, "-" ) ) fd = STDIN_FILENO ;
+  else if ( ( fd = open ( path, O_RDONLY ) ) < 0 ) return -1 ;
+  if ( fstat ( fd, &st ) < 0 ) goto fail ;
+  // A real file, map it all.
+  if ( S_ISREG ( st.st_mode ) && st.st_size > 0 )
+    {
+    map = mmap ( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 ) ;
+    if ( map != MAP_FAILED )
+      {
+      madvise ( map, st.st_size, MADV_SEQUENTIAL ) ;
+      if ( jobs > 1 ) ret = batch_parallel ( map, st.st_size, fmt, jobs, out ) ;
+      else ret = batch_serial ( map, st.st_size, fmt, out ) ;
+      err = errno ;
+      munmap ( map, st.st_size ) ;
+      if ( fd != STDIN_FILENO ) close ( fd ) ;
+      errno = err ;
+      return ret ;
+      }
+    }
+  // Otherwise read it as it comes, with an empty last block to finish off.
+  do
+    {
+    got = read ( fd, rxbuf, sizeof ( rxbuf ) ) ;
+    if ( got < 0 )
+      {
+      if ( errno == EINTR ) continue ;
+      goto fail ;
+      }
+    if ( batch_block ( &framer, &fix, rxbuf, got, fmt, simpp, got == 0, &text ) < 0 )
+      {
+      errno = ENOMEM ;
+      goto fail ;
+      }
+    if ( batch_flush ( &text, out ) < 0 ) goto fail ;
+    }
+  while ( got != 0 ) ;
+  free ( text.buf ) ;
+  if ( fd != STDIN_FILENO ) close ( fd ) ;
+  return 0 ;
+fail :
+  err = errno ;
+  free ( text.buf ) ;
+  if ( fd != STDIN_FILENO ) close ( fd ) ;
+  errno = err ;
+  return -1 ;
+  }
+
+
+// Pass every fix in a log file, or stdin if path is "-", to onfix, in order.
+// Returns 0, or -1 with errno set.
+int
+batch_each ( const char* path, gpsread_fix_cb onfix, void* user )
+  {
+  gpsread_t reader ;
+  char rxbuf[65536] ;
+  ssize_t got ;
+  int fd, err ;
+  gpsread_init ( &reader, onfix, user ) ;
+  if ( !strcmp ( path, "-" ) ) fd = STDIN_FILENO ;
+  else if ( ( fd = open ( path, O_RDONLY ) ) < 0 ) return -1 ;
+  while ( ( got = read ( fd, rxbuf, sizeof ( rxbuf ) ) ) != 0 )
+    {
+    if ( got < 0 )
+      {
+      if ( errno == EINTR ) continue ;
+      err = errno ;
+      if ( fd != STDIN_FILENO ) close ( fd ) ;
+      errno = err ;
+      return -1 ;
+      }
+    gpsread_push ( &reader, rxbuf, got ) ;
+    }
+  if ( fd != STDIN_FILENO ) close ( fd ) ;
+  return 0 ;
+  }
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent
@@ -0,0 +1,501 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    Microbenchmarks of gpsread's hot paths, on synthetic NMEA.                                                                          */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+// Each benchmark runs over the same data until it's taken at least the minimum time, and reports nanoseconds per item, and MB/s where
+// there's a byte stream in or out. Results go to stdout as JSON, one object per line, so runs can be kept and compared; a table for
+// people goes to stderr. "make bench" runs it into bench.json.
+//
+// The streams are made up here, along a track across southern England, so they're the same every run:
+//   gga       good $GPGGA sentences and nothing else.
+//   corrupt   a quarter each good, bad checksums, line noise before a good one, and cut off by the next '$'.
+//   overlong  $GPTXT sentences longer than the framer holds, between good ones.
+//   mixed     GGA, RMC, GSA, VTG and GSV each epoch, from GP, GN, GL, GA, BD and GQ talkers in turn.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <getopt.h>
+#include "gpsread.h"
+
+
+// Convert macros to strings.
+#define STR(S) _STR(S)
+#define _STR(S) #S
+
+// Defaults: sentences in each stream, and seconds to spend on each benchmark.
+#define BENCH_SENTENCES 20000
+#define BENCH_SECONDS 0.25
+// Size of the reads the framer gets, as from a tty or a file.
+#define BENCH_READ 4096
+
+
+// A made up stream of NMEA.
+typedef struct
+  {
+  const char* name ;
+  char* data ;
+  size_t len, size ;
+  long count ;                  // Sentences, good or not.
+  } stream_t ;
+
+// Fixes, and positions, to convert and format.
+typedef struct
+  {
+  size_t n ;
+  gpsfix_t* fix ;
+  double* lat ;
+  double* lon ;
+  char (*z)[3] ;
+  long* e ;
+  long* north ;
+  char* loc ;
+  const char** sentence ;       // The GGA sentences they came from.
+  int* slen ;
+  } fixes_t ;
+
+// One of the formatters.
+typedef struct
+  {
+  const fixes_t* fixes ;
+  format_t fmt ;
+  } formatter_t ;
+
+static double mintime = BENCH_SECONDS ;
+// Somewhere for results to go, so they aren't optimised away.
+static volatile long sink ;
+
+
+// Seconds, from some time.
+static double
+bench_now ( void )
+  {
+  struct timespec ts ;
+  clock_gettime ( CLOCK_MONOTONIC, &ts ) ;
+  return ts.tv_sec + ts.tv_nsec * 1e-9 ;
+  }
+
+
+// Add a sentence to a stream, with its '$', checksum and CRLF.
+static void
+bench_add ( stream_t* s, const char* body, int good )
+  {
+  size_t n = strlen ( body ) ;
+  unsigned x = 0 ;
+  size_t i ;
+  if ( s->len + n + 8 > s->size )
+    {
+    s->size = ( s->size + n + 8 ) * 2 ;
+    if ( ( s->data = realloc ( s->data, s->size ) ) == NULL )
+      {
+      perror ( "bench" ) ;
+      exit ( EXIT_FAILURE ) ;
+      }
+    }
+  for ( i = 0 ; i < n ; i++ ) x ^= (unsigned char) body[i] ;
+  if ( !good ) x ^= 0x55 ;
+  s->len += sprintf ( s->data + s->len, "$%s*%02X\r\n", body, x ) ;
+  s->count++ ;
+  }
+
+
+// Add raw bytes to a stream, not counted as a sentence.
+static void
+bench_noise ( stream_t* s, const char* bytes, size_t n )
+  {
+  if ( s->len + n > s->size )
+    {
+    s->size = ( s->size + n ) * 2 ;
+    if ( ( s->data = realloc ( s->data, s->size ) ) == NULL )
+      {
+      perror ( "bench" ) ;
+      exit ( EXIT_FAILURE ) ;
+      }
+    }
+  memcpy ( s->data + s->len, bytes, n ) ;
+  s->len += n ;
+  }
+
+
+// The body of a GGA sentence for the i'th second along the track, from talker.
+static void
+bench_gga ( char* buf, size_t size, const char* talker, long i )
+  {
+  double lat = 51.5 + i * 1e-5, lon = -1.2 + i * 1.3e-5 ;
+  double alat = fabs ( lat ), alon = fabs ( lon ) ;
+  snprintf ( buf, size, "%sGGA,%02ld%02ld%02ld.000,%02d%08.5f,%c,%03d%08.5f,%c,1,%02ld,0.9,%.1f,M,47.0,M,,", talker,
+             i / 3600 % 24, i / 60 % 60, i % 60, (int) alat, ( alat - (int) alat ) * 60, lat < 0 ? 'S' : 'N',
+             (int) alon, ( alon - (int) alon ) * 60, lon < 0 ? 'W' : 'E', 4 + i % 9, 30.0 + i % 100 / 10.0 ) ;
+  }
+
+
+// Make up the streams.
+static void
+bench_streams ( stream_t* s, long n )
+  {
+  static const char* const talkers[] = { "GP", "GN", "GL", "GA", "BD", "GQ" } ;
+  char body[512] ;
+  char noise[40] ;
+  long i ;
+  int j ;
+  memset ( s, 0, 4 * sizeof ( *s ) ) ;
+  s[0].name = "gga" ;
+  s[1].name = "corrupt" ;
+  s[2].name = "overlong" ;
+  s[3].name = "mixed" ;
+  srand ( 1 ) ;
+  for ( i = 0 ; i < n ; i++ )
+    {
+    bench_gga ( body, sizeof ( body ), "GP", i ) ;
+    bench_add ( &s[0], body, 1 ) ;
+    switch ( i % 4 )
+      {
+      case 0 :
+        bench_add ( &s[1], body, 1 ) ;
+        break ;
+      case 1 :
+        bench_add ( &s[1], body, 0 ) ;
+        break ;
+      case 2 :
+        for ( j = 0 ; j < (int) sizeof ( noise ) ; j++ ) noise[j] = 32 + rand ( ) % 95 ;
+        bench_noise ( &s[1], noise, sizeof ( noise ) ) ;
+        bench_add ( &s[1], body, 1 ) ;
+        break ;
+      default :
+        bench_noise ( &s[1], "$", 1 ) ;
+        bench_noise ( &s[1], body, strlen ( body ) / 2 ) ;
+        s[1].count++ ;
+        break ;
+      }
+    if ( i % 2 )
+      {
+      memset ( body, 'X', 300 ) ;
+      memcpy ( body, "GPTXT,01,01,02,", 15 ) ;
+      body[300] = '\0' ;
+      }
+    bench_add ( &s[2], body, 1 ) ;
+    }
+  for ( i = 0 ; i < n / 5 ; i++ )
+    {
+    const char* t = talkers[i%6] ;
+    bench_gga ( body, sizeof ( body ), t, i ) ;
+    bench_add ( &s[3], body, 1 ) ;
+    snprintf ( body, sizeof ( body ), "%sRMC,%02ld%02ld%02ld.000,A,5130.00000,N,00112.00000,W,3.1,45.0,160926,,,A", t, i / 3600 % 24,
+               i / 60 % 60, i % 60 ) ;
+    bench_add ( &s[3], body, 1 ) ;
+    snprintf ( body, sizeof ( body ), "%sGSA,A,3,04,05,09,12,,,,,,,,,1.8,0.9,1.5", t ) ;
+    bench_add ( &s[3], body, 1 ) ;
+    snprintf ( body, sizeof ( body ), "%sVTG,45.0,T,,M,3.1,N,5.7,K,A", t ) ;
+    bench_add ( &s[3], body, 1 ) ;
+    snprintf ( body, sizeof ( body ), "%sGSV,3,1,11,04,68,120,45,05,22,310,38,09,40,080,41,12,15,200,33", t ) ;
+    bench_add ( &s[3], body, 1 ) ;
+    }
+  }
+
+
+// Frame a stream, in read sized lumps.
+static long
+run_frame ( const void* arg )
+  {
+  const stream_t* s = arg ;
+  nmea_framer_t fr ;
+  const char* sentence ;
+  const char* p ;
+  size_t left, n, used ;
+  int slen ;
+  long found = 0 ;
+  nmea_init ( &fr, NMEA_CHECK_PRESENT ) ;
+  for ( p = s->data, left = s->len ; left > 0 ; p += n, left -= n )
+    {
+    n = ( left < BENCH_READ ) ? left : BENCH_READ ;
+    const char* q = p ;
+    size_t m = n ;
+    while ( m > 0 )
+      {
+      used = nmea_frame ( &fr, q, m, &sentence, &slen ) ;
+      q += used ;
+      m -= used ;
+      found += ( sentence != NULL ) ;
+      }
+    }
+  sink = found ;
+  return s->count ;
+  }
+
+
+// Frame and parse a stream, the whole reader.
+static long
+run_read ( const void* arg )
+  {
+  const stream_t* s = arg ;
+  gpsread_t rd ;
+  const char* p ;
+  size_t left, n ;
+  gpsread_init ( &rd, NULL, NULL ) ;
+  for ( p = s->data, left = s->len ; left > 0 ; p += n, left -= n )
+    {
+    n = ( left < BENCH_READ ) ? left : BENCH_READ ;
+    gpsread_push ( &rd, p, n ) ;
+    }
+  sink = rd.stats.fixes ;
+  return s->count ;
+  }
+
+
+// Parse GGA sentences already framed.
+static long
+run_gga ( const void* arg )
+  {
+  const fixes_t* f = arg ;
+  gpsfix_t fix ;
+  size_t i ;
+  long good = 0 ;
+  gpsfix_init ( &fix ) ;
+  for ( i = 0 ; i < f->n ; i++ ) good += nmea_gga ( f->sentence[i], f->slen[i], &fix ) ;
+  sink = good + fix.lat ;
+  return f->n ;
+  }
+
+
+// OSGB, a point at a time.
+static long
+run_osgb ( const void* arg )
+  {
+  const fixes_t* f = arg ;
+  size_t i ;
+  for ( i = 0 ; i < f->n ; i++ ) LLtoOSGB ( f->lat[i], f->lon[i], f->z[i], &f->e[i], &f->north[i] ) ;
+  sink = f->e[f->n-1] ;
+  return f->n ;
+  }
+
+
+// OSGB, all at once.
+static long
+run_osgbv ( const void* arg )
+  {
+  const fixes_t* f = arg ;
+  LLtoOSGBv ( f->n, f->lat, f->lon, f->z, f->e, f->north ) ;
+  sink = f->e[f->n-1] ;
+  return f->n ;
+  }
+
+
+// Maidenhead, a point at a time.
+static long
+run_mhead ( const void* arg )
+  {
+  const fixes_t* f = arg ;
+  size_t i ;
+  for ( i = 0 ; i < f->n ; i++ ) LLtoMaidenhead ( f->lat[i], f->lon[i], 6, f->loc + 7 * i ) ;
+  sink = f->loc[0] ;
+  return f->n ;
+  }
+
+
+// Maidenhead, all at once.
+static long
+run_mheadv ( const void* arg )
+  {
+  const fixes_t* f = arg ;
+  LLtoMaidenheadv ( f->n, f->lat, f->lon, 6, f->loc ) ;
+  sink = f->loc[0] ;
+  return f->n ;
+  }
+
+
+// Format every fix in some units.
+static long
+run_format ( const void* arg )
+  {
+  const formatter_t* fm = arg ;
+  char buf[FORMAT_MAX] ;
+  size_t i ;
+  long bytes = 0 ;
+  for ( i = 0 ; i < fm->fixes->n ; i++ ) bytes += format_fix ( buf, sizeof ( buf ), &fm->fixes->fix[i], &fm->fmt ) ;
+  sink = bytes ;
+  return fm->fixes->n ;
+  }
+
+
+// Run a benchmark for long enough, and report on it. bytes is how much goes in or out each run, 0 if it's not a stream.
+static void
+bench ( const char* name, const char* unit, long ( *run ) ( const void* ), const void* arg, size_t bytes )
+  {
+  double start, took ;
+  long items = 0, runs = 0 ;
+  // Once to warm the caches.
+  run ( arg ) ;
+  start = bench_now ( ) ;
+  do
+    {
+    items += run ( arg ) ;
+    runs++ ;
+    took = bench_now ( ) - start ;
+    }
+  while ( took < mintime ) ;
+  printf ( "{\"name\":\"%s\",\"unit\":\"%s\",\"items\":%ld,\"seconds\":%.6f,\"ns_per_item\":%.3f", name, unit, items, took,
+           took * 1e9 / items ) ;
+  if ( bytes ) printf ( ",\"mb_per_s\":%.2f", bytes * (double) runs / took / 1e6 ) ;
+  else printf ( ",\"mb_per_s\":null" ) ;
+  printf ( "}\n" ) ;
+  fprintf ( stderr, "%-20s %10.1f ns/%-9s", name, took * 1e9 / items, unit ) ;
+  if ( bytes ) fprintf ( stderr, " %10.1f MB/s", bytes * (double) runs / took / 1e6 ) ;
+  fprintf ( stderr, "\n" ) ;
+  }
+
+
+// Collect the fixes from the good GGA stream, with their sentences.
+static void
+collect ( const stream_t* s, fixes_t* f )
+  {
+  nmea_framer_t fr ;
+  const char* sentence ;
+  const char* p = s->data ;
+  size_t left = s->len, used ;
+  int slen ;
+  memset ( f, 0, sizeof ( *f ) ) ;
+  f->fix = calloc ( s->count, sizeof ( gpsfix_t ) ) ;
+  f->lat = calloc ( s->count, sizeof ( double ) ) ;
+  f->lon = calloc ( s->count, sizeof ( double ) ) ;
+  f->z = calloc ( s->count, sizeof ( *f->z ) ) ;
+  f->e = calloc ( s->count, sizeof ( long ) ) ;
+  f->north = calloc ( s->count, sizeof ( long ) ) ;
+  f->loc = calloc ( s->count, MHEAD_MAXLEN + 1 ) ;
+  f->sentence = calloc ( s->count, sizeof ( char* ) ) ;
+  f->slen = calloc ( s->count, sizeof ( int ) ) ;
+  if ( !f->fix || !f->lat || !f->lon || !f->z || !f->e || !f->north || !f->loc || !f->sentence || !f->slen )
+    {
+    perror ( "bench" ) ;
+    exit ( EXIT_FAILURE ) ;
+    }
+  nmea_init ( &fr, NMEA_CHECK_PRESENT ) ;
+  // The whole stream's in one block, so sentences point straight into it.
+  while ( left > 0 && f->n < (size_t) s->count )
+    {
+    used = nmea_frame ( &fr, p, left, &sentence, &slen ) ;
+    p += used ;
+    left -= used ;
+    if ( sentence == NULL ) continue ;
+    gpsfix_init ( &f->fix[f->n] ) ;
+    if ( !nmea_gga ( sentence, slen, &f->fix[f->n] ) ) continue ;
+    f->fix[f->n].raw = sentence ;
+    f->fix[f->n].rawlen = slen ;
+    f->sentence[f->n] = sentence ;
+    f->slen[f->n] = slen ;
+    f->lat[f->n] = fix_degrees ( f->fix[f->n].lat ) ;
+    f->lon[f->n] = fix_degrees ( f->fix[f->n].lon ) ;
+    f->n++ ;
+    }
+  }
+
+
+// Show usage info.
+static void
+usage ( const char* appname )
+  {
+  printf ( "Usage: %s [-n sentences] [-t seconds]\n", appname ) ;
+  printf ( "\t-n,--sentences In each made up stream. Default %d\n", BENCH_SENTENCES ) ;
+  printf ( "\t-t,--time      Least seconds to spend on each benchmark. Default %g\n", BENCH_SECONDS ) ;
+  }
+
+
+// Make up the streams, then time everything over them.
+int
+main ( int argc, char* argv[] )
+  {
+  static struct option long_options[] =
+    {
+      { "help",      no_argument,       0,  'h' },
+      { "sentences", required_argument, 0,  'n' },
+      { "time",      required_argument, 0,  't' },
+      { 0, 0, 0, 0 }
+    } ;
+  stream_t streams[4] ;
+  fixes_t fixes ;
+  formatter_t fm ;
+  char name[64] ;
+  char grid[] = "/tmp/gpsbenchXXXXXX" ;
+  long count = BENCH_SENTENCES ;
+  int opt, i, fd ;
+  while ( ( opt = getopt_long ( argc, argv, "hn:t:", long_options, NULL ) ) != -1 )
+    {
+    switch ( opt )
+      {
+      case 'n' :
+        count = strtol ( optarg, NULL, 10 ) ;
+        break ;
+      case 't' :
+        mintime = strtod ( optarg, NULL ) ;
+        break ;
+      case 'h' :
+        usage ( argv[0] ) ;
+        return EXIT_SUCCESS ;
+      default :
+        usage ( argv[0] ) ;
+        return EXIT_FAILURE ;
+      }
+    }
+  if ( count < 5 || mintime <= 0 )
+    {
+    usage ( argv[0] ) ;
+    return EXIT_FAILURE ;
+    }
+  printf ( "{\"name\":\"gpsread\",\"version\":\"%s\",\"sentences\":%ld,\"seconds\":%g}\n", STR(VERSION), count, mintime ) ;
+  bench_streams ( streams, count ) ;
+  // Framing, then the whole reader, over each stream.
+  for ( i = 0 ; i < 4 ; i++ )
+    {
+    snprintf ( name, sizeof ( name ), "frame/%s", streams[i].name ) ;
+    bench ( name, "sentence", run_frame, &streams[i], streams[i].len ) ;
+    }
+  for ( i = 0 ; i < 4 ; i++ )
+    {
+    snprintf ( name, sizeof ( name ), "read/%s", streams[i].name ) ;
+    bench ( name, "sentence", run_read, &streams[i], streams[i].len ) ;
+    }
+  // Parsing, and conversions, on the good fixes.
+  collect ( &streams[0], &fixes ) ;
+  bench ( "parse/gga", "sentence", run_gga, &fixes, streams[0].len ) ;
+  bench ( "osgb", "point", run_osgb, &fixes, 0 ) ;
+  bench ( "osgb/batch", "point", run_osgbv, &fixes, 0 ) ;
+  // And again shifted onto OSGB36, with a grid made for the purpose.
+  if ( ( fd = mkstemp ( grid ) ) >= 0 )
+    {
+    close ( fd ) ;
+    if ( osgb_datum_build ( grid ) == 0 && osgb_datum_open ( grid ) == 0 )
+      {
+      bench ( "osgb/datum", "point", run_osgb, &fixes, 0 ) ;
+      bench ( "osgb/datum/batch", "point", run_osgbv, &fixes, 0 ) ;
+      osgb_datum_close ( ) ;
+      }
+    unlink ( grid ) ;
+    }
+  bench ( "mhead", "point", run_mhead, &fixes, 0 ) ;
+  bench ( "mhead/batch", "point", run_mheadv, &fixes, 0 ) ;
+  // Each of the units.
+  fm.fixes = &fixes ;
+  fm.fmt.mheadlen = MHEADLEN ;
+  fm.fmt.simplify = 0 ;
+  for ( i = TIME ; i <= GEOJSON ; i++ )
+    {
+    long bytes = 0 ;
+    char buf[FORMAT_MAX] ;
+    size_t j ;
+    fm.fmt.posunit = (posunit_t) i ;
+    for ( j = 0 ; j < fixes.n ; j++ ) bytes += format_fix ( buf, sizeof ( buf ), &fixes.fix[j], &fm.fmt ) ;
+    snprintf ( name, sizeof ( name ), "format/%s", posunit_names[i] ) ;
+    bench ( name, "fix", run_format, &fm, bytes ) ;
+    }
+  return EXIT_SUCCESS ;
+  }
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent
@@ -0,0 +1,155 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    Last-known-fix cache, for quick answers from one-shot runs.                                                                         */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+// Needs clock_gettime().
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include "gpsread.h"
+
+
+// What the cache file starts with. Changes with the layout, so an old file just looks like no cache.
+static const char fixcache_magic[8] = "GPSFIX2" ;
+
+
+// A clock in nanoseconds.
+static int64_t
+fixcache_clock ( clockid_t clock )
+  {
+  struct timespec ts ;
+  clock_gettime ( clock, &ts ) ;
+  return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec ;
+  }
+
+
+// Fill in a record from a fix, stamped with the time now.
+void
+fixcache_pack ( fixcache_t* cache, const gpsfix_t* fix )
+  {
+  memset ( cache, 0, sizeof ( *cache ) ) ;
+  memcpy ( cache->magic, fixcache_magic, sizeof ( cache->magic ) ) ;
+  cache->realtime = fixcache_clock ( CLOCK_REALTIME ) ;
+  cache->monotonic = fixcache_clock ( CLOCK_MONOTONIC ) ;
+  cache->utc = fix->utc ;
+  cache->lat = fix->lat ;
+  cache->lon = fix->lon ;
+  cache->alt = fix->alt ;
+  cache->hdop = fix->hdop ;
+  cache->quality = fix->quality ;
+  cache->sats = fix->sats ;
+  cache->date = fix->date ;
+  cache->speed = fix->speed ;
+  cache->course = fix->course ;
+  cache->pdop = fix->pdop ;
+  cache->vdop = fix->vdop ;
+  cache->mode = fix->mode ;
+  cache->rawlen = ( fix->rawlen < (int) sizeof ( cache->raw ) ) ? fix->rawlen : (int) sizeof ( cache->raw ) - 1 ;
+  memcpy ( cache->raw, fix->raw, cache->rawlen ) ;
+  }
+
+
+// Get the fix back out of a record. fix->raw points into cache.
+// Returns 0, or -1 if it's not a good record.
+int
+fixcache_unpack ( const fixcache_t* cache, gpsfix_t* fix )
+  {
+  if ( memcmp ( cache->magic, fixcache_magic, sizeof ( cache->magic ) ) ) return -1 ;
+  if ( cache->rawlen < 0 || cache->rawlen >= (int32_t) sizeof ( cache->raw ) ) return -1 ;
+  gpsfix_init ( fix ) ;
+  fix->utc = cache->utc ;
+  fix->lat = cache->lat ;
+  fix->lon = cache->lon ;
+  fix->alt = cache->alt ;
+  fix->hdop = cache->hdop ;
+  fix->quality = cache->quality ;
+  fix->sats = cache->sats ;
+  fix->date = cache->date ;
+  fix->speed = cache->speed ;
+  fix->course = cache->course ;
+  fix->pdop = cache->pdop ;
+  fix->vdop = cache->vdop ;
+  fix->mode = cache->mode ;
+  fix->rawlen = cache->rawlen ;
+  fix->raw = cache->raw ;
+  return 0 ;
+  }
+
+
+// How old a record is, in seconds.
+// The age is from the monotonic clock, and has to agree with the real-time clock, so a record from before a reboot doesn't look new.
+// Returns -1 if it doesn't.
+double
+fixcache_age ( const fixcache_t* cache )
+  {
+  int64_t age = fixcache_clock ( CLOCK_MONOTONIC ) - cache->monotonic ;
+  int64_t realage = fixcache_clock ( CLOCK_REALTIME ) - cache->realtime ;
+  if ( age < 0 || realage - age > 2000000000LL || age - realage > 2000000000LL ) return -1 ;
+  return age / 1e9 ;
+  }
+
+
+// Save a fix, stamped with the time now.
+// Written to a temporary file then renamed over the old one, so readers only ever see a whole record. Returns 0, or -1 with errno set.
+int
+fixcache_save ( const char* path, const gpsfix_t* fix )
+  {
+  fixcache_t cache ;
+  char tmp[4096] ;
+  int fd, err ;
+  fixcache_pack ( &cache, fix ) ;
+  if ( snprintf ( tmp, sizeof ( tmp ), "%s.%d", path, (int) getpid ( ) ) >= (int) sizeof ( tmp ) )
+    {
+    errno = ENAMETOOLONG ;
+    return -1 ;
+    }
+  fd = open ( tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644 ) ;
+  if ( fd < 0 ) return -1 ;
+  if ( write ( fd, &cache, sizeof ( cache ) ) != sizeof ( cache ) ) goto fail ;
+  if ( close ( fd ) < 0 )
+    {
+    fd = -1 ;
+    goto fail ;
+    }
+  if ( rename ( tmp, path ) < 0 )
+    {
+    fd = -1 ;
+    goto fail ;
+    }
+  return 0 ;
+fail :
+  err = errno ;
+  if ( fd >= 0 ) close ( fd ) ;
+  unlink ( tmp ) ;
+  errno = ( err == 0 ) ? EIO : err ;
+  return -1 ;
+  }
+
+
+// Load the cached fix, if it's no older than maxage seconds.
+// fix->raw points into cache. Returns 1 if it's fresh enough, 0 if it's stale, missing or not a cache file.
+int
+fixcache_load ( const char* path, double maxage, fixcache_t* cache, gpsfix_t* fix )
+  {
+  int fd ;
+  ssize_t got ;
+  double age ;
+  fd = open ( path, O_RDONLY ) ;
+  if ( fd < 0 ) return 0 ;
+  got = read ( fd, cache, sizeof ( *cache ) ) ;
+  close ( fd ) ;
+  if ( got != sizeof ( *cache ) || fixcache_unpack ( cache, fix ) < 0 ) return 0 ;
+  age = fixcache_age ( cache ) ;
+  return ( age >= 0 && age <= maxage ) ;
+  }
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent
@@ -0,0 +1,34 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    Work out the WGS84 to OSGB36 correction grid at build time, without the app or its config files.                                    */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+// Built with the host's compiler from just this and osgb.c, so cross-compiling still gets a grid, and nothing needs libconfuse. The grid
+// is the same either way, it's only int16_t shifts in native byte order, so host and target have to agree on that.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "gpsread.h"
+
+
+int
+main ( int argc, char* argv[] )
+  {
+  if ( argc != 2 )
+    {
+    fprintf ( stderr, "Usage: %s grid\n", argv[0] ) ;
+    return EXIT_FAILURE ;
+    }
+  if ( osgb_datum_build ( argv[1] ) < 0 )
+    {
+    perror ( argv[1] ) ;
+    return EXIT_FAILURE ;
+    }
+  return EXIT_SUCCESS ;
+  }
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent
@@ -0,0 +1,331 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    Geofences, raising enter and exit events as fixes cross polygon boundaries.                                                         */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+// Fences are loaded into flat arrays of vertices, each polygon closed by repeating its first vertex. A uniform grid over all of them
+// lists, for each cell, the fences whose bounding box touches it, so a fix only looks at the few near it. Those get a bounding box
+// check, then a crossing number test done several edges at a time. The fences a fix is inside are compared with the ones the last fix
+// was inside, for the events.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+// Wide compares, where there are any.
+#if defined ( __SSE2__ )
+  #include <immintrin.h>
+#endif
+#include "gpsread.h"
+
+
+// Most cells in the grid, each way.
+#define GEOFENCE_GRID 1024
+
+
+// Add to a growing array. Returns 0, or -1 if it ran out of memory.
+static int
+geofence_grow ( void** p, size_t* size, size_t need, size_t each )
+  {
+  void* bigger ;
+  size_t n ;
+  if ( need <= *size ) return 0 ;
+  n = *size * 2 + need + 16 ;
+  bigger = realloc ( *p, n * each ) ;
+  if ( bigger == NULL ) return -1 ;
+  *p = bigger ;
+  *size = n ;
+  return 0 ;
+  }
+
+
+// Read one fence from a line: a name, then lat,lon for each corner. Returns 1 if there was one, 0 for a blank line, -1 if it's bad.
+static int
+geofence_line ( geofence_t* gf, char* line, size_t* sizes )
+  {
+  char* save ;
+  char* tok ;
+  char* name ;
+  double lat, lon ;
+  size_t start = gf->nvertices ;
+  int n ;
+  if ( ( tok = strchr ( line, '#' ) ) != NULL ) *tok = '\0' ;
+  if ( ( name = strtok_r ( line, " \t\r\n", &save ) ) == NULL ) return 0 ;
+  while ( ( tok = strtok_r ( NULL, " \t\r\n", &save ) ) != NULL )
+    {
+    if ( sscanf ( tok, "%lf,%lf%n", &lat, &lon, &n ) != 2 || tok[n] || fabs ( lat ) > 90 || fabs ( lon ) > 180 ) return -1 ;
+    if ( geofence_grow ( (void**) &gf->x, &sizes[0], gf->nvertices + 2, sizeof ( double ) ) < 0 ||
+         geofence_grow ( (void**) &gf->y, &sizes[1], gf->nvertices + 2, sizeof ( double ) ) < 0 ) return -1 ;
+    gf->x[gf->nvertices] = lon ;
+    gf->y[gf->nvertices] = lat ;
+    gf->nvertices++ ;
+    }
+  if ( gf->nvertices - start < 3 ) return -1 ;
+  // Close it.
+  gf->x[gf->nvertices] = gf->x[start] ;
+  gf->y[gf->nvertices] = gf->y[start] ;
+  gf->nvertices++ ;
+  if ( geofence_grow ( (void**) &gf->fence, &sizes[2], gf->n + 1, sizeof ( geofence_poly_t ) ) < 0 ) return -1 ;
+  memset ( &gf->fence[gf->n], 0, sizeof ( geofence_poly_t ) ) ;
+  if ( ( gf->fence[gf->n].name = strdup ( name ) ) == NULL ) return -1 ;
+  gf->fence[gf->n].start = start ;
+  gf->fence[gf->n].count = gf->nvertices - start ;
+  gf->n++ ;
+  return 1 ;
+  }
+
+
+// Which cell a point's in, clamped to the grid.
+static int
+geofence_cell ( const geofence_t* gf, double x, double y, int* cx, int* cy )
+  {
+  *cx = (int) floor ( ( x - gf->x0 ) / gf->cw ) ;
+  *cy = (int) floor ( ( y - gf->y0 ) / gf->ch ) ;
+  if ( *cx < 0 ) *cx = 0 ;
+  if ( *cx >= gf->gx ) *cx = gf->gx - 1 ;
+  if ( *cy < 0 ) *cy = 0 ;
+  if ( *cy >= gf->gy ) *cy = gf->gy - 1 ;
+  return *cy * gf->gx + *cx ;
+  }
+
+
+// Bounding boxes, and the grid over them. Returns 0, or -1 if it ran out of memory.
+static int
+geofence_index ( geofence_t* gf )
+  {
+  double minx = 180, maxx = -180, miny = 90, maxy = -90 ;
+  geofence_poly_t* f ;
+  size_t i, j, total ;
+  int x0, y0, x1, y1, cx, cy, side ;
+  for ( i = 0 ; i < gf->n ; i++ )
+    {
+    f = &gf->fence[i] ;
+    f->minx = f->maxx = gf->x[f->start] ;
+    f->miny = f->maxy = gf->y[f->start] ;
+    for ( j = f->start ; j < f->start + f->count ; j++ )
+      {
+      if ( gf->x[j] < f->minx ) f->minx = gf->x[j] ;
+      if ( gf->x[j] > f->maxx ) f->maxx = gf->x[j] ;
+      if ( gf->y[j] < f->miny ) f->miny = gf->y[j] ;
+      if ( gf->y[j] > f->maxy ) f->maxy = gf->y[j] ;
+      }
+    if ( f->minx < minx ) minx = f->minx ;
+    if ( f->maxx > maxx ) maxx = f->maxx ;
+    if ( f->miny < miny ) miny = f->miny ;
+    if ( f->maxy > maxy ) maxy = f->maxy ;
+    }
+  // About four fences to a cell, if they're spread out.
+  side = (int) ceil ( sqrt ( gf->n / 4.0 ) ) ;
+  if ( side < 1 ) side = 1 ;
+  if ( side > GEOFENCE_GRID ) side = GEOFENCE_GRID ;
+  gf->gx = gf->gy = side ;
+  gf->x0 = minx ;
+  gf->y0 = miny ;
+  gf->cw = ( maxx > minx ) ? ( maxx - minx ) / side : 1 ;
+  gf->ch = ( maxy > miny ) ? ( maxy - miny ) / side : 1 ;
+  // Count the fences in each cell, then fill them in.
+  gf->cellstart = calloc ( (size_t) side * side + 1, sizeof ( uint32_t ) ) ;
+  if ( gf->cellstart == NULL ) return -1 ;
+  for ( i = 0 ; i < gf->n ; i++ )
+    {
+    f = &gf->fence[i] ;
+    geofence_cell ( gf, f->minx, f->miny, &x0, &y0 ) ;
+    geofence_cell ( gf, f->maxx, f->maxy, &x1, &y1 ) ;
+    for ( cy = y0 ; cy <= y1 ; cy++ ) for ( cx = x0 ; cx <= x1 ; cx++ ) gf->cellstart[cy*side+cx+1]++ ;
+    }
+  for ( i = 0 ; i < (size_t) side * side ; i++ ) gf->cellstart[i+1] += gf->cellstart[i] ;
+  total = gf->cellstart[(size_t) side * side] ;
+  gf->cells = malloc ( ( total + 1 ) * sizeof ( uint32_t ) ) ;
+  gf->fill = calloc ( (size_t) side * side, sizeof ( uint32_t ) ) ;
+  gf->state = calloc ( gf->n + 1, sizeof ( uint32_t ) ) ;
+  gf->inside = malloc ( ( gf->n + 1 ) * sizeof ( uint32_t ) ) ;
+  gf->now = malloc ( ( gf->n + 1 ) * sizeof ( uint32_t ) ) ;
+  if ( gf->cells == NULL || gf->fill == NULL || gf->state == NULL || gf->inside == NULL || gf->now == NULL ) return -1 ;
+  for ( i = 0 ; i < gf->n ; i++ )
+    {
+    f = &gf->fence[i] ;
+    geofence_cell ( gf, f->minx, f->miny, &x0, &y0 ) ;
+    geofence_cell ( gf, f->maxx, f->maxy, &x1, &y1 ) ;
+    for ( cy = y0 ; cy <= y1 ; cy++ ) for ( cx = x0 ; cx <= x1 ; cx++ )
+      {
+      j = cy * side + cx ;
+      gf->cells[gf->cellstart[j]+gf->fill[j]++] = i ;
+      }
+    }
+  return 0 ;
+  }
+
+
+// Load fences from a file, one to a line: a name with no spaces, then at least three lat,lon corners in decimal degrees, eg.
+//   depot 51.501,-0.142 51.502,-0.140 51.500,-0.139
+// '#' starts a comment. Returns 0, or -1 with errno set, and line set to the bad one if it's EINVAL.
+int
+geofence_load ( geofence_t* gf, const char* path, int* line )
+  {
+  FILE* fp ;
+  char* buf = NULL ;
+  size_t bufsize = 0 ;
+  size_t sizes[3] = { 0, 0, 0 } ;
+  int err ;
+  memset ( gf, 0, sizeof ( *gf ) ) ;
+  *line = 0 ;
+  if ( ( fp = fopen ( path, "r" ) ) == NULL ) return -1 ;
+  while ( getline ( &buf, &bufsize, fp ) >= 0 )
+    {
+    ++*line ;
+    errno = 0 ;
+    if ( geofence_line ( gf, buf, sizes ) < 0 )
+      {
+      err = errno ? errno : EINVAL ;
+      free ( buf ) ;
+      fclose ( fp ) ;
+      geofence_free ( gf ) ;
+      errno = err ;
+      return -1 ;
+      }
+    }
+  free ( buf ) ;
+  fclose ( fp ) ;
+  *line = 0 ;
+  if ( geofence_index ( gf ) < 0 )
+    {
+    geofence_free ( gf ) ;
+    errno = ENOMEM ;
+    return -1 ;
+    }
+  return 0 ;
+  }
+
+
+// Done with them.
+void
+geofence_free ( geofence_t* gf )
+  {
+  size_t i ;
+  for ( i = 0 ; i < gf->n ; i++ ) free ( gf->fence[i].name ) ;
+  free ( gf->fence ) ;
+  free ( gf->x ) ;
+  free ( gf->y ) ;
+  free ( gf->cellstart ) ;
+  free ( gf->cells ) ;
+  free ( gf->fill ) ;
+  free ( gf->state ) ;
+  free ( gf->inside ) ;
+  free ( gf->now ) ;
+  memset ( gf, 0, sizeof ( *gf ) ) ;
+  }
+
+
+// Is a point inside a closed polygon of n-1 edges? Count the edges crossing a ray to the east. An edge crosses if its ends are either
+// side of the point, and the point's on the side of it that makes the ray hit it. Both are compares, so 4 or 2 edges at a time.
+static int
+geofence_pip ( const double* x, const double* y, size_t n, double px, double py )
+  {
+  size_t i = 0 ;
+  double dy, d ;
+  int c = 0 ;
+#if defined ( __AVX__ )
+  const __m256d px4 = _mm256_set1_pd ( px ), py4 = _mm256_set1_pd ( py ), zero4 = _mm256_setzero_pd ( ) ;
+  __m256d x0, x1, y0, y1, dy4, d4, straddle, side ;
+  for ( ; i + 4 < n ; i += 4 )
+    {
+    x0 = _mm256_loadu_pd ( x + i ) ;
+    x1 = _mm256_loadu_pd ( x + i + 1 ) ;
+    y0 = _mm256_loadu_pd ( y + i ) ;
+    y1 = _mm256_loadu_pd ( y + i + 1 ) ;
+    dy4 = _mm256_sub_pd ( y1, y0 ) ;
+    d4 = _mm256_sub_pd ( _mm256_mul_pd ( _mm256_sub_pd ( x1, x0 ), _mm256_sub_pd ( py4, y0 ) ), _mm256_mul_pd ( _mm256_sub_pd ( px4, x0 ), dy4 ) ) ;
+    straddle = _mm256_xor_pd ( _mm256_cmp_pd ( y0, py4, _CMP_GT_OQ ), _mm256_cmp_pd ( y1, py4, _CMP_GT_OQ ) ) ;
+    side = _mm256_xor_pd ( _mm256_cmp_pd ( d4, zero4, _CMP_GT_OQ ), _mm256_cmp_pd ( dy4, zero4, _CMP_GT_OQ ) ) ;
+    c += __builtin_popcount ( _mm256_movemask_pd ( _mm256_andnot_pd ( side, straddle ) ) ) ;
+    }
+#endif
+#if defined ( __SSE2__ )
+  const __m128d px2 = _mm_set1_pd ( px ), py2 = _mm_set1_pd ( py ), zero2 = _mm_setzero_pd ( ) ;
+  __m128d a0, a1, b0, b1, dy2, d2, straddle2, side2 ;
+  for ( ; i + 2 < n ; i += 2 )
+    {
+    a0 = _mm_loadu_pd ( x + i ) ;
+    a1 = _mm_loadu_pd ( x + i + 1 ) ;
+    b0 = _mm_loadu_pd ( y + i ) ;
+    b1 = _mm_loadu_pd ( y + i + 1 ) ;
+    dy2 = _mm_sub_pd ( b1, b0 ) ;
+    d2 = _mm_sub_pd ( _mm_mul_pd ( _mm_sub_pd ( a1, a0 ), _mm_sub_pd ( py2, b0 ) ), _mm_mul_pd ( _mm_sub_pd ( px2, a0 ), dy2 ) ) ;
+    straddle2 = _mm_xor_pd ( _mm_cmpgt_pd ( b0, py2 ), _mm_cmpgt_pd ( b1, py2 ) ) ;
+    side2 = _mm_xor_pd ( _mm_cmpgt_pd ( d2, zero2 ), _mm_cmpgt_pd ( dy2, zero2 ) ) ;
+    c += __builtin_popcount ( _mm_movemask_pd ( _mm_andnot_pd ( side2, straddle2 ) ) ) ;
+    }
+#endif
+  for ( ; i + 1 < n ; i++ )
+    {
+    dy = y[i+1] - y[i] ;
+    d = ( x[i+1] - x[i] ) * ( py - y[i] ) - ( px - x[i] ) * dy ;
+    c += ( ( y[i] > py ) != ( y[i+1] > py ) ) & ( ( d > 0 ) == ( dy > 0 ) ) ;
+    }
+  return c & 1 ;
+  }
+
+
+// Check a fix against the fences, calling onevent for each one it's gone into or out of since the last. Returns how many events.
+int
+geofence_check ( geofence_t* gf, const gpsfix_t* fix, geofence_cb onevent, void* user )
+  {
+  double px = fix_degrees ( fix->lon ), py = fix_degrees ( fix->lat ) ;
+  const geofence_poly_t* f ;
+  size_t i, nnow = 0, ninside = 0 ;
+  uint32_t k, cell, id ;
+  int cx, cy, events = 0 ;
+  if ( gf->n == 0 ) return 0 ;
+  // Stamps, so nothing needs clearing between fixes. Odd for inside now, even for seen before.
+  gf->epoch += 2 ;
+  if ( gf->epoch < 2 )
+    {
+    memset ( gf->state, 0, gf->n * sizeof ( uint32_t ) ) ;
+    gf->epoch = 2 ;
+    }
+  // Off the grid there's nothing to be inside.
+  if ( px >= gf->x0 && py >= gf->y0 && px <= gf->x0 + gf->cw * gf->gx && py <= gf->y0 + gf->ch * gf->gy )
+    {
+    cell = geofence_cell ( gf, px, py, &cx, &cy ) ;
+    for ( k = gf->cellstart[cell] ; k < gf->cellstart[cell+1] ; k++ )
+      {
+      id = gf->cells[k] ;
+      f = &gf->fence[id] ;
+      if ( px < f->minx || px > f->maxx || py < f->miny || py > f->maxy ) continue ;
+      if ( !geofence_pip ( gf->x + f->start, gf->y + f->start, f->count, px, py ) ) continue ;
+      gf->now[nnow++] = id ;
+      gf->state[id] = gf->epoch + 1 ;
+      }
+    }
+  // Gone out of any?
+  for ( i = 0 ; i < gf->ninside ; i++ )
+    {
+    id = gf->inside[i] ;
+    if ( gf->state[id] == gf->epoch + 1 ) continue ;
+    events++ ;
+    if ( onevent ) onevent ( fix, gf->fence[id].name, 0, user ) ;
+    }
+  // Gone into any? Those that were in before have last time's stamp.
+  for ( i = 0 ; i < gf->ninside ; i++ ) if ( gf->state[gf->inside[i]] == gf->epoch + 1 ) gf->state[gf->inside[i]] = gf->epoch ;
+  for ( i = 0 ; i < nnow ; i++ )
+    {
+    id = gf->now[i] ;
+    if ( gf->state[id] == gf->epoch ) gf->state[id] = gf->epoch + 1 ;
+    else
+      {
+      events++ ;
+      if ( onevent ) onevent ( fix, gf->fence[id].name, 1, user ) ;
+      }
+    gf->inside[ninside++] = id ;
+    }
+  gf->ninside = ninside ;
+  return events ;
+  }
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent
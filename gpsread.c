@@ -28,10 +28,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
-// Trig functions.
-#include <math.h>
-// For serial comms.
-#include <fcntl.h>
+// For baud rates.
 #include <termios.h>
 // For basename()
 #include <libgen.h>
@@ -41,8 +38,15 @@
 #include <confuse.h>
 // For timeouts.
 #include <signal.h>
+// For the stats file.
+#include <fcntl.h>
+#include <errno.h>
 // Required by strtol()
 #include <limits.h>
+// For timegm()
+#include <time.h>
+#include <math.h>
+#include <ctype.h>
 // Compile-time defults.
 #include "gpsread.h"
 
@@ -52,114 +56,166 @@
 #define _STR(S) #S
 
 
-// Die if we hit the timeout.
+// The GPS devices being read, if any, the latency of what's been shown from them, and where to write stats about them.
+static gpsmerge_t* reading = NULL ;
+static gpsstats_t latency ;
+static char* statsfile = NULL ;
+
+// The simplifier holding back fixes from them, if there is one, to be let go on the way out.
+static gpssimplify_t* simplifying = NULL ;
+
+// Set by signals, for the read loop to act on. Exiting from the handler could catch the archive or output half way through a write.
+static volatile sig_atomic_t stopping = 0 ;
+static volatile sig_atomic_t timedout = 0 ;
+
+// Write out the stats, to the stats file, or stderr if there isn't one or it's "-". Only system calls, so it's fine in a signal handler.
+void
+dump_stats ( void )
+  {
+  gpsstats_t st = latency ;
+  char buf[2048] ;
+  int fd, len, err = errno ;
+  ssize_t put ;
+  if ( reading ) gpsmerge_stats ( reading, &st ) ;
+  len = gpsstats_format ( buf, sizeof ( buf ), &st ) ;
+  if ( len >= (int) sizeof ( buf ) ) len = sizeof ( buf ) - 1 ;
+  if ( statsfile && strcmp ( statsfile, "-" ) ) fd = open ( statsfile, O_WRONLY | O_CREAT | O_TRUNC, 0644 ) ;
+  else fd = STDERR_FILENO ;
+  if ( fd < 0 )
+    {
+    errno = err ;
+    return ;
+    }
+  // Nowhere to moan to if it doesn't all go.
+  put = write ( fd, buf, len ) ;
+  if ( fd != STDERR_FILENO ) close ( fd ) ;
+  (void) put ;
+  errno = err ;
+  }
+
+
+// Say the timeout's been hit, and how far it got, then die.
+void
+timed_out ( void )
+  {
+  gpsstats_t st ;
+  memset ( &st, 0, sizeof ( st ) ) ;
+  if ( reading ) gpsmerge_stats ( reading, &st ) ;
+  if ( simplifying ) gpssimplify_flush ( simplifying ) ;
+  fprintf ( stderr, "Timed out trying to read GPS: %lu bytes, %lu sentences, %lu bad checksums, %lu too long, %lu GGA without a fix.\n",
+            st.bytes, st.sentences, st.badsums, st.overflows, st.invalid ) ;
+  exit ( EXIT_FAILURE ) ;
+  }
+
+
+// Timeouts and stopping just get noted, for the read loop.
 void
 sighandler ( int sig )
   {
   if ( sig == SIGALRM )
     {
-    fprintf ( stderr, "Timed out trying to read GPS.\n" ) ;
-    exit ( EXIT_FAILURE ) ;
+    timedout = 1 ;
+    return ;
     }
+  if ( sig == SIGUSR1 )
+    {
+    dump_stats ( ) ;
+    return ;
+    }
+  // Stopped, so finish off properly.
+  if ( sig == SIGINT || sig == SIGTERM ) stopping = 1 ;
   }
 
 
-// Map a baudrate to a number.
-int
-map_baud ( int br )
-  {
-  switch ( br )
-    {
-    case B50 :
-      return 50 ;
-    case B75 :
-      return 75 ;
-    case B110 :
-      return 110 ;
-    case B134 :
-      return 134 ;
-    case B150 :
-      return 150 ;
-    case B200 :
-      return 200 ;
-    case B300 :
-      return 300 ;
-    case B600 :
-      return 600 ;
-    case B1200 :
-      return 1200 ;
-    case B1800 :
-      return 1800 ;
-    case B2400 :
-      return 2400 ;
-    case B4800 :
-      return 4800 ;
-    case B9600 :
-      return 9600 ;
-    case B19200 :
-      return 19200 ;
-    case B38400 :
-      return 38400 ;
-    default :
-      return -1 ;
-    }
+// The track archive being written, if any. Closed on the way out, however that happens, so it gets its index.
+static trackfile_t* archiving = NULL ;
+
+void
+close_archive ( void )
+  {
+  if ( archiving && trackfile_close ( archiving ) < 0 ) perror ( "Writing track archive" ) ;
+  archiving = NULL ;
   }
 
 
-// Convert and check the baud rate is OK.
+// Where fixes get shown, stdout through a buffer. Written out when full, after each fix when following, and on the way out.
+static fixout_t out ;
+
+void
+close_out ( void )
+  {
+  fixout_close ( &out ) ;
+  }
+
+
+// Make a start on the output, with the units' header line if they have one. Only does anything the first time.
+void
+start_out ( const format_t* fmt )
+  {
+  static int started = 0 ;
+  char header[128] ;
+  if ( started ) return ;
+  started = 1 ;
+  fixout_text ( &out, header, format_header ( header, sizeof ( header ), fmt ) ) ;
+  }
+
+
+// A time for --begin and --end, as milliseconds since 1970. Seconds since 1970, or "YYYY-MM-DD[THH:MM[:SS]]" UTC.
+// Returns 0, or -1 if it's no good.
 int
-valid_baud ( int br )
-  {
-  switch ( br )
-    {
-    case 50 :
-      return B50 ;
-    case 75 :
-      return B75 ;
-    case 110 :
-      return B110 ;
-    case 134 :
-      return B134 ;
-    case 150 :
-      return B150 ;
-    case 200 :
-      return B200 ;
-    case 300 :
-      return B300 ;
-    case 600 :
-      return B600 ;
-    case 1200 :
-      return B1200 ;
-    case 1800 :
-      return B1800 ;
-    case 2400 :
-      return B2400 ;
-    case 4800 :
-      return B4800 ;
-    case 9600 :
-      return B9600 ;
-    case 19200 :
-      return B19200 ;
-    case 38400 :
-      return B38400 ;
-    default :
-      return -1 ;
+parse_when ( const char* value, int64_t* when )
+  {
+  struct tm tm ;
+  char* end ;
+  long long secs ;
+  int n = 0 ;
+  secs = strtoll ( value, &end, 10 ) ;
+  if ( end != value && *end == '\0' )
+    {
+    *when = secs * 1000 ;
+    return 0 ;
     }
+  memset ( &tm, 0, sizeof ( tm ) ) ;
+  if ( sscanf ( value, "%d-%d-%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &n ) != 3 ) return -1 ;
+  if ( value[n] == 'T' || value[n] == ' ' )
+    {
+    value += n + 1 ;
+    n = 0 ;
+    if ( sscanf ( value, "%d:%d%n:%d%n", &tm.tm_hour, &tm.tm_min, &n, &tm.tm_sec, &n ) < 2 ) return -1 ;
+    }
+  if ( value[n] != '\0' ) return -1 ;
+  if ( tm.tm_mon < 1 || tm.tm_mon > 12 || tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_hour > 23 || tm.tm_min > 59 || tm.tm_sec > 60 ) return -1 ;
+  tm.tm_year -= 1900 ;
+  tm.tm_mon -= 1 ;
+  *when = (int64_t) timegm ( &tm ) * 1000 ;
+  return 0 ;
   }
 
 
-// Convert a string to a posuint_t
-posunit_t
-map_posunit ( const char* value )
+// An area for --in, "lat,lon,lat,lon" corners in decimal degrees, or an OSGB square, eg. "TQ" or "TQ38", or geohash prefix.
+// Returns 0, or -1 if it's no good.
+int
+parse_area ( const char* value, gridarea_t* area )
   {
-  if ( !strcasecmp ( value, posunit_names[TIME] ) ) return TIME ;
-  else if ( !strcasecmp ( value, posunit_names[NMEA] ) ) return NMEA ;
-  else if ( !strcasecmp ( value, posunit_names[OSGB] ) ) return OSGB ;
-  else if ( !strcasecmp ( value, posunit_names[MHEAD] ) ) return MHEAD ;
-  else if ( !strcasecmp ( value, posunit_names[LLMINSEC] ) ) return LLMINSEC ;
-  else if ( !strcasecmp ( value, posunit_names[LLMINDEC] ) ) return LLMINDEC ;
-  else if ( !strcasecmp ( value, posunit_names[LLDECIMAL] ) ) return LLDECIMAL ;
-  else return INVALID ;
+  double lat1, lon1, lat2, lon2 ;
+  int n = 0 ;
+  memset ( area, 0, sizeof ( *area ) ) ;
+  if ( strchr ( value, ',' ) )
+    {
+    if ( sscanf ( value, "%lf,%lf,%lf,%lf%n", &lat1, &lon1, &lat2, &lon2, &n ) != 4 || value[n] ) return -1 ;
+    if ( fabs ( lat1 ) > 90 || fabs ( lat2 ) > 90 || fabs ( lon1 ) > 180 || fabs ( lon2 ) > 180 ) return -1 ;
+    // Corners either way round, but west to east, so it can go over the date line.
+    area->minlat = (int32_t) lround ( ( lat1 < lat2 ? lat1 : lat2 ) * FIX_DEGREE ) ;
+    area->maxlat = (int32_t) lround ( ( lat1 < lat2 ? lat2 : lat1 ) * FIX_DEGREE ) ;
+    area->minlon = (int32_t) lround ( lon1 * FIX_DEGREE ) ;
+    area->maxlon = (int32_t) lround ( lon2 * FIX_DEGREE ) ;
+    return 0 ;
+    }
+  if ( strlen ( value ) < 1 || strlen ( value ) > 4 ) return -1 ;
+  strcpy ( area->square, value ) ;
+  // OSGB letters are capitals, geohashes are not.
+  if ( isupper ( (unsigned char) value[0] ) ) for ( n = 1 ; n < 2 && value[n] ; n++ ) area->square[n] = toupper ( (unsigned char) value[n] ) ;
+  return 0 ;
   }
 
 
@@ -177,13 +233,53 @@ validate_uint ( cfg_t* cfg, cfg_opt_t* opt )
   }
 
 
-// Check the baud rate's a good'un.
+// Check the cache age isn't negative.
+int
+validate_maxage ( cfg_t* cfg, cfg_opt_t* opt )
+  {
+  if ( cfg_opt_getnfloat ( opt, 0 ) < 0 )
+    {
+    cfg_error ( cfg, "Invalid maximum fix age." ) ;
+    return -1 ;
+    }
+  return 0 ;
+  }
+
+
+// Check the simplification tolerance isn't negative.
+int
+validate_simplify ( cfg_t* cfg, cfg_opt_t* opt )
+  {
+  if ( cfg_opt_getnfloat ( opt, 0 ) < 0 )
+    {
+    cfg_error ( cfg, "Invalid simplification tolerance." ) ;
+    return -1 ;
+    }
+  return 0 ;
+  }
+
+
+// Check the Maidenhead locator length.
+int
+validate_mheadlen ( cfg_t* cfg, cfg_opt_t* opt )
+  {
+  int value = cfg_opt_getnint ( opt, 0 ) ;
+  if ( value < 2 || value > MHEAD_MAXLEN || value % 2 )
+    {
+    cfg_error ( cfg, "Invalid Maidenhead locator length." ) ;
+    return -1 ;
+    }
+  return 0 ;
+  }
+
+
+// Check the baud rate's a good'un. 0 is auto.
 int
 validate_baud ( cfg_t* cfg, cfg_opt_t* opt )
   {
   int value ;
   value = cfg_opt_getnint ( opt, 0 ) ;
-  if ( valid_baud ( value ) == -1 )
+  if ( value != 0 && valid_baud ( value ) == -1 )
     {
     cfg_error ( cfg, "Invalid baudrate." ) ;
     return -1 ;
@@ -192,7 +288,89 @@ validate_baud ( cfg_t* cfg, cfg_opt_t* opt )
   }
 
 
-// Check the GPS device.
+// Separates GPS devices in a list.
+#define DEVSEP " ,\t"
+
+
+// A baud rate, "auto" or 0 to find it, as a termios speed. -1 if it's no good.
+int
+parse_baud ( const char* value )
+  {
+  char* end ;
+  long baud ;
+  if ( !strcasecmp ( value, "auto" ) ) return GPSBAUD_AUTO ;
+  baud = strtol ( value, &end, 10 ) ;
+  if ( end == value || *end || baud < 0 || baud > INT_MAX ) return -1 ;
+  return baud ? valid_baud ( (int) baud ) : GPSBAUD_AUTO ;
+  }
+
+
+// Split a GPS device, "/dev/tty*" with an optional ":baud", into its path and termios speed, defbaud if there isn't one.
+// Returns the speed, or -1 if it's no good. Colons followed by anything but a baud rate are part of the path, as in /dev/serial/by-path.
+int
+parse_device ( const char* spec, char* path, size_t size, int defbaud )
+  {
+  const char* colon = strrchr ( spec, ':' ) ;
+  size_t len ;
+  if ( colon && strcasecmp ( colon + 1, "auto" ) && ( !colon[1] || strspn ( colon + 1, "0123456789" ) != strlen ( colon + 1 ) ) )
+    {
+    colon = NULL ;
+    }
+  len = colon ? (size_t) ( colon - spec ) : strlen ( spec ) ;
+  // Needs to be "/dev/tty*", at least 8 chars.
+  if ( len < 8 || len >= size ) return -1 ;
+  memcpy ( path, spec, len ) ;
+  path[len] = '\0' ;
+  return colon ? parse_baud ( colon + 1 ) : defbaud ;
+  }
+
+
+// Check every device in a list, returns the first bad one or NULL.
+const char*
+check_devices ( const char* list, char* bad, size_t size )
+  {
+  char path[PATH_MAX] ;
+  char* copy = strdup ( list ) ;
+  char* spec ;
+  char* save ;
+  int n = 0 ;
+  for ( spec = strtok_r ( copy, DEVSEP, &save ) ; spec ; spec = strtok_r ( NULL, DEVSEP, &save ) )
+    {
+    if ( parse_device ( spec, path, sizeof ( path ), GPSBAUD ) == -1 || ++n > GPSMERGE_MAX ) break ;
+    }
+  if ( spec == NULL && n == 0 ) spec = copy ;
+  if ( spec ) snprintf ( bad, size, "%s", spec ) ;
+  free ( copy ) ;
+  return spec ? bad : NULL ;
+  }
+
+
+// Open every GPS device in a list, those without a baud rate at baud. Returns how many, and their fds and names.
+// Ones that won't open are left out, with a warning.
+int
+open_devices ( const char* list, int baud, int* tty, char** name )
+  {
+  char path[PATH_MAX] ;
+  char* copy = strdup ( list ) ;
+  char* spec ;
+  char* save ;
+  int n = 0, speed ;
+  for ( spec = strtok_r ( copy, DEVSEP, &save ) ; spec && n < GPSMERGE_MAX ; spec = strtok_r ( NULL, DEVSEP, &save ) )
+    {
+    speed = parse_device ( spec, path, sizeof ( path ), baud ) ;
+    if ( ( tty[n] = gps_open ( path, speed ) ) < 0 )
+      {
+      fprintf ( stderr, "Can't access GPS device %s: %s\n", path, strerror ( errno ) ) ;
+      continue ;
+      }
+    name[n++] = strdup ( path ) ;
+    }
+  free ( copy ) ;
+  return n ;
+  }
+
+
+// Check the GPS device, or devices.
 int
 validate_term ( cfg_t* cfg, cfg_opt_t* opt )
   {
@@ -209,10 +387,11 @@ validate_term ( cfg_t* cfg, cfg_opt_t* opt )
     cfg_error(cfg, "Setting %s, no GPS tty value.", opt->name ) ;
     return -1 ;
     }
-  // Needs to be "/dev/tty*", at least 8 chars.
-  if( strlen ( cfg_opt_getnstr ( opt, 0 ) ) < 8 )
+  // Each needs to be "/dev/tty*", at least 8 chars, maybe with a baud rate.
+  char bad[PATH_MAX] ;
+  if ( check_devices ( cfg_opt_getnstr ( opt, 0 ), bad, sizeof ( bad ) ) )
     {
-    cfg_error(cfg, "Setting %s, problem with GPS tty value: %s", opt->name, cfg_opt_getnstr ( opt, 0 ) ) ;
+    cfg_error(cfg, "Setting %s, problem with GPS tty value: %s", opt->name, bad ) ;
     return -1 ;
     }
   return 0 ;
@@ -248,7 +427,7 @@ parse_posunit ( cfg_t* cfg, cfg_opt_t* opt, const char* value, void* result )
 void
 usage ( char* appname )
   {
-  printf ( "Usage: %s -t%d -b%d -d%s -u%s\n", appname, TIMEOUT, map_baud(GPSBAUD), GPSTERM, STR(POSUNIT) ) ;
+  printf ( "Usage: %s -t%d -b%d -d%s -u%s -m%d [-F] [-c cache [-a age]] [-p shm | -s shm] [-S socket] [-A archive] [-f file [-j jobs]] [-q archive [-B begin] [-E end]] [-z metres] [-w index [-i area]] [-I index archive...] [-g fences] [-D datum] [-G datum] [-r stats] [-n unit]\n", appname, TIMEOUT, map_baud(GPSBAUD), GPSTERM, STR(POSUNIT), MHEADLEN ) ;
   }
 
 
@@ -267,13 +446,168 @@ help ( char* appname )
   printf ( "Usage: %s [option] ...\n", appname ) ;
   printf ( "\t-h,--help     This help.\n" ) ;
   printf ( "\t-t,--timeout  Time to wait for GPS in seconds, default %ds\n", TIMEOUT ) ;
-  printf ( "\t-b,--baudrate GPS device baudrate. Default %d\n", map_baud(GPSBAUD) ) ;
-  printf ( "\t-d,--device   GPS tty device. Default %s\n", GPSTERM ) ;
+  printf ( "\t-b,--baudrate GPS device baudrate, or auto to find it. Default %d\n", map_baud(GPSBAUD) ) ;
+  printf ( "\t-d,--device   GPS tty device, with :baud to override -b. Repeat to merge several. Default %s\n", GPSTERM ) ;
   printf ( "\t-u,--units    Units to show position in. Default %s\n", STR(POSUNIT) ) ;
+  printf ( "\t-m,--mheadlen Maidenhead locator length, 2 to %d. Default %d\n", MHEAD_MAXLEN, MHEADLEN ) ;
+  printf ( "\t-F,--follow   Keep reading and show every fix, not just the first.\n" ) ;
+  printf ( "\t-c,--cache    File to keep the last fix in.\n" ) ;
+  printf ( "\t-a,--max-age  Use the cached fix if it's no older than this, in seconds. Default 0, never\n" ) ;
+  printf ( "\t-p,--publish  Keep reading and publish every fix in this shared memory segment.\n" ) ;
+  printf ( "\t-s,--shm      Show the latest fix published in this shared memory segment.\n" ) ;
+  printf ( "\t-S,--serve    Keep reading and stream every fix to clients of this Unix socket.\n" ) ;
+  printf ( "\t-f,--file     Show every fix in an NMEA log file instead, - for stdin.\n" ) ;
+  printf ( "\t-j,--jobs     Threads to convert a log file with, 0 for one per CPU. Default 1\n" ) ;
+  printf ( "\t-A,--archive  Add every fix to this track archive, from the GPS or a log file.\n" ) ;
+  printf ( "\t-q,--query    Show the fixes in a track archive, from --begin to --end.\n" ) ;
+  printf ( "\t-B,--begin    Earliest fix to show, seconds since 1970 or YYYY-MM-DDTHH:MM:SS UTC.\n" ) ;
+  printf ( "\t-E,--end      Latest fix to show, the same way.\n" ) ;
+  printf ( "\t-I,--build-index Index the track archives named after the options into this file, by OSGB square or geohash.\n" ) ;
+  printf ( "\t-w,--where    Show the fixes in an index, in --in, from --begin to --end.\n" ) ;
+  printf ( "\t-i,--in       Area for --where, an OSGB square such as TQ or TQ38, a geohash, or lat,lon,lat,lon corners.\n" ) ;
+  printf ( "\t-g,--geofence Show fixes going into or out of the fences in this file, instead of every fix.\n" ) ;
+  printf ( "\t-D,--datum    WGS84 to OSGB36 correction grid for OSGB units. Default %s\n", DATUMGRID ) ;
+  printf ( "\t-G,--build-datum Work out a correction grid for --datum and write it to this file.\n" ) ;
+  printf ( "\t-n,--ntp      Feed fix times to ntpd or chrony, through this NTP SHM refclock unit, instead of showing them.\n" ) ;
+  printf ( "\t-r,--stats    Write counts of bytes, sentences and fixes, and latencies, to this file, or - for stderr, at exit and on SIGUSR1.\n" ) ;
+  printf ( "\t-z,--simplify Only show fixes needed to keep the track within this many metres. Default 0, all\n" ) ;
   printf ( "%s v%s, W.B.Hill <mail@wbh.org>, 19 Sept 2014\n", appname, STR(VERSION) ) ;
   }
 
 
+// Show a fix from a track archive, or a log file.
+void
+print_fix ( const gpsfix_t* fix, void* user )
+  {
+  const format_t* fmt = user ;
+  start_out ( fmt ) ;
+  if ( fixout_fix ( &out, fix, fmt ) < 0 )
+    {
+    perror ( "Writing fixes" ) ;
+    exit ( EXIT_FAILURE ) ;
+    }
+  }
+
+
+// Show a fix going into, or out of, a geofence.
+void
+show_event ( const gpsfix_t* fix, const char* name, int entered, void* user )
+  {
+  start_out ( user ) ;
+  fixout_text ( &out, entered ? "enter " : "exit ", entered ? 6 : 5 ) ;
+  fixout_text ( &out, name, strlen ( name ) ) ;
+  fixout_text ( &out, "\n", 1 ) ;
+  print_fix ( fix, user ) ;
+  }
+
+
+// What fence_fix() needs to know.
+typedef struct
+  {
+  geofence_t* fences ;
+  const format_t* fmt ;
+  } fencing_t ;
+
+
+// Check a fix from a track archive, or a log file, against the geofences.
+void
+fence_fix ( const gpsfix_t* fix, void* user )
+  {
+  fencing_t* fencing = user ;
+  geofence_check ( fencing->fences, fix, show_event, (void*) fencing->fmt ) ;
+  }
+
+
+// What show_fix() needs to know.
+typedef struct
+  {
+  const format_t* fmt ;
+  int follow ;
+  int found ;
+  const char* cache ;
+  fixshm_t* shm ;
+  trackfile_t* track ;
+  geofence_t* fences ;
+  ntpshm_t* ntp ;
+  gpssimplify_t* simp ;
+  } shown_t ;
+
+
+// Show a fix that's got past any simplifying, unless it's geofence events being shown instead, and archive it.
+void
+show_kept ( const gpsfix_t* fix, void* user )
+  {
+  shown_t* shown = user ;
+  // Publishing, or feeding NTP, instead? Then nothing.
+  if ( !shown->fences && !shown->shm && !shown->ntp )
+    {
+    print_fix ( fix, (void*) shown->fmt ) ;
+    fixout_flush ( &out ) ;
+    }
+  if ( shown->track && trackfile_add ( shown->track, fix ) < 0 )
+    {
+    perror ( "Writing track archive" ) ;
+    exit ( EXIT_FAILURE ) ;
+    }
+  }
+
+
+// Take a fix as soon as it arrives. Only the first one, unless following.
+// Publishing, NTP, the cache, the geofences and the latencies get every fix, straight away. Only what's shown and archived is simplified.
+void
+show_fix ( const gpsfix_t* fix, void* user )
+  {
+  shown_t* shown = user ;
+  if ( shown->found ) return ;
+  if ( shown->shm ) fixshm_publish ( shown->shm, fix ) ;
+  if ( shown->ntp ) ntpshm_publish ( shown->ntp, fix ) ;
+  // Keep it for next time. Only moan once.
+  if ( shown->cache && fixcache_save ( shown->cache, fix ) < 0 )
+    {
+    perror ( shown->cache ) ;
+    shown->cache = NULL ;
+    }
+  // Geofence events still get shown. Simplifying first could skip a crossing, or hold it back.
+  if ( shown->fences && geofence_check ( shown->fences, fix, show_event, (void*) shown->fmt ) ) fixout_flush ( &out ) ;
+  if ( shown->simp ) gpssimplify_push ( fix, shown->simp ) ;
+  else show_kept ( fix, shown ) ;
+  if ( fix->heard ) gpsstats_latency ( &latency, gpsstats_now ( ) - fix->heard ) ;
+  shown->found = !shown->follow ;
+  }
+
+
+// Where a record from a track archive goes next.
+typedef struct
+  {
+  gpsread_fix_cb onfix ;
+  void* user ;
+  } passon_t ;
+
+
+// Pass on a record from a track archive as a fix.
+void
+show_rec ( const fixrec_t* rec, void* user )
+  {
+  passon_t* next = user ;
+  gpsfix_t fix ;
+  fixrec_unpack ( rec, &fix ) ;
+  next->onfix ( &fix, next->user ) ;
+  }
+
+
+// Add a fix from a log file to the archive. Stopped? Then finish it off, between fixes.
+void
+archive_fix ( const gpsfix_t* fix, void* user )
+  {
+  if ( stopping ) exit ( EXIT_SUCCESS ) ;
+  if ( trackfile_add ( user, fix ) < 0 )
+    {
+    perror ( "Writing track archive" ) ;
+    exit ( EXIT_FAILURE ) ;
+    }
+  }
+
+
 // Parse the config files, then the command line, setup and then finally do stuff.
 int
 main ( int argc, char* argv[] )
@@ -283,6 +617,28 @@ main ( int argc, char* argv[] )
   static int gpsbaud ;
   static char* gpsterm ;
   static posunit_t posunit ;
+  static int mheadlen ;
+  static int follow ;
+  static char* fixcache ;
+  static double maxage ;
+  static char* publish ;
+  static char* shmread = NULL ;
+  static char* serve ;
+  static char* logfile = NULL ;
+  static int jobs = 1 ;
+  static char* archive ;
+  static char* query = NULL ;
+  static int64_t begin = INT64_MIN ;
+  static int64_t end = INT64_MAX ;
+  static double simplify ;
+  static char* buildindex = NULL ;
+  static char* where = NULL ;
+  static char* fencefile ;
+  static char* datum ;
+  static char* builddatum = NULL ;
+  static char* stats ;
+  static int ntpunit ;
+  static gridarea_t area = { "", -90 * FIX_DEGREE, 90 * FIX_DEGREE, -180 * FIX_DEGREE, 180 * FIX_DEGREE } ;
   // Config file. ADDARG
   static cfg_opt_t opts[] =
     {
@@ -290,6 +646,18 @@ main ( int argc, char* argv[] )
     CFG_INT ( "gpsbaud", GPSBAUD, CFGF_NONE ),
     CFG_STR ( "gpsterm", GPSTERM, CFGF_NONE ),
     CFG_PTR_CB ( "posunit", STR(POSUNIT), CFGF_NONE, parse_posunit, free ),
+    CFG_INT ( "mheadlen", MHEADLEN, CFGF_NONE ),
+    CFG_BOOL ( "follow", cfg_false, CFGF_NONE ),
+    CFG_STR ( "fixcache", "", CFGF_NONE ),
+    CFG_FLOAT ( "maxage", 0, CFGF_NONE ),
+    CFG_STR ( "publish", "", CFGF_NONE ),
+    CFG_STR ( "serve", "", CFGF_NONE ),
+    CFG_STR ( "archive", "", CFGF_NONE ),
+    CFG_FLOAT ( "simplify", 0, CFGF_NONE ),
+    CFG_STR ( "geofence", "", CFGF_NONE ),
+    CFG_STR ( "datum", DATUMGRID, CFGF_NONE ),
+    CFG_STR ( "stats", "", CFGF_NONE ),
+    CFG_INT ( "ntpunit", -1, CFGF_NONE ),
     CFG_END()
     } ;
   // Command line options. ADDARG
@@ -301,6 +669,28 @@ main ( int argc, char* argv[] )
       { "baudrate",  required_argument, 0,  'b' },
       { "device",    required_argument, 0,  'd' },
       { "units",     required_argument, 0,  'u' },
+      { "mheadlen",  required_argument, 0,  'm' },
+      { "follow",    no_argument,       0,  'F' },
+      { "cache",     required_argument, 0,  'c' },
+      { "max-age",   required_argument, 0,  'a' },
+      { "publish",   required_argument, 0,  'p' },
+      { "shm",       required_argument, 0,  's' },
+      { "serve",     required_argument, 0,  'S' },
+      { "file",      required_argument, 0,  'f' },
+      { "jobs",      required_argument, 0,  'j' },
+      { "archive",   required_argument, 0,  'A' },
+      { "query",     required_argument, 0,  'q' },
+      { "begin",     required_argument, 0,  'B' },
+      { "end",       required_argument, 0,  'E' },
+      { "simplify",  required_argument, 0,  'z' },
+      { "build-index", required_argument, 0, 'I' },
+      { "where",     required_argument, 0,  'w' },
+      { "in",        required_argument, 0,  'i' },
+      { "geofence",  required_argument, 0,  'g' },
+      { "datum",     required_argument, 0,  'D' },
+      { "build-datum", required_argument, 0, 'G' },
+      { "stats",     required_argument, 0,  'r' },
+      { "ntp",       required_argument, 0,  'n' },
       { 0, 0, 0, 0 }
     } ;
   // Load the config files.
@@ -316,6 +706,9 @@ main ( int argc, char* argv[] )
   cfg_set_validate_func ( confuse, "timeout", validate_uint ) ;
   cfg_set_validate_func ( confuse, "gpsbaud", validate_baud ) ;
   cfg_set_validate_func ( confuse, "gpsterm", validate_term ) ;
+  cfg_set_validate_func ( confuse, "mheadlen", validate_mheadlen ) ;
+  cfg_set_validate_func ( confuse, "maxage", validate_maxage ) ;
+  cfg_set_validate_func ( confuse, "simplify", validate_simplify ) ;
   // Read the /etc/app.conf file.
   if ( cfg_parse ( confuse, etcconf ) == CFG_PARSE_ERROR )
     {
@@ -330,9 +723,24 @@ main ( int argc, char* argv[] )
     }
   // Save the values. ADDARG
   gpsterm = strdup ( cfg_getstr ( confuse, "gpsterm" ) ) ;
+  // A number in the file, a termios speed if it's the default.
   gpsbaud = cfg_getint ( confuse, "gpsbaud" ) ;
+  gpsbaud = gpsbaud ? valid_baud ( gpsbaud ) : GPSBAUD_AUTO ;
+  if ( gpsbaud == -1 ) gpsbaud = GPSBAUD ;
   timeout = cfg_getint ( confuse, "timeout" ) ;
   posunit = *(posunit_t*) cfg_getptr ( confuse, "posunit" ) ;
+  mheadlen = cfg_getint ( confuse, "mheadlen" ) ;
+  follow = cfg_getbool ( confuse, "follow" ) ;
+  fixcache = strdup ( cfg_getstr ( confuse, "fixcache" ) ) ;
+  maxage = cfg_getfloat ( confuse, "maxage" ) ;
+  publish = strdup ( cfg_getstr ( confuse, "publish" ) ) ;
+  serve = strdup ( cfg_getstr ( confuse, "serve" ) ) ;
+  archive = strdup ( cfg_getstr ( confuse, "archive" ) ) ;
+  simplify = cfg_getfloat ( confuse, "simplify" ) ;
+  fencefile = strdup ( cfg_getstr ( confuse, "geofence" ) ) ;
+  datum = strdup ( cfg_getstr ( confuse, "datum" ) ) ;
+  stats = strdup ( cfg_getstr ( confuse, "stats" ) ) ;
+  ntpunit = cfg_getint ( confuse, "ntpunit" ) ;
   // Done - free stuff.
   cfg_free ( confuse ) ;
   free ( etcconf ) ;
@@ -340,8 +748,10 @@ main ( int argc, char* argv[] )
   // Now parse the command line.
   int opt = 0 ;
   int long_index = 0 ;
+  int devices = 0 ;
+  char badterm[PATH_MAX] ;
   // Process the command line ADDARG
-  while ( ( opt = getopt_long ( argc, argv, "hvt:b:d:u:", long_options, &long_index ) ) != -1 )
+  while ( ( opt = getopt_long ( argc, argv, "hvt:b:d:u:m:Fc:a:p:s:S:f:j:A:q:B:E:z:I:w:i:g:D:G:r:n:", long_options, &long_index ) ) != -1 )
     {
     switch ( opt )
       {
@@ -355,7 +765,7 @@ main ( int argc, char* argv[] )
         timeout = (int) strtol ( optarg, (char **)NULL, 10 ) ;
         break ;
       case 'b' :
-        gpsbaud = valid_baud ( (int) strtol ( optarg, (char **)NULL, 10 ) ) ;
+        gpsbaud = parse_baud ( optarg ) ;
         if ( gpsbaud == -1  )
           {
           fprintf ( stderr, "Invalid baudrate: %s\n", optarg ) ;
@@ -363,17 +773,25 @@ main ( int argc, char* argv[] )
           }
         break ;
       case 'd' :
-        // Needs to be "/dev/tty*", at least 8 chars.
-        if( strlen ( optarg ) < 8 )
+        // Each needs to be "/dev/tty*", at least 8 chars, maybe with a baud rate.
+        if ( check_devices ( optarg, badterm, sizeof ( badterm ) ) )
           {
-          fprintf ( stderr, "Problem with GPS tty value: %s\n", optarg ) ;
+          fprintf ( stderr, "Problem with GPS tty value: %s\n", badterm ) ;
           exit ( EXIT_FAILURE ) ;
           }
-        else
+        // The first replaces the config file's, any more are extra.
+        else if ( !devices++ )
           {
           free ( gpsterm ) ;
           gpsterm = strdup ( optarg  ) ;
           }
+        else
+          {
+          char* more = malloc ( strlen ( gpsterm ) + strlen ( optarg ) + 2 ) ;
+          sprintf ( more, "%s %s", gpsterm, optarg ) ;
+          free ( gpsterm ) ;
+          gpsterm = more ;
+          }
         break ;
       case 'u' :
         if ( map_posunit ( optarg ) )
@@ -386,11 +804,156 @@ main ( int argc, char* argv[] )
           exit ( EXIT_FAILURE ) ;
           }
         break ;
+      case 'm' :
+        mheadlen = (int) strtol ( optarg, (char **)NULL, 10 ) ;
+        if ( mheadlen < 2 || mheadlen > MHEAD_MAXLEN || mheadlen % 2 )
+          {
+          fprintf ( stderr, "Invalid Maidenhead locator length: %s\n", optarg ) ;
+          exit ( EXIT_FAILURE ) ;
+          }
+        break ;
+      case 'F' :
+        follow = 1 ;
+        break ;
+      case 'c' :
+        free ( fixcache ) ;
+        fixcache = strdup ( optarg ) ;
+        break ;
+      case 'a' :
+        maxage = strtod ( optarg, (char **)NULL ) ;
+        if ( maxage < 0 )
+          {
+          fprintf ( stderr, "Invalid maximum fix age: %s\n", optarg ) ;
+          exit ( EXIT_FAILURE ) ;
+          }
+        break ;
+      case 'p' :
+        free ( publish ) ;
+        publish = strdup ( optarg ) ;
+        break ;
+      case 's' :
+        free ( shmread ) ;
+        shmread = strdup ( optarg ) ;
+        break ;
+      case 'S' :
+        free ( serve ) ;
+        serve = strdup ( optarg ) ;
+        break ;
+      case 'f' :
+        free ( logfile ) ;
+        logfile = strdup ( optarg ) ;
+        break ;
+      case 'j' :
+        jobs = (int) strtol ( optarg, (char **)NULL, 10 ) ;
+        if ( jobs < 0 )
+          {
+          fprintf ( stderr, "Invalid number of jobs: %s\n", optarg ) ;
+          exit ( EXIT_FAILURE ) ;
+          }
+        if ( jobs == 0 ) jobs = (int) sysconf ( _SC_NPROCESSORS_ONLN ) ;
+        break ;
+      case 'A' :
+        free ( archive ) ;
+        archive = strdup ( optarg ) ;
+        break ;
+      case 'q' :
+        free ( query ) ;
+        query = strdup ( optarg ) ;
+        break ;
+      case 'z' :
+        simplify = strtod ( optarg, (char **)NULL ) ;
+        if ( simplify < 0 )
+          {
+          fprintf ( stderr, "Invalid simplification tolerance: %s\n", optarg ) ;
+          exit ( EXIT_FAILURE ) ;
+          }
+        break ;
+      case 'I' :
+        free ( buildindex ) ;
+        buildindex = strdup ( optarg ) ;
+        break ;
+      case 'g' :
+        free ( fencefile ) ;
+        fencefile = strdup ( optarg ) ;
+        break ;
+      case 'D' :
+        free ( datum ) ;
+        datum = strdup ( optarg ) ;
+        break ;
+      case 'G' :
+        free ( builddatum ) ;
+        builddatum = strdup ( optarg ) ;
+        break ;
+      case 'r' :
+        free ( stats ) ;
+        stats = strdup ( optarg ) ;
+        break ;
+      case 'n' :
+        ntpunit = (int) strtol ( optarg, (char **)NULL, 10 ) ;
+        if ( ntpunit < 0 || ntpunit > 255 )
+          {
+          fprintf ( stderr, "Invalid NTP SHM unit: %s\n", optarg ) ;
+          exit ( EXIT_FAILURE ) ;
+          }
+        break ;
+      case 'w' :
+        free ( where ) ;
+        where = strdup ( optarg ) ;
+        break ;
+      case 'i' :
+        if ( parse_area ( optarg, &area ) < 0 )
+          {
+          fprintf ( stderr, "Invalid area: %s\n", optarg ) ;
+          exit ( EXIT_FAILURE ) ;
+          }
+        break ;
+      case 'B' :
+      case 'E' :
+        if ( parse_when ( optarg, ( opt == 'B' ) ? &begin : &end ) < 0 )
+          {
+          fprintf ( stderr, "Invalid time: %s\n", optarg ) ;
+          exit ( EXIT_FAILURE ) ;
+          }
+        break ;
       default :
         usage ( basename ( argv[0] ) ) ;
         exit ( EXIT_FAILURE ) ;
       }
     }
+  // Working out a datum grid?
+  if ( builddatum )
+    {
+    if ( osgb_datum_build ( builddatum ) < 0 )
+      {
+      perror ( builddatum ) ;
+      exit ( EXIT_FAILURE ) ;
+      }
+    free ( builddatum ) ;
+    return EXIT_SUCCESS ;
+    }
+  // OSGB grid references want the datum shifting. It's fine for the default grid not to be installed, they're just less accurate.
+  if ( datum[0] && osgb_datum_open ( datum ) < 0 && !( errno == ENOENT && strcmp ( datum, DATUMGRID ) == 0 ) )
+    {
+    perror ( datum ) ;
+    exit ( EXIT_FAILURE ) ;
+    }
+  free ( datum ) ;
+  // Indexing archives? They're the rest of the command line.
+  if ( buildindex )
+    {
+    if ( optind == argc )
+      {
+      fprintf ( stderr, "No track archives to index.\n" ) ;
+      exit ( EXIT_FAILURE ) ;
+      }
+    if ( gridindex_build ( buildindex, (const char* const*) argv + optind, argc - optind ) < 0 )
+      {
+      perror ( buildindex ) ;
+      exit ( EXIT_FAILURE ) ;
+      }
+    free ( buildindex ) ;
+    return EXIT_SUCCESS ;
+    }
   // Shouldn't be anything left.
   if ( optind != argc )
     {
@@ -398,199 +961,278 @@ main ( int argc, char* argv[] )
     usage ( basename ( argv[0] ) ) ;
     exit ( EXIT_FAILURE ) ;
     }
-  // Set a callback for the alarm() signal.
-  signal ( SIGALRM, sighandler ) ;
-  // Timeout after specified seconds.
-  alarm ( timeout ) ;
-  // Start serial comms to GPS.
-  int tty ;
-  struct termios gpsio ;
-  // Default to zero.
-  memset ( &gpsio, 0, sizeof ( gpsio ) ) ;
-  // Set for GPS comms.
-  gpsio.c_iflag = 0 ;
-  gpsio.c_oflag = 0 ;
-  gpsio.c_cflag = CS8 | CREAD | CLOCAL ;
-  gpsio.c_lflag = 0 ;
-  gpsio.c_cc[VMIN] = 1 ;
-  gpsio.c_cc[VTIME] = 5 ;
-  // Open the tty device.
-  tty = open ( gpsterm, O_RDWR | O_NONBLOCK ) ;
-  // Did it work?
-  if ( tty < 0 )
+  // How to show things.
+  format_t fmt = { posunit, mheadlen, simplify } ;
+  if ( fixout_init ( &out, STDOUT_FILENO, 65536 ) < 0 )
     {
-    perror ( "Can't access GPS device" ) ;
-    exit ( EXIT_FAILURE );
+    perror ( "Output buffer" ) ;
+    exit ( EXIT_FAILURE ) ;
     }
-  // Set baud rate.
-  cfsetospeed ( &gpsio, gpsbaud ) ;
-  cfsetispeed ( &gpsio, gpsbaud ) ;
-  // Set properties.
-  tcsetattr ( tty, TCSANOW, &gpsio ) ;
-  // Attempt to fetch data.
-  int i, len = 0, state = 0 ;
-  unsigned char c ;
-  char gpsbuffer[256] ;
-  // The data.
-  char utctime[10] ;
-  char* raw ;
-  char latc[3], lonc[4] ;
-  int latd, lond ;
-  double latm, lonm ;
-  // Loop until break or timeout.
-  while ( 1 )
-    {
-    // Read the GPSdongle
-    i = read ( tty, &c, 1 ) ;
-    // Give up if it's got nothing for us.
-    if ( i <= 0 )
+  atexit ( close_out ) ;
+  // Simplifying? That goes between the parsing and whatever happens to the fixes.
+  static gpssimplify_t simp ;
+  // Geofencing? Then only the fixes going into or out of a fence get shown.
+  static geofence_t fences ;
+  fencing_t fencing = { NULL, &fmt } ;
+  if ( fencefile[0] )
+    {
+    int line ;
+    if ( geofence_load ( &fences, fencefile, &line ) < 0 )
       {
-      usleep ( 250 ) ;
-      continue ;
+      if ( errno == EINVAL ) fprintf ( stderr, "Invalid geofence at %s line %d\n", fencefile, line ) ;
+      else perror ( fencefile ) ;
+      exit ( EXIT_FAILURE ) ;
       }
-    // Don't save until the start of a sentence.
-    if ( state == 0 )
+    fencing.fences = &fences ;
+    }
+  // Reading back an archive, or an index of them? Only the blocks, or buckets, that can have what's wanted get touched.
+  if ( query || where )
+    {
+    trackmap_t tm ;
+    gridindex_t gi ;
+    if ( posunit == NMEA )
       {
-      if ( c == '$' ) state = 1 ;
+      fprintf ( stderr, "Track archives don't keep NMEA sentences.\n" ) ;
+      exit ( EXIT_FAILURE ) ;
       }
-    // Save the data data.
-    else if ( state == 1 )
+    // Geofences get every fix, so no crossing's missed.
+    passon_t next = { print_fix, &fmt } ;
+    if ( fencing.fences ) next = (passon_t) { fence_fix, &fencing } ;
+    else if ( simplify > 0 )
       {
-      // The end?
-      if ( c == '\r' )
-        {
-        // Make it a valid string.
-        gpsbuffer[len] = '\0' ;
-        // Ready for the next time.
-        len = 0 ;state = 0 ;
-        // Process it.
-        if ( ( gpsbuffer[0] == 'G' ) && ( gpsbuffer[1] == 'P' ) && ( gpsbuffer[2] == 'G' ) && ( gpsbuffer[3] == 'G' ) && ( gpsbuffer[4] == 'A' ) )
-          {
-          char **fp, *field[15], *ds ;
-          ds = gpsbuffer + 6 ;
-          // Save a copy, before it gets split.
-          raw = strdup ( gpsbuffer ) ;
-          for ( fp = field ; ( *fp = strsep( &ds, ",")) != NULL ; ) if ( ++fp >= &field[15]) break;
-          /*
-          0    = UTC of Position
-          1    = Latitude
-          2    = N or S
-          3    = Longitude
-          4    = E or W
-          5    = GPS quality indicator (0=invalid; 1=GPS fix; 2=Diff. GPS fix)
-          6    = Number of satellites in use [not those in view]
-          7    = Horizontal dilution of position
-          8    = Antenna altitude above/below mean sea level (geoid)
-          9    = Meters  (Antenna height unit)
-          10   = Geoidal separation (Diff. between WGS-84 earth ellipsoid and
-                 mean sea level.  -=geoid is below WGS-84 ellipsoid)
-          11   = Meters  (Units of geoidal separation)
-          12   = Age in seconds since last update from diff. reference station
-          13   = Diff. reference station ID#
-          14   = Checksum
-          */
-          // Got a good reading?
-          if ( (int) strtol ( field[5], (char **)NULL, 10 ) )
-            {
-            // Save it!
-            snprintf ( utctime, 9, "%c%c:%c%c:%c%c", field[0][0], field[0][1], field[0][2], field[0][3], field[0][4], field[0][5] ) ;
-            latc[0] = field[1][0] ;
-            latc[1] = field[1][1] ;
-            latc[2] = '\0' ;
-            latd = (int) strtol ( latc, (char **)NULL, 10 ) ;
-            latd *= ( field[2][0] == 'N' ) ? +1 : -1 ;
-            latm = strtod ( field[1]+2, NULL ) ;
-            lonc[0] = field[3][0] ;
-            lonc[1] = field[3][1] ;
-            lonc[2] = field[3][2] ;
-            lonc[3] = '\0' ;
-            lond = (int) strtol ( lonc, (char **)NULL, 10 ) ;
-            lond *= ( field[4][0] == 'E' ) ? +1 : -1 ;
-            lonm = strtod ( field[3]+3, NULL ) ;
-            // Done it!
-            break ;
-            }
-          else
-            {
-            free ( raw ) ;
-            }
-          }
-        }
-      // Save if not too much.
-      else if ( len < 254 )
+      gpssimplify_init ( &simp, simplify, next.onfix, next.user ) ;
+      next.onfix = gpssimplify_push ;
+      next.user = &simp ;
+      }
+    if ( where )
+      {
+      if ( gridindex_open ( &gi, where ) < 0 || gridindex_query ( &gi, &area, begin, end, show_rec, &next ) < 0 )
         {
-        gpsbuffer[len++] = c ;
+        perror ( where ) ;
+        exit ( EXIT_FAILURE ) ;
         }
-      // This has gone on too long.
-      else
+      gridindex_close ( &gi ) ;
+      }
+    else
+      {
+      if ( trackmap_open ( &tm, query ) < 0 || trackmap_query ( &tm, begin, end, show_rec, &next ) < 0 )
         {
-        // Give up.
-        len = 0 ; state = 0 ;
+        perror ( query ) ;
+        exit ( EXIT_FAILURE ) ;
         }
+      trackmap_close ( &tm ) ;
       }
-    // Should never happen!
-    else
+    gpssimplify_flush ( &simp ) ;
+    free ( query ) ;
+    free ( where ) ;
+    return EXIT_SUCCESS ;
+    }
+  // Writing to an archive? It has to be closed, even on a timeout.
+  static trackfile_t track ;
+  if ( archive[0] && serve[0] )
+    {
+    fprintf ( stderr, "Can't archive while serving.\n" ) ;
+    exit ( EXIT_FAILURE ) ;
+    }
+  if ( archive[0] )
+    {
+    if ( trackfile_open ( &track, archive ) < 0 )
+      {
+      perror ( archive ) ;
+      exit ( EXIT_FAILURE ) ;
+      }
+    archiving = &track ;
+    atexit ( close_archive ) ;
+    signal ( SIGINT, sighandler ) ;
+    signal ( SIGTERM, sighandler ) ;
+    }
+  // Archiving a log file? All of it, in order.
+  if ( logfile && archiving )
+    {
+    gpssimplify_init ( &simp, simplify, archive_fix, archiving ) ;
+    if ( batch_each ( logfile, simplify > 0 ? gpssimplify_push : archive_fix, simplify > 0 ? (void*) &simp : (void*) archiving ) < 0 )
+      {
+      perror ( logfile ) ;
+      exit ( EXIT_FAILURE ) ;
+      }
+    gpssimplify_flush ( &simp ) ;
+    free ( logfile ) ;
+    return EXIT_SUCCESS ;
+    }
+  // Geofencing a log file? That has to be in order, so one thread, and every fix, so no simplifying.
+  if ( logfile && fencing.fences )
+    {
+    if ( batch_each ( logfile, fence_fix, &fencing ) < 0 )
+      {
+      perror ( logfile ) ;
+      exit ( EXIT_FAILURE ) ;
+      }
+    geofence_free ( &fences ) ;
+    free ( logfile ) ;
+    return EXIT_SUCCESS ;
+    }
+  // Converting a log file? No device or timeout needed.
+  if ( logfile )
+    {
+    static char stdoutbuf[65536] ;
+    setvbuf ( stdout, stdoutbuf, _IOFBF, sizeof ( stdoutbuf ) ) ;
+    if ( batch_file ( logfile, &fmt, jobs, stdout ) < 0 )
+      {
+      perror ( logfile ) ;
+      exit ( EXIT_FAILURE ) ;
+      }
+    free ( logfile ) ;
+    free ( gpsterm ) ;
+    free ( fixcache ) ;
+    return EXIT_SUCCESS ;
+    }
+  // Just want what someone else has published?
+  if ( shmread )
+    {
+    const fixshm_t* shm = fixshm_open ( shmread ) ;
+    fixcache_t rec ;
+    gpsfix_t fix ;
+    if ( shm == NULL )
+      {
+      perror ( shmread ) ;
+      exit ( EXIT_FAILURE ) ;
+      }
+    switch ( fixshm_read ( shm, &rec, &fix ) )
+      {
+      case -1 :
+        perror ( shmread ) ;
+        exit ( EXIT_FAILURE ) ;
+      case 0 :
+        fprintf ( stderr, "No fix published in %s yet.\n", shmread ) ;
+        exit ( EXIT_FAILURE ) ;
+      }
+    if ( maxage > 0 && !( fixcache_age ( &rec ) >= 0 && fixcache_age ( &rec ) <= maxage ) )
+      {
+      fprintf ( stderr, "Fix published in %s is too old.\n", shmread ) ;
+      exit ( EXIT_FAILURE ) ;
+      }
+    print_fix ( &fix, &fmt ) ;
+    fixshm_close ( shm ) ;
+    return EXIT_SUCCESS ;
+    }
+  // Publishing? That's for as long as we can.
+  fixshm_t* shm = NULL ;
+  if ( publish[0] )
+    {
+    if ( ( shm = fixshm_create ( publish ) ) == NULL )
+      {
+      perror ( publish ) ;
+      exit ( EXIT_FAILURE ) ;
+      }
+    follow = 1 ;
+    }
+  // Feeding NTP? Likewise.
+  ntpshm_t* ntp = NULL ;
+  if ( ntpunit >= 0 )
+    {
+    if ( ( ntp = ntpshm_open ( ntpunit ) ) == NULL )
+      {
+      perror ( "NTP SHM segment" ) ;
+      exit ( EXIT_FAILURE ) ;
+      }
+    follow = 1 ;
+    }
+  // Serving? That's for as long as the GPS lasts, with no need for signals.
+  int tty[GPSMERGE_MAX] ;
+  char* devname[GPSMERGE_MAX] ;
+  int ntty ;
+  if ( serve[0] )
+    {
+    if ( ( ntty = open_devices ( gpsterm, gpsbaud, tty, devname ) ) == 0 )
+      {
+      fprintf ( stderr, "No GPS devices.\n" ) ;
+      exit ( EXIT_FAILURE );
+      }
+    gps_serve ( tty, ntty, serve, &fmt, timeout ) ;
+    if ( errno == ETIMEDOUT ) fprintf ( stderr, "Timed out trying to read GPS.\n" ) ;
+    else perror ( serve ) ;
+    exit ( EXIT_FAILURE ) ;
+    }
+  // A recent enough fix saved? Then that'll do.
+  if ( fixcache[0] && maxage > 0 && !follow )
+    {
+    fixcache_t cached ;
+    gpsfix_t fix ;
+    if ( fixcache_load ( fixcache, maxage, &cached, &fix ) && !archiving && !fencing.fences )
+      {
+      print_fix ( &fix, &fmt ) ;
+      free ( fixcache ) ;
+      free ( gpsterm ) ;
+      return EXIT_SUCCESS ;
+      }
+    }
+  // Stats on demand, and at the end if they're wanted.
+  if ( stats[0] )
+    {
+    statsfile = stats ;
+    atexit ( dump_stats ) ;
+    }
+  signal ( SIGUSR1, sighandler ) ;
+  // Start serial comms to the GPS, or several. Finding their speeds has its own limit, so the timeout starts after.
+  ntty = open_devices ( gpsterm, gpsbaud, tty, devname ) ;
+  // Did it work?
+  if ( ntty == 0 )
+    {
+    fprintf ( stderr, "No GPS devices.\n" ) ;
+    exit ( EXIT_FAILURE );
+    }
+  // Set a callback for the alarm() signal.
+  signal ( SIGALRM, sighandler ) ;
+  // Timeout after specified seconds.
+  alarm ( timeout ) ;
+  // Attempt to fetch data, merging the best fixes if there's more than one. Kept for the stats after main() has gone.
+  static gpsmerge_t merge ;
+  shown_t shown = { &fmt, follow, 0, fixcache[0] ? fixcache : NULL, shm, archiving, fencing.fences, ntp, simplify > 0 ? &simp : NULL } ;
+  unsigned long sentences ;
+  unsigned live ;
+  int i ;
+  gpssimplify_init ( &simp, simplify, show_kept, &shown ) ;
+  gpsmerge_init ( &merge, tty, ntty, show_fix, &shown ) ;
+  reading = &merge ;
+  simplifying = shown.simp ;
+  // Loop until found, stopped or timeout.
+  while ( !shown.found && !stopping )
+    {
+    sentences = merge.sentences ;
+    live = merge.live ;
+    // Sleep until a GPSdongle has something for us, then take everything it's got. A signal wakes it, but one just before the
+    // sleep wouldn't, so it looks again every second.
+    if ( gpsmerge_read ( &merge, 1000 ) < 0 )
+      {
+      perror ( "Lost the GPS device" ) ;
+      exit ( EXIT_FAILURE ) ;
+      }
+    if ( timedout ) timed_out ( ) ;
+    // Can carry on with the others.
+    for ( i = 0 ; i < ntty ; i++ )
       {
-      // Give up.
-      len = 0 ; state = 0 ;
+      if ( ( live & ~merge.live ) & ( 1u << i ) ) fprintf ( stderr, "Lost GPS device %s, carrying on without it.\n", devname[i] ) ;
       }
+    // Still alive, so give it longer when following.
+    if ( follow && merge.sentences != sentences ) alarm ( timeout ) ;
     }
-  // Disable timeout.
+  // Disable timeout, and let go of what the simplifier's still holding.
   signal ( SIGALRM, SIG_IGN ) ;
-  // Done with it now.
-  close ( tty ) ;
+  simplifying = NULL ;
+  if ( shown.simp ) gpssimplify_flush ( shown.simp ) ;
+  // Done with them now.
+  gpsmerge_close ( &merge ) ;
+  for ( i = 0 ; i < ntty ; i++ ) free ( devname[i] ) ;
   // Done with any config data. ADDARG
   free ( gpsterm ) ;
-  // Show the data.
-  double latt, lats, lont, lons ;
-  char z[3] ;
-  long e, n ;
-  switch ( posunit )
-    {
-    case TIME :
-      printf ( "%s\n", utctime ) ;
-      break ;
-    case NMEA :
-      printf ( "$%s\n", raw ) ;
-      break ;
-    case OSGB :
-      LLtoOSGB ( latd + latm / 60.0, lond + lonm / 60.0, z, &e, &n ) ;
-      printf ( "[%s][%05ld][%05ld]\n", z, e, n ) ;
-      break ;
-    case MHEAD :
-      latt =  90.0 + latd + latm / 60.0 ;
-      lont = 180.0 + lond + lonm / 60.0 ;
-      printf ( "%c", 'A' + (int) floor ( lont / 20.0 ) ) ;
-      printf ( "%c", 'A' + (int) floor ( latt / 10.0 ) ) ;
-      lont -= 20.0 * floor ( lont / 20.0 ) ;
-      printf ( "%d", (int) floor ( lont / 2.0 ) ) ;
-      latt -= 10.0 * floor ( latt / 10.0 ) ;
-      printf ( "%d", (int) floor ( latt ) ) ;
-      lont -= 2.0 * floor ( lont / 2.0 ) ;
-      printf ( "%c", 'a' + (int) floor ( 12.0 * lont ) ) ;
-      latt -= 1.0 * floor ( latt / 1.0 ) ;
-      printf ( "%c", 'a' + (int) floor ( 24.0 * latt ) ) ;
-      printf ( "\n" ) ;
-      break ;
-    case LLMINSEC :
-      lats = 60.0 * modf ( latm, &latt ) ;
-      printf ( "lat: %3d%c%02d\'%06.3f\"\n", latd, ( latd < 0 ) ? 'S' : 'N', ( int ) latt, lats ) ;
-      lons = 60.0 * modf ( lonm, &lont ) ;
-      printf ( "lon: %3d%c%02d\'%06.3f\"\n", lond, ( lond < 0 ) ? 'W' : 'E', ( int ) lont, lons ) ;
-      break ;
-    case LLMINDEC :
-      printf ( "lat: %3d%c%8.4f\'\n", abs ( latd ), ( latd < 0 ) ? 'S' : 'N', latm ) ;
-      printf ( "lon: %3d%c%8.4f\'\n", abs ( lond ), ( lond < 0 ) ? 'W' : 'E', lonm ) ;
-      break ;
-    case LLDECIMAL :
-      printf ( "lat: %+10.5f\n", latd + latm / 60.0 ) ;
-      printf ( "lon: %+10.5f\n", lond + lonm / 60.0 ) ;
-      break ;
-    default :
-      // What happend here?
-      break ;
-    }
-  free ( raw ) ;
+  free ( fixcache ) ;
+  free ( publish ) ;
+  free ( serve ) ;
+  free ( archive ) ;
+  free ( fencefile ) ;
+  if ( fencing.fences ) geofence_free ( &fences ) ;
+  if ( shm ) fixshm_close ( shm ) ;
+  if ( ntp ) ntpshm_close ( ntp ) ;
   // That's all, folks!
   return EXIT_SUCCESS ;
   }
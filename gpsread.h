@@ -1,15 +1,24 @@
 #ifndef GPSREAD_H
 #define GPSREAD_H
 
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+
 
 // Valid position units.
-typedef enum { INVALID=0, TIME, NMEA, OSGB, MHEAD, LLMINSEC, LLMINDEC, LLDECIMAL } posunit_t ;
-const char* posunit_names[] = { "INVALID", "TIME", "NMEA", "OSGB", "MHEAD", "LLMINSEC", "LLMINDEC", "LLDECIMAL" } ;
+typedef enum { INVALID=0, TIME, NMEA, OSGB, MHEAD, LLMINSEC, LLMINDEC, LLDECIMAL, RECORD, NDJSON, CSV, GEOJSON } posunit_t ;
+extern const char* const posunit_names[] ;
 
 // Set compile-time defaults.
 #define TIMEOUT 15
+#define MHEADLEN 6
 #define GPSBAUD B4800
 #define POSUNIT LLDECIMAL
+// Where the datum correction grid gets installed.
+#ifndef DATUMGRID
+  #define DATUMGRID "/usr/local/share/gpsread/osgb36.grid"
+#endif
 #if __APPLE__
   #define GPSTERM "/dev/tty.usbserial"
 #elif __linux
@@ -18,8 +27,499 @@ const char* posunit_names[] = { "INVALID", "TIME", "NMEA", "OSGB", "MHEAD", "LLM
   #error "Unable to determine default for GPSTERM"
 #endif
 
-// Converts lat/long to OSGB coords. Lat and Lon are in decimal degrees.
+// How to show fixes.
+typedef struct
+  {
+  posunit_t posunit ;
+  int mheadlen ;                // Maidenhead locator length, 2 to MHEAD_MAXLEN.
+  double simplify ;             // Simplify the track to within this many metres, 0 to show every fix.
+  } format_t ;
+
+// Longest Maidenhead locator, extended subsquares.
+#define MHEAD_MAXLEN 10
+
+// Fixed-point units used in fixes.
+#define FIX_MINUTE 100000
+#define FIX_DEGREE ( 60 * FIX_MINUTE )
+
+// A position fix.
+// Lat and lon are signed, +N/+E, in 1/100000ths of a minute of arc. Raw points at the GGA sentence it came from, without the '$', and
+// is only good as long as that is. The position comes from GGA, and the rest from the latest RMC, VTG and GSA, which may be from the
+// epoch before, depending on the order the GPS sends them in. The date is moved on with the GGA's UTC when that goes past midnight.
+typedef struct
+  {
+  int32_t utc ;                 // Milliseconds since midnight UTC, -1 if not known.
+  int32_t lat, lon ;
+  int32_t alt ;                 // Centimetres above mean sea level.
+  int16_t hdop ;                // Hundredths, INT16_MAX if not known.
+  uint8_t quality ;             // 0=invalid; 1=GPS fix; 2=Diff. GPS fix
+  uint8_t sats ;
+  int rawlen ;
+  const char* raw ;
+  int32_t date ;                // Days since 1 Jan 1970, -1 if not known.
+  int32_t dateutc ;             // Milliseconds since midnight the date goes with, -1 if not known.
+  int32_t speed ;               // Over the ground, cm/s, -1 if not known.
+  int32_t course ;              // True, hundredths of a degree, -1 if not known.
+  int16_t pdop, vdop ;          // Hundredths, INT16_MAX if not known.
+  uint8_t mode ;                // 0=not known; 1=no fix; 2=2D; 3=3D
+  int64_t heard ;               // When the GGA's '$' came in, CLOCK_MONOTONIC ns, 0 if not known.
+  int64_t heardreal ;           // The same, CLOCK_REALTIME.
+  } gpsfix_t ;
+
+// Set a fix to nothing known.
+void gpsfix_init ( gpsfix_t* fix ) ;
+
+// Where a field is in a sentence.
+typedef struct
+  {
+  uint8_t off ;
+  uint8_t len ;
+  } nmea_field_t ;
+
+// How fussy to be about the "*hh" checksum on the end of a sentence.
+typedef enum { NMEA_CHECK_OFF=0, NMEA_CHECK_PRESENT, NMEA_CHECK_REQUIRE } nmea_check_t ;
+
+// Sentence framer state, the text between the '$' and the '\r'.
+typedef struct
+  {
+  int state ;
+  int len ;
+  nmea_check_t check ;
+  char buffer[256] ;
+  unsigned long starts ;        // Every '$' that began a sentence.
+  unsigned long overflows ;     // Too long to hold, dropped.
+  unsigned long badsums ;       // Wrong checksum, dropped.
+  } nmea_framer_t ;
+
+// Set up a new framer. By default, check the checksum if there's one there.
+void nmea_init ( nmea_framer_t* fr, nmea_check_t check ) ;
+// Get ready to look for the start of a sentence.
+void nmea_reset ( nmea_framer_t* fr ) ;
+// Pull the next sentence out of a block of bytes, returns how many bytes were used.
+size_t nmea_frame ( nmea_framer_t* fr, const char* data, size_t len, const char** sentence, int* slen ) ;
+// Check a sentence's checksum: 1 if right, 0 if it hasn't got one, -1 if wrong.
+int nmea_checksum ( const char* sentence, int slen ) ;
+// Find the comma separated fields after the sentence name, returns how many.
+int nmea_fields ( const char* sentence, int slen, nmea_field_t* field, int max ) ;
+// Sentence types that get parsed, from talkers GP, GN, GL, GA, GB, BD and GQ.
+typedef enum { NMEA_NONE=0, NMEA_GGA, NMEA_RMC, NMEA_GSA, NMEA_VTG } nmea_type_t ;
+
+// What type a sentence is, NMEA_NONE if it's not one of ours.
+nmea_type_t nmea_type ( const char* sentence, int slen ) ;
+// Parse any sentence into the parts of fix it covers. Returns its type if good, minus it if not, or NMEA_NONE if it was skipped.
+int nmea_parse ( const char* sentence, int slen, gpsfix_t* fix ) ;
+// Parse a GGA sentence, returns 1 for a good fix.
+int nmea_gga ( const char* sentence, int slen, gpsfix_t* fix ) ;
+// Fixed-point lat or lon to decimal degrees.
+double fix_degrees ( int32_t v ) ;
+
+// Called with each good fix.
+typedef void ( *gpsread_fix_cb ) ( const gpsfix_t* fix, void* user ) ;
+
+// Latency histogram buckets, powers of 2 microseconds. Bucket 0 is under 1us, i is under 2^i us, and the last anything longer.
+#define GPSSTATS_BUCKETS 24
+
+// What became of the bytes from a GPS, for telling why there were no fixes.
+typedef struct
+  {
+  unsigned long reads ;         // That got something.
+  unsigned long empty ;         // Woken up, but nothing to read.
+  unsigned long bytes ;
+  unsigned long sentences ;     // Framed, with good checksums or none.
+  unsigned long badsums ;       // Framed, but the checksum was wrong.
+  unsigned long overflows ;     // Longer than a sentence can be.
+  unsigned long other ;         // Not GGA.
+  unsigned long invalid ;       // GGA, but no fix.
+  unsigned long fixes ;
+  unsigned long latency[GPSSTATS_BUCKETS] ;     // From a GGA's '$' being read to its fix being shown, where someone's timed it.
+  } gpsstats_t ;
+
+// CLOCK_MONOTONIC in nanoseconds.
+int64_t gpsstats_now ( void ) ;
+// Count a fix shown ns after it was heard.
+void gpsstats_latency ( gpsstats_t* st, int64_t ns ) ;
+// Format as "name value" lines, without stdio, so it's safe in a signal handler. Returns the length, like snprintf().
+int gpsstats_format ( char* buf, size_t size, const gpsstats_t* st ) ;
+
+// A reader, turning a byte stream into fixes.
+typedef struct
+  {
+  nmea_framer_t framer ;
+  gpsfix_t fix ;                // Everything heard so far.
+  gpsread_fix_cb onfix ;
+  void* user ;
+  gpsstats_t stats ;            // Bar what the framer counts itself, and latency.
+  int64_t now, nowreal ;        // When the bytes being pushed were read, CLOCK_MONOTONIC and CLOCK_REALTIME ns, 0 if not known.
+  int64_t begun, begunreal ;    // When the '$' came in, of a sentence split over pushes.
+  int64_t bytens ;              // Nanoseconds a byte takes on the line, to work back from the read to each '$'. 0 to not bother.
+  } gpsread_t ;
+
+// Set up a reader, onfix gets called with user for each good fix.
+void gpsread_init ( gpsread_t* ctx, gpsread_fix_cb onfix, void* user ) ;
+// Note the time, just after reading some bytes and before pushing them, so the fixes say when they were heard.
+void gpsread_clock ( gpsread_t* ctx ) ;
+// Feed it bytes, returns how many fixes they completed.
+int gpsread_push ( gpsread_t* ctx, const char* data, size_t len ) ;
+// Wait up to timeout ms (-1 forever) for fd, then push what's there. Returns bytes read, 0 on timeout, -1 with errno.
+ssize_t gpsread_read ( gpsread_t* ctx, int fd, int timeout ) ;
+// Add a reader's counts to st, the framer's too.
+void gpsread_stats ( const gpsread_t* ctx, gpsstats_t* st ) ;
+
+// Most fixes waiting to be simplified, and the longest sentence kept with them.
+#define GPSSIMPLIFY_WINDOW 64
+#define GPSSIMPLIFY_RAW 256
+
+// Online track simplification, between a reader and whatever wants its fixes.
+typedef struct
+  {
+  double tolerance ;            // Metres.
+  gpsread_fix_cb onfix ;
+  void* user ;
+  int anchored ;
+  int32_t lat, lon ;            // The last fix passed on.
+  double xscale ;               // Metres per unit of lon there.
+  int n ;                       // Fixes waiting, since then.
+  gpsfix_t win[GPSSIMPLIFY_WINDOW] ;
+  char raw[GPSSIMPLIFY_WINDOW][GPSSIMPLIFY_RAW] ;
+  double x[GPSSIMPLIFY_WINDOW], y[GPSSIMPLIFY_WINDOW] ;
+  unsigned long seen ;
+  unsigned long kept ;
+  } gpssimplify_t ;
+
+// Set up a simplifier, passing on to onfix only the fixes needed to keep the track within tolerance metres of them all.
+void gpssimplify_init ( gpssimplify_t* s, double tolerance, gpsread_fix_cb onfix, void* user ) ;
+// Take a fix. A gpsread_fix_cb, with the simplifier as user.
+void gpssimplify_push ( const gpsfix_t* fix, void* user ) ;
+// Pass on the last fix now, if it's waiting.
+void gpssimplify_flush ( gpssimplify_t* s ) ;
+
+// Most GPS devices read at once.
+#define GPSMERGE_MAX 8
+// How long to wait for the other devices once one has reported an epoch, in milliseconds.
+#define GPSMERGE_HOLD 250
+// Fixes this many milliseconds older than the latest epoch are stragglers, and dropped. Any older, the clock's been reset.
+#define GPSMERGE_LATE 1000
+
+// One of several GPS devices being merged.
+typedef struct
+  {
+  struct gpsmerge_s* merge ;
+  int fd ;                      // -1 once it's gone.
+  gpsread_t reader ;
+  } gpsmerge_dev_t ;
+
+// Several GPS devices, with their fixes merged by UTC time.
+typedef struct gpsmerge_s
+  {
+  int n ;
+  unsigned live ;               // Bit per device still there.
+  gpsmerge_dev_t dev[GPSMERGE_MAX] ;
+  gpsread_fix_cb onfix ;
+  void* user ;
+  int32_t epoch ;               // UTC of the latest epoch, -1 before the first.
+  int pending ;                 // Its best fix is still to be passed on.
+  unsigned seen ;               // Bit per device that's reported it.
+  int64_t due ;                 // When to stop waiting for the others, monotonic ms.
+  gpsfix_t best ;
+  char raw[256] ;
+  unsigned long sentences ;     // From all devices.
+  unsigned long epochs ;
+  } gpsmerge_t ;
+
+// Is fix a better than b? By quality indicator, then satellites, then HDOP.
+int gpsfix_better ( const gpsfix_t* a, const gpsfix_t* b ) ;
+// Set up to merge n opened devices, taking over their fds. onfix gets the best fix of each epoch. -1 with errno if n's no good.
+int gpsmerge_init ( gpsmerge_t* m, const int* fd, int n, gpsread_fix_cb onfix, void* user ) ;
+void gpsmerge_close ( gpsmerge_t* m ) ;
+// Add every device's counts to st.
+void gpsmerge_stats ( const gpsmerge_t* m, gpsstats_t* st ) ;
+// Wait up to timeout ms (-1 forever) for any device, and push what's there. Returns bytes, 0 on timeout, a signal or losing one, -1 when all
+// have gone.
+ssize_t gpsmerge_read ( gpsmerge_t* m, int timeout ) ;
+// For running from another event loop: read device i when it's ready, returns -1 with errno if it's gone. Limit waits with
+// gpsmerge_wait() and call gpsmerge_tick() after them, so epochs don't wait forever for a missing device.
+ssize_t gpsmerge_service ( gpsmerge_t* m, int i ) ;
+int gpsmerge_wait ( const gpsmerge_t* m, int timeout ) ;
+void gpsmerge_tick ( gpsmerge_t* m ) ;
+// Pass on the current epoch now.
+void gpsmerge_flush ( gpsmerge_t* m ) ;
+
+// The fix cache file. Fixed layout, native byte order.
+typedef struct
+  {
+  char magic[8] ;
+  int64_t realtime ;            // When it was saved, CLOCK_REALTIME and CLOCK_MONOTONIC nanoseconds.
+  int64_t monotonic ;
+  int32_t utc, lat, lon, alt ;
+  int16_t hdop, pdop, vdop ;
+  uint8_t quality, sats, mode ;
+  int32_t date, speed, course ;
+  int32_t rawlen ;
+  char raw[256] ;
+  } fixcache_t ;
+
+// Save a fix to the cache file, atomically. Returns 0, or -1 with errno set.
+int fixcache_save ( const char* path, const gpsfix_t* fix ) ;
+// Load the cached fix if it's no more than maxage seconds old. Returns 1 if it is.
+int fixcache_load ( const char* path, double maxage, fixcache_t* cache, gpsfix_t* fix ) ;
+// Fill a record from a fix, stamped now, and back again. Unpacking returns -1 for a bad record.
+void fixcache_pack ( fixcache_t* cache, const gpsfix_t* fix ) ;
+int fixcache_unpack ( const fixcache_t* cache, gpsfix_t* fix ) ;
+// Age of a record in seconds, -1 if the clocks don't agree on it.
+double fixcache_age ( const fixcache_t* cache ) ;
+
+// Shared memory segment for publishing fixes, a record behind a sequence lock.
+typedef struct
+  {
+  uint32_t seq ;                // Odd while it's being written, 0 if never.
+  uint32_t pad ;
+  fixcache_t rec ;
+  } fixshm_t ;
+
+// Create a segment to publish in, or attach to one to read. NULL with errno set if not.
+fixshm_t* fixshm_create ( const char* name ) ;
+const fixshm_t* fixshm_open ( const char* name ) ;
+void fixshm_close ( const fixshm_t* shm ) ;
+// Publish a fix. Only one writer per segment.
+void fixshm_publish ( fixshm_t* shm, const gpsfix_t* fix ) ;
+// Get the latest fix, normally without any system calls. Returns 1 if there was one, -1 with errno EAGAIN if it stays half written.
+int fixshm_read ( const fixshm_t* shm, fixcache_t* rec, gpsfix_t* fix ) ;
+
+// A fix as a fixed-size binary record, for RECORD output and track archives. Native byte order.
+typedef struct
+  {
+  int64_t time ;                // Milliseconds since 1970 UTC, or -2 less ms since midnight if the date's not known. -1 if the time isn't.
+  int32_t lat, lon ;            // As in gpsfix_t.
+  int32_t alt ;
+  int16_t hdop ;
+  uint8_t quality, sats ;
+  } fixrec_t ;
+
+// Fill a record from a fix, and back. Unpacked fixes have no raw sentence.
+void fixrec_pack ( fixrec_t* rec, const gpsfix_t* fix ) ;
+void fixrec_unpack ( const fixrec_t* rec, gpsfix_t* fix ) ;
+
+// Fixes per track archive block.
+#define TRACK_BLOCK 256
+// Room for a block: header, worst case coding of each fix, and padding.
+#define TRACK_BUFSIZE ( 32 + TRACK_BLOCK * 70 + 8 )
+
+// Where a block is in a track archive, and the times it covers.
+typedef struct
+  {
+  int64_t first, last ;
+  uint64_t off ;
+  uint32_t count ;
+  uint32_t pad ;
+  } trackindex_t ;
+
+// A track archive being added to.
+typedef struct
+  {
+  int fd ;
+  uint64_t end ;                // Where the next block goes.
+  fixrec_t prev ;
+  int64_t step[3] ;             // Last change in time, lat and lon.
+  int count ;                   // Fixes in the block so far.
+  int64_t first, last ;
+  size_t len ;
+  uint8_t buf[TRACK_BUFSIZE] ;
+  trackindex_t* index ;
+  size_t nindex, sizeindex ;
+  } trackfile_t ;
+
+// A track archive mapped for reading.
+typedef struct
+  {
+  const char* map ;
+  size_t size ;
+  const trackindex_t* index ;
+  size_t nindex ;
+  trackindex_t* built ;         // The index, if the file didn't have one.
+  } trackmap_t ;
+
+// Called with each record a query finds.
+typedef void ( *trackmap_cb ) ( const fixrec_t* rec, void* user ) ;
+
+// Open an archive to add fixes to, creating it if need be. Returns 0, or -1 with errno set.
+int trackfile_open ( trackfile_t* tf, const char* path ) ;
+// Add a fix, a block's written each TRACK_BLOCK of them. Flush writes out a part block now. Returns 0, or -1 with errno set.
+int trackfile_add ( trackfile_t* tf, const gpsfix_t* fix ) ;
+int trackfile_flush ( trackfile_t* tf ) ;
+// Write out the rest, and the index. Returns 0, or -1 with errno set.
+int trackfile_close ( trackfile_t* tf ) ;
+// Map an archive to read. Returns 0, or -1 with errno set.
+int trackmap_open ( trackmap_t* tm, const char* path ) ;
+void trackmap_close ( trackmap_t* tm ) ;
+// Pass each record timed from first to last, inclusive, to onrec. Returns how many, or -1 with errno set if it's corrupt.
+long trackmap_query ( const trackmap_t* tm, int64_t first, int64_t last, trackmap_cb onrec, void* user ) ;
+
+// A bucket in a spatial index, and where its fixes are.
+typedef struct
+  {
+  char key[4] ;                 // OSGB 10km square, eg. "TQ38", or off the grid a geohash, eg. "u09t".
+  uint32_t pad ;
+  int32_t minlat, maxlat ;      // The box and times its fixes cover.
+  int32_t minlon, maxlon ;
+  int64_t first, last ;
+  uint64_t off ;                // Where its fixes are in the file, in time order.
+  uint64_t count ;
+  } gridbucket_t ;
+
+// A spatial index mapped for querying.
+typedef struct
+  {
+  const char* map ;
+  size_t size ;
+  const gridbucket_t* bucket ;
+  size_t nbuckets ;
+  } gridindex_t ;
+
+// Where to look: buckets whose names start with square, eg. "TQ" or "TQ38", or if that's empty, a box. Box edges are included, and
+// minlon > maxlon goes over the date line.
+typedef struct
+  {
+  char square[5] ;
+  int32_t minlat, maxlat ;
+  int32_t minlon, maxlon ;
+  } gridarea_t ;
+
+// Bucket names for arrays of points. Lat and lon in decimal degrees.
+void gridindex_keys ( size_t count, const double* lat, const double* lon, char (*key)[4] ) ;
+// Index every fix in some track archives. Returns 0, or -1 with errno set.
+int gridindex_build ( const char* path, const char* const* archive, int narchives ) ;
+// Map an index to query. Returns 0, or -1 with errno set.
+int gridindex_open ( gridindex_t* gi, const char* path ) ;
+void gridindex_close ( gridindex_t* gi ) ;
+// Pass each record in area, timed from first to last inclusive, to onrec in time order. Returns how many, or -1 with errno set.
+long gridindex_query ( const gridindex_t* gi, const gridarea_t* area, int64_t first, int64_t last, trackmap_cb onrec, void* user ) ;
+
+// A geofence polygon. Its corners are x[start] to x[start+count-1] in a geofence_t, the last the same as the first.
+typedef struct
+  {
+  char* name ;
+  size_t start, count ;
+  double minx, maxx, miny, maxy ;
+  } geofence_poly_t ;
+
+// A set of geofences, with a grid of which are near where, and which the last fix was inside.
+typedef struct
+  {
+  geofence_poly_t* fence ;
+  size_t n ;
+  double* x ;                   // Lon and lat of every corner, in decimal degrees.
+  double* y ;
+  size_t nvertices ;
+  double x0, y0, cw, ch ;       // The grid's corner, and cell sizes.
+  int gx, gy ;
+  uint32_t* cellstart ;         // Fences touching cell i are cells[cellstart[i]] to cells[cellstart[i+1]-1].
+  uint32_t* cells ;
+  uint32_t* fill ;
+  uint32_t* state ;
+  uint32_t epoch ;
+  uint32_t* inside ;            // The fences the last fix was in.
+  size_t ninside ;
+  uint32_t* now ;
+  } geofence_t ;
+
+// Called with the name of a fence a fix has just gone into, or out of.
+typedef void ( *geofence_cb ) ( const gpsfix_t* fix, const char* name, int entered, void* user ) ;
+
+// Load geofences from a file. Returns 0, or -1 with errno set, and line set if it's EINVAL.
+int geofence_load ( geofence_t* gf, const char* path, int* line ) ;
+void geofence_free ( geofence_t* gf ) ;
+// Check a fix, calling onevent for each fence gone into or out of. Returns how many.
+int geofence_check ( geofence_t* gf, const gpsfix_t* fix, geofence_cb onevent, void* user ) ;
+
+// The NTP shared memory refclock segment, as ntpd's SHM driver and chrony's "refclock SHM" read it.
+typedef struct
+  {
+  int mode ;                    // 1, use the count to check for a torn sample.
+  volatile int count ;
+  time_t clockTimeStampSec ;    // What the GPS said the time was.
+  int clockTimeStampUSec ;
+  time_t receiveTimeStampSec ;  // What the system clock said when it said it.
+  int receiveTimeStampUSec ;
+  int leap ;
+  int precision ;               // Log2 seconds.
+  int nsamples ;
+  volatile int valid ;
+  unsigned clockTimeStampNSec ;
+  unsigned receiveTimeStampNSec ;
+  int dummy[8] ;
+  } ntpshm_t ;
+
+// The key of the first unit's segment, "NTP0".
+#define NTPSHM_KEY 0x4E545030
+
+// Attach to NTP SHM unit's segment, creating it if need be. Returns NULL with errno set if it can't.
+ntpshm_t* ntpshm_open ( int unit ) ;
+void ntpshm_close ( ntpshm_t* shm ) ;
+// Publish a fix's UTC against when it was heard. Returns 1 if it did, 0 if the fix hasn't the time, a fix or a stamp.
+int ntpshm_publish ( ntpshm_t* shm, const gpsfix_t* fix ) ;
+
+// Serve merged fixes from ntty GPS ttys to clients of a Unix socket, in fmt unless they send a units name. Gives up after timeout seconds
+// (0 never) without a sentence, with ETIMEDOUT, or when every tty has gone. Only returns on error, -1 with errno set.
+int gps_serve ( const int* tty, int ntty, const char* path, const format_t* fmt, int timeout ) ;
+
+// Map a termios baud rate to a number, and back. -1 if it's not valid.
+int map_baud ( int br ) ;
+int valid_baud ( int br ) ;
+// Open a GPS tty at a valid_baud() speed, or GPSBAUD_AUTO. Returns the fd, or -1 with errno set.
+int gps_open ( const char* term, int speed ) ;
+// A speed for gps_open() to find for itself.
+#define GPSBAUD_AUTO ( -2 )
+// Set a tty to whichever speed gets sentences with good checksums. Returns the speed, or -1 with errno set, ETIMEDOUT if none do.
+int gps_autobaud ( int tty ) ;
+
+// Convert a string to a posunit_t, INVALID if it isn't one.
+posunit_t map_posunit ( const char* value ) ;
+// Format a fix in the given units, returns the length like snprintf(). Any fix in any units fits in FORMAT_MAX.
+int format_fix ( char* buf, size_t size, const gpsfix_t* fix, const format_t* fmt ) ;
+#define FORMAT_MAX 512
+// Format an OSGB zone, easting and northing, the same way.
+int format_osgb ( char* buf, size_t size, const char* z, long e, long n ) ;
+// Format a line to go before the fixes, CSV's column names. Returns the length, 0 if the units have none.
+int format_header ( char* buf, size_t size, const format_t* fmt ) ;
+
+// Formatted fixes, saved up to go out to a file descriptor in big writes.
+typedef struct
+  {
+  int fd ;
+  char* buf ;
+  size_t len, size ;
+  } fixout_t ;
+
+// Set up a buffer of size for fd. Returns 0, or -1 with errno set.
+int fixout_init ( fixout_t* out, int fd, size_t size ) ;
+// Add a fix, or some text. Either may write out the buffer to make room. Return 0, or -1 with errno set.
+int fixout_fix ( fixout_t* out, const gpsfix_t* fix, const format_t* fmt ) ;
+int fixout_text ( fixout_t* out, const char* text, size_t len ) ;
+// Write out all that's buffered. Returns 0, or -1 with errno set.
+int fixout_flush ( fixout_t* out ) ;
+// Flush and free, leaving fd open. Returns 0, or -1 with errno set.
+int fixout_close ( fixout_t* out ) ;
+// Show every fix in a log file, or stdin for "-", using jobs threads. Returns 0, or -1 with errno set.
+int batch_file ( const char* path, const format_t* fmt, int jobs, FILE* out ) ;
+// Pass every fix in a log file, or stdin for "-", to onfix. Returns 0, or -1 with errno set.
+int batch_each ( const char* path, gpsread_fix_cb onfix, void* user ) ;
+
+// Converts lat/long to OSGB coords. Lat and Lon are in decimal degrees. Zone is "??" outside the grid.
 void LLtoOSGB ( const double lat, const double lon, char* OSGBz, long* OSGBe, long* OSGBn ) ;
+// Same, for arrays of points.
+void LLtoOSGBv ( size_t count, const double* restrict lat, const double* restrict lon, char (*restrict OSGBz)[3], long* restrict OSGBe,
+                 long* restrict OSGBn ) ;
+// Map in a WGS84 to OSGB36 correction grid, which both then use, on every thread. Without one, GPS positions are about 100m out. Only
+// once per process, EBUSY after it's worked. Returns 0, or -1 with errno set. Close it only when nothing's converting.
+int osgb_datum_open ( const char* path ) ;
+void osgb_datum_close ( void ) ;
+// Work out a correction grid with a Helmert transform, good to a few metres, and write it. Returns 0, or -1 with errno set.
+int osgb_datum_build ( const char* path ) ;
+
+// Converts lat/long to a Maidenhead locator, chars long. Returns the length.
+int LLtoMaidenhead ( const double lat, const double lon, int chars, char* loc ) ;
+// Same, for arrays of points. Each locator in loc is followed by a '\0'.
+void LLtoMaidenheadv ( size_t count, const double* lat, const double* lon, int chars, char* loc ) ;
 
 
 #endif //GPSREAD_H
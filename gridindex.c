@@ -0,0 +1,480 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    Spatial index of track archives, by OSGB square or geohash, for box and time queries.                                               */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+// Every fix goes in a bucket named for where it is: the OSGB 10km square, eg. "TQ38", from LLtoOSGBv()'s zone letters and the first
+// digit of the easting and northing, or a 4 character geohash, about 40km by 20km, outside the grid. The index file is a header, a
+// directory of buckets sorted by name, with the box and times each one covers, then each bucket's fixes as fixrec_t, sorted by time.
+// A query picks buckets from the directory, finds its times in each by binary search, and merges them back into time order.
+// Building makes two passes over the archives, one to count and one to put each fix in place, so it only needs memory per bucket.
+
+// For ftruncate()
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "gpsread.h"
+
+
+// What an index file starts with.
+static const char gridindex_magic[8] = "GPSGIX1" ;
+
+// Before the directory.
+typedef struct
+  {
+  char magic[8] ;
+  uint64_t count ;              // Buckets.
+  } gridhead_t ;
+
+// How many fixes to find buckets for together.
+#define GRID_BATCH 256
+
+// Geohash digits.
+static const char geohash32[] = "0123456789bcdefghjkmnpqrstuvwxyz" ;
+
+
+// Bucket names for a batch of points. Lat and lon are in decimal degrees.
+void
+gridindex_keys ( size_t count, const double* lat, const double* lon, char (*key)[4] )
+  {
+  char z[GRID_BATCH][3] ;
+  long e[GRID_BATCH], n[GRID_BATCH] ;
+  size_t i, j, m ;
+  int b, bits ;
+  double lo[2], hi[2], mid, v ;
+  unsigned h ;
+  for ( j = 0 ; j < count ; j += m )
+    {
+    m = ( count - j < GRID_BATCH ) ? count - j : GRID_BATCH ;
+    LLtoOSGBv ( m, lat + j, lon + j, z, e, n ) ;
+    for ( i = 0 ; i < m ; i++ )
+      {
+      if ( z[i][0] != '?' )
+        {
+        key[j+i][0] = z[i][0] ;
+        key[j+i][1] = z[i][1] ;
+        key[j+i][2] = '0' + e[i] / 10000 ;
+        key[j+i][3] = '0' + n[i] / 10000 ;
+        continue ;
+        }
+      // Off the grid, so 20 bits of geohash, lon first.
+      lo[0] = -180.0 ; hi[0] = 180.0 ;
+      lo[1] = -90.0 ; hi[1] = 90.0 ;
+      for ( h = 0, bits = 0 ; bits < 20 ; bits++ )
+        {
+        b = bits & 1 ;
+        v = b ? lat[j+i] : lon[j+i] ;
+        mid = ( lo[b] + hi[b] ) / 2 ;
+        h <<= 1 ;
+        if ( v >= mid )
+          {
+          h |= 1 ;
+          lo[b] = mid ;
+          }
+        else hi[b] = mid ;
+        }
+      key[j+i][0] = geohash32[h>>15&31] ;
+      key[j+i][1] = geohash32[h>>10&31] ;
+      key[j+i][2] = geohash32[h>>5&31] ;
+      key[j+i][3] = geohash32[h&31] ;
+      }
+    }
+  }
+
+
+// Buckets while building, found by name through an open hash table.
+typedef struct
+  {
+  gridbucket_t* bucket ;
+  size_t n, size ;
+  int32_t* slot ;               // Bucket number + 1, 0 for empty.
+  size_t nslots ;
+  uint64_t* fill ;              // Second pass, how many are in so far.
+  char* out ;
+  fixrec_t batch[GRID_BATCH] ;
+  size_t k ;
+  int pass ;
+  int err ;
+  } gridbuild_t ;
+
+
+// Name as a number, for hashing.
+static uint32_t
+gridindex_word ( const char* key )
+  {
+  return (uint32_t) (uint8_t) key[0] | (uint32_t) (uint8_t) key[1] << 8 | (uint32_t) (uint8_t) key[2] << 16 | (uint32_t) (uint8_t) key[3] << 24 ;
+  }
+
+
+// Find a bucket, adding it if it's new. -1 if it ran out of memory.
+static long
+gridbuild_find ( gridbuild_t* gb, const char* key )
+  {
+  uint32_t w = gridindex_word ( key ) ;
+  size_t i, mask ;
+  int32_t* bigger ;
+  gridbucket_t* more ;
+  // Keep it under half full.
+  if ( ( gb->n + 1 ) * 2 > gb->nslots )
+    {
+    bigger = calloc ( gb->nslots ? gb->nslots * 2 : 4096, sizeof ( int32_t ) ) ;
+    if ( bigger == NULL ) return -1 ;
+    free ( gb->slot ) ;
+    gb->slot = bigger ;
+    gb->nslots = gb->nslots ? gb->nslots * 2 : 4096 ;
+    for ( i = 0 ; i < gb->n ; i++ )
+      {
+      size_t j = ( gridindex_word ( gb->bucket[i].key ) * 2654435761u ) & ( gb->nslots - 1 ) ;
+      while ( gb->slot[j] ) j = ( j + 1 ) & ( gb->nslots - 1 ) ;
+      gb->slot[j] = (int32_t) i + 1 ;
+      }
+    }
+  mask = gb->nslots - 1 ;
+  for ( i = ( w * 2654435761u ) & mask ; gb->slot[i] ; i = ( i + 1 ) & mask )
+    {
+    if ( gridindex_word ( gb->bucket[gb->slot[i]-1].key ) == w ) return gb->slot[i] - 1 ;
+    }
+  if ( gb->pass ) return -1 ;
+  if ( gb->n == gb->size )
+    {
+    more = realloc ( gb->bucket, ( gb->size * 2 + 1024 ) * sizeof ( gridbucket_t ) ) ;
+    if ( more == NULL ) return -1 ;
+    gb->bucket = more ;
+    gb->size = gb->size * 2 + 1024 ;
+    }
+  memset ( &gb->bucket[gb->n], 0, sizeof ( gridbucket_t ) ) ;
+  memcpy ( gb->bucket[gb->n].key, key, 4 ) ;
+  gb->bucket[gb->n].minlat = gb->bucket[gb->n].minlon = INT32_MAX ;
+  gb->bucket[gb->n].maxlat = gb->bucket[gb->n].maxlon = INT32_MIN ;
+  gb->bucket[gb->n].first = INT64_MAX ;
+  gb->bucket[gb->n].last = INT64_MIN ;
+  gb->slot[i] = (int32_t) gb->n + 1 ;
+  return (long) gb->n++ ;
+  }
+
+
+// Put a batch of records in their buckets: counting them the first time round, copying them in the second.
+static void
+gridbuild_batch ( gridbuild_t* gb )
+  {
+  double lat[GRID_BATCH], lon[GRID_BATCH] ;
+  char key[GRID_BATCH][4] ;
+  gridbucket_t* b ;
+  const fixrec_t* r ;
+  size_t i ;
+  long j ;
+  for ( i = 0 ; i < gb->k ; i++ )
+    {
+    lat[i] = fix_degrees ( gb->batch[i].lat ) ;
+    lon[i] = fix_degrees ( gb->batch[i].lon ) ;
+    }
+  gridindex_keys ( gb->k, lat, lon, key ) ;
+  for ( i = 0 ; i < gb->k && !gb->err ; i++ )
+    {
+    if ( ( j = gridbuild_find ( gb, key[i] ) ) < 0 )
+      {
+      gb->err = gb->pass ? EINVAL : ENOMEM ;
+      break ;
+      }
+    b = &gb->bucket[j] ;
+    r = &gb->batch[i] ;
+    if ( gb->pass )
+      {
+      if ( gb->fill[j] == b->count ) gb->err = EINVAL ;
+      else ( (fixrec_t*) ( gb->out + b->off ) )[gb->fill[j]++] = *r ;
+      continue ;
+      }
+    b->count++ ;
+    if ( r->lat < b->minlat ) b->minlat = r->lat ;
+    if ( r->lat > b->maxlat ) b->maxlat = r->lat ;
+    if ( r->lon < b->minlon ) b->minlon = r->lon ;
+    if ( r->lon > b->maxlon ) b->maxlon = r->lon ;
+    if ( r->time < b->first ) b->first = r->time ;
+    if ( r->time > b->last ) b->last = r->time ;
+    }
+  gb->k = 0 ;
+  }
+
+
+// Each record from the archives.
+static void
+gridbuild_rec ( const fixrec_t* rec, void* user )
+  {
+  gridbuild_t* gb = user ;
+  gb->batch[gb->k++] = *rec ;
+  if ( gb->k == GRID_BATCH ) gridbuild_batch ( gb ) ;
+  }
+
+
+// Go through all the archives.
+static int
+gridbuild_pass ( gridbuild_t* gb, const char* const* archive, int narchives )
+  {
+  trackmap_t tm ;
+  int i, err ;
+  for ( i = 0 ; i < narchives && !gb->err ; i++ )
+    {
+    if ( trackmap_open ( &tm, archive[i] ) < 0 ) return -1 ;
+    madvise ( (void*) tm.map, tm.size, MADV_SEQUENTIAL ) ;
+    if ( trackmap_query ( &tm, INT64_MIN, INT64_MAX, gridbuild_rec, gb ) < 0 )
+      {
+      err = errno ;
+      trackmap_close ( &tm ) ;
+      errno = err ;
+      return -1 ;
+      }
+    trackmap_close ( &tm ) ;
+    }
+  if ( gb->k ) gridbuild_batch ( gb ) ;
+  if ( gb->err ) errno = gb->err ;
+  return gb->err ? -1 : 0 ;
+  }
+
+
+// By name.
+static int
+gridbucket_cmp ( const void* a, const void* b )
+  {
+  return memcmp ( ( (const gridbucket_t*) a )->key, ( (const gridbucket_t*) b )->key, 4 ) ;
+  }
+
+// By time.
+static int
+fixrec_cmp ( const void* a, const void* b )
+  {
+  int64_t ta = ( (const fixrec_t*) a )->time, tb = ( (const fixrec_t*) b )->time ;
+  return ( ta > tb ) - ( ta < tb ) ;
+  }
+
+
+// Build an index of every fix in some track archives. Returns 0, or -1 with errno set.
+int
+gridindex_build ( const char* path, const char* const* archive, int narchives )
+  {
+  gridbuild_t gb ;
+  gridhead_t head ;
+  uint64_t off, size = 0 ;
+  size_t i, j ;
+  char* map = MAP_FAILED ;
+  int fd = -1, err, ret = -1 ;
+  memset ( &gb, 0, sizeof ( gb ) ) ;
+  // Count them.
+  if ( gridbuild_pass ( &gb, archive, narchives ) < 0 ) goto done ;
+  // Lay it out, buckets in name order.
+  qsort ( gb.bucket, gb.n, sizeof ( gridbucket_t ), gridbucket_cmp ) ;
+  if ( gb.slot ) memset ( gb.slot, 0, gb.nslots * sizeof ( int32_t ) ) ;
+  for ( i = 0 ; i < gb.n ; i++ )
+    {
+    j = ( gridindex_word ( gb.bucket[i].key ) * 2654435761u ) & ( gb.nslots - 1 ) ;
+    while ( gb.slot[j] ) j = ( j + 1 ) & ( gb.nslots - 1 ) ;
+    gb.slot[j] = (int32_t) i + 1 ;
+    }
+  off = sizeof ( head ) + gb.n * sizeof ( gridbucket_t ) ;
+  for ( i = 0 ; i < gb.n ; i++ )
+    {
+    gb.bucket[i].off = off ;
+    off += gb.bucket[i].count * sizeof ( fixrec_t ) ;
+    }
+  size = off ;
+  gb.fill = calloc ( gb.n + 1, sizeof ( uint64_t ) ) ;
+  if ( gb.fill == NULL ) goto done ;
+  if ( ( fd = open ( path, O_RDWR | O_CREAT | O_TRUNC, 0644 ) ) < 0 ) goto done ;
+  if ( ftruncate ( fd, size ) < 0 ) goto done ;
+  map = mmap ( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 ) ;
+  if ( map == MAP_FAILED ) goto done ;
+  // Put them in place, then sort any bucket that's not in time order already.
+  gb.out = map ;
+  gb.pass = 1 ;
+  if ( gridbuild_pass ( &gb, archive, narchives ) < 0 ) goto done ;
+  for ( i = 0 ; i < gb.n ; i++ )
+    {
+    fixrec_t* r = (fixrec_t*) ( map + gb.bucket[i].off ) ;
+    if ( gb.fill[i] != gb.bucket[i].count )
+      {
+      errno = EINVAL ;
+      goto done ;
+      }
+    for ( j = 1 ; j < gb.bucket[i].count && r[j-1].time <= r[j].time ; j++ ) ;
+    if ( j < gb.bucket[i].count ) qsort ( r, gb.bucket[i].count, sizeof ( fixrec_t ), fixrec_cmp ) ;
+    }
+  memset ( &head, 0, sizeof ( head ) ) ;
+  memcpy ( head.magic, gridindex_magic, sizeof ( head.magic ) ) ;
+  head.count = gb.n ;
+  memcpy ( map, &head, sizeof ( head ) ) ;
+  memcpy ( map + sizeof ( head ), gb.bucket, gb.n * sizeof ( gridbucket_t ) ) ;
+  if ( msync ( map, size, MS_SYNC ) < 0 ) goto done ;
+  ret = 0 ;
+done :
+  err = errno ;
+  if ( map != MAP_FAILED ) munmap ( map, size ) ;
+  if ( fd >= 0 ) close ( fd ) ;
+  if ( ret < 0 && fd >= 0 ) unlink ( path ) ;
+  free ( gb.bucket ) ;
+  free ( gb.slot ) ;
+  free ( gb.fill ) ;
+  errno = err ;
+  return ret ;
+  }
+
+
+// Map an index to query. Returns 0, or -1 with errno set.
+int
+gridindex_open ( gridindex_t* gi, const char* path )
+  {
+  struct stat st ;
+  const gridhead_t* head ;
+  size_t i ;
+  int fd, err ;
+  memset ( gi, 0, sizeof ( *gi ) ) ;
+  if ( ( fd = open ( path, O_RDONLY ) ) < 0 ) return -1 ;
+  if ( fstat ( fd, &st ) < 0 ) goto fail ;
+  if ( (uint64_t) st.st_size < sizeof ( *head ) )
+    {
+    errno = EINVAL ;
+    goto fail ;
+    }
+  gi->size = st.st_size ;
+  gi->map = mmap ( NULL, gi->size, PROT_READ, MAP_SHARED, fd, 0 ) ;
+  if ( gi->map == MAP_FAILED )
+    {
+    gi->map = NULL ;
+    goto fail ;
+    }
+  close ( fd ) ;
+  fd = -1 ;
+  head = (const gridhead_t*) gi->map ;
+  if ( memcmp ( head->magic, gridindex_magic, sizeof ( head->magic ) ) || head->count > ( gi->size - sizeof ( *head ) ) / sizeof ( gridbucket_t ) )
+    {
+    errno = EINVAL ;
+    goto fail ;
+    }
+  gi->bucket = (const gridbucket_t*) ( gi->map + sizeof ( *head ) ) ;
+  gi->nbuckets = head->count ;
+  for ( i = 0 ; i < gi->nbuckets ; i++ )
+    {
+    if ( gi->bucket[i].off % 8 || gi->bucket[i].off > gi->size || gi->bucket[i].count > ( gi->size - gi->bucket[i].off ) / sizeof ( fixrec_t ) )
+      {
+      errno = EINVAL ;
+      goto fail ;
+      }
+    }
+  return 0 ;
+fail :
+  err = errno ;
+  if ( fd >= 0 ) close ( fd ) ;
+  if ( gi->map ) munmap ( (void*) gi->map, gi->size ) ;
+  memset ( gi, 0, sizeof ( *gi ) ) ;
+  errno = err ;
+  return -1 ;
+  }
+
+
+// Done with it.
+void
+gridindex_close ( gridindex_t* gi )
+  {
+  if ( gi->map ) munmap ( (void*) gi->map, gi->size ) ;
+  memset ( gi, 0, sizeof ( *gi ) ) ;
+  }
+
+
+// Is a longitude in the box? It might go over the date line.
+static int
+gridarea_lon ( const gridarea_t* area, int32_t lo, int32_t hi )
+  {
+  if ( area->minlon <= area->maxlon ) return hi >= area->minlon && lo <= area->maxlon ;
+  return hi >= area->minlon || lo <= area->maxlon ;
+  }
+
+
+// Where the fixes from one bucket are up to, in the merge.
+typedef struct
+  {
+  const fixrec_t* p ;
+  const fixrec_t* end ;
+  } gridcursor_t ;
+
+
+// Put the earliest cursor at the top of the heap.
+static void
+gridheap_down ( gridcursor_t* heap, size_t n, size_t i )
+  {
+  gridcursor_t t ;
+  size_t c ;
+  while ( ( c = 2 * i + 1 ) < n )
+    {
+    if ( c + 1 < n && heap[c+1].p->time < heap[c].p->time ) c++ ;
+    if ( heap[i].p->time <= heap[c].p->time ) break ;
+    t = heap[i] ;
+    heap[i] = heap[c] ;
+    heap[c] = t ;
+    i = c ;
+    }
+  }
+
+
+// First record at or after time t, by binary search.
+static const fixrec_t*
+gridindex_seek ( const fixrec_t* p, const fixrec_t* end, int64_t t )
+  {
+  const fixrec_t* mid ;
+  while ( p < end )
+    {
+    mid = p + ( end - p ) / 2 ;
+    if ( mid->time < t ) p = mid + 1 ;
+    else end = mid ;
+    }
+  return p ;
+  }
+
+
+// Pass every indexed record in an area, timed from first to last inclusive, to onrec, in time order.
+// Only buckets that can have some are looked at. Returns how many there were, or -1 with errno set.
+long
+gridindex_query ( const gridindex_t* gi, const gridarea_t* area, int64_t first, int64_t last, trackmap_cb onrec, void* user )
+  {
+  const gridbucket_t* b ;
+  const fixrec_t* r ;
+  gridcursor_t* heap ;
+  size_t i, n = 0, sq = strlen ( area->square ) ;
+  long found = 0 ;
+  heap = malloc ( ( gi->nbuckets + 1 ) * sizeof ( gridcursor_t ) ) ;
+  if ( heap == NULL ) return -1 ;
+  for ( i = 0 ; i < gi->nbuckets ; i++ )
+    {
+    b = &gi->bucket[i] ;
+    if ( b->count == 0 || b->last < first || b->first > last ) continue ;
+    if ( sq ? memcmp ( b->key, area->square, sq ) != 0
+            : ( b->maxlat < area->minlat || b->minlat > area->maxlat || !gridarea_lon ( area, b->minlon, b->maxlon ) ) ) continue ;
+    r = (const fixrec_t*) ( gi->map + b->off ) ;
+    heap[n].p = gridindex_seek ( r, r + b->count, first ) ;
+    heap[n].end = r + b->count ;
+    if ( heap[n].p < heap[n].end && heap[n].p->time <= last ) n++ ;
+    }
+  for ( i = n ; i-- > 0 ; ) gridheap_down ( heap, n, i ) ;
+  // Merge them, earliest first.
+  while ( n > 0 )
+    {
+    r = heap[0].p++ ;
+    if ( sq || ( r->lat >= area->minlat && r->lat <= area->maxlat && gridarea_lon ( area, r->lon, r->lon ) ) )
+      {
+      found++ ;
+      if ( onrec ) onrec ( r, user ) ;
+      }
+    if ( heap[0].p == heap[0].end || heap[0].p->time > last ) heap[0] = heap[--n] ;
+    gridheap_down ( heap, n, 0 ) ;
+    }
+  free ( heap ) ;
+  return found ;
+  }
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent
@@ -0,0 +1,269 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    Read several GPS devices at once, and merge their fixes.                                                                            */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+// Each device has its own gpsread_t, all serviced from one poll(). Fixes are grouped into epochs by their UTC time, and the best fix
+// from each epoch is passed on, as soon as every device has reported it, a later one turns up, or GPSMERGE_HOLD ms have gone by.
+
+// Needs clock_gettime().
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <termios.h>
+#include "gpsread.h"
+
+// Half a day, for telling earlier from later across midnight.
+#define HALFDAY ( 12 * 3600 * 1000 )
+
+
+// How much a GGA quality indicator is worth. RTK beats differential beats plain GPS, and dead reckoning, manual and simulated
+// positions come last.
+static const uint8_t quality_rank[9] = { 0, 3, 4, 4, 6, 5, 2, 1, 1 } ;
+
+
+// Milliseconds on the monotonic clock.
+static int64_t
+gpsmerge_now ( void )
+  {
+  struct timespec ts ;
+  clock_gettime ( CLOCK_MONOTONIC, &ts ) ;
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000 ;
+  }
+
+
+// Is fix a better than b? Best quality indicator, then most satellites, then lowest HDOP.
+int
+gpsfix_better ( const gpsfix_t* a, const gpsfix_t* b )
+  {
+  int qa = a->quality < 9 ? quality_rank[a->quality] : 0 ;
+  int qb = b->quality < 9 ? quality_rank[b->quality] : 0 ;
+  if ( qa != qb ) return qa > qb ;
+  if ( a->sats != b->sats ) return a->sats > b->sats ;
+  return a->hdop < b->hdop ;
+  }
+
+
+// Pass on the best fix of the epoch, if it hasn't been already.
+void
+gpsmerge_flush ( gpsmerge_t* m )
+  {
+  if ( !m->pending ) return ;
+  m->pending = 0 ;
+  m->epochs++ ;
+  if ( m->onfix ) m->onfix ( &m->best, m->user ) ;
+  }
+
+
+// A fix from one of the devices.
+static void
+gpsmerge_fix ( const gpsfix_t* fix, void* user )
+  {
+  gpsmerge_dev_t* dev = user ;
+  gpsmerge_t* m = dev->merge ;
+  unsigned bit = 1u << ( dev - m->dev ) ;
+  int32_t d ;
+  // No time, no way to line it up with the others.
+  if ( fix->utc < 0 )
+    {
+    gpsmerge_flush ( m ) ;
+    if ( m->onfix ) m->onfix ( fix, m->user ) ;
+    return ;
+    }
+  if ( m->epoch >= 0 )
+    {
+    d = fix->utc - m->epoch ;
+    if ( d < -HALFDAY ) d += 2 * HALFDAY ;
+    else if ( d > HALFDAY ) d -= 2 * HALFDAY ;
+    // Too late, that's been and gone. Unless it's from a device that's already had its say, when its clock's gone back.
+    if ( ( d < 0 && d >= -GPSMERGE_LATE && !( m->seen & bit ) ) || ( d == 0 && !m->pending ) ) return ;
+    // A new epoch, or the clock's gone back, so the last one's as good as it's going to get.
+    if ( d != 0 ) gpsmerge_flush ( m ) ;
+    }
+  if ( !m->pending )
+    {
+    m->epoch = fix->utc ;
+    m->seen = 0 ;
+    m->due = gpsmerge_now ( ) + GPSMERGE_HOLD ;
+    }
+  // Keep a copy, the sentence won't be around for long.
+  if ( !m->pending || gpsfix_better ( fix, &m->best ) )
+    {
+    m->best = *fix ;
+    m->best.rawlen = fix->rawlen < (int) sizeof ( m->raw ) ? fix->rawlen : (int) sizeof ( m->raw ) - 1 ;
+    memcpy ( m->raw, fix->raw, m->best.rawlen ) ;
+    m->raw[m->best.rawlen] = '\0' ;
+    m->best.raw = m->raw ;
+    }
+  m->pending = 1 ;
+  m->seen |= bit ;
+  // Everyone's had their say?
+  if ( ( m->seen & m->live ) == m->live ) gpsmerge_flush ( m ) ;
+  }
+
+
+// Set up to read n devices, that have already been opened with gps_open(). It owns the fds from now on.
+// onfix gets called with user for the best fix of each epoch. Returns -1 with errno set if there are too many, or none.
+int
+gpsmerge_init ( gpsmerge_t* m, const int* fd, int n, gpsread_fix_cb onfix, void* user )
+  {
+  struct termios tio ;
+  int i, baud ;
+  if ( n < 1 || n > GPSMERGE_MAX )
+    {
+    errno = EINVAL ;
+    return -1 ;
+    }
+  memset ( m, 0, sizeof ( *m ) ) ;
+  m->n = n ;
+  m->onfix = onfix ;
+  m->user = user ;
+  m->epoch = -1 ;
+  for ( i = 0 ; i < n ; i++ )
+    {
+    m->dev[i].merge = m ;
+    m->dev[i].fd = fd[i] ;
+    gpsread_init ( &m->dev[i].reader, gpsmerge_fix, &m->dev[i] ) ;
+    // Ttys say how long a byte takes, 10 bits with the start and stop, for working back to when each sentence started.
+    if ( tcgetattr ( fd[i], &tio ) == 0 && ( baud = map_baud ( cfgetispeed ( &tio ) ) ) > 0 ) m->dev[i].reader.bytens = 10000000000LL / baud ;
+    m->live |= 1u << i ;
+    }
+  return 0 ;
+  }
+
+
+// Close all the devices that are left.
+void
+gpsmerge_close ( gpsmerge_t* m )
+  {
+  int i ;
+  for ( i = 0 ; i < m->n ; i++ )
+    {
+    if ( m->dev[i].fd >= 0 ) close ( m->dev[i].fd ) ;
+    m->dev[i].fd = -1 ;
+    }
+  m->live = 0 ;
+  }
+
+
+// Add up the counts from every device, gone or not.
+void
+gpsmerge_stats ( const gpsmerge_t* m, gpsstats_t* st )
+  {
+  int i ;
+  for ( i = 0 ; i < m->n ; i++ ) gpsread_stats ( &m->dev[i].reader, st ) ;
+  }
+
+
+// How long to wait, given the caller wants no more than timeout ms, or forever if it's negative, and an epoch may be due.
+int
+gpsmerge_wait ( const gpsmerge_t* m, int timeout )
+  {
+  int64_t left ;
+  if ( !m->pending ) return timeout ;
+  left = m->due - gpsmerge_now ( ) ;
+  if ( left < 0 ) left = 0 ;
+  return ( timeout < 0 || left < timeout ) ? (int) left : timeout ;
+  }
+
+
+// Send on the epoch if it's waited long enough for any stragglers.
+void
+gpsmerge_tick ( gpsmerge_t* m )
+  {
+  if ( m->pending && gpsmerge_now ( ) >= m->due ) gpsmerge_flush ( m ) ;
+  }
+
+
+// Read and push whatever device i has. Returns how many bytes, 0 if there weren't any, or -1 with errno set if the device has gone, in
+// which case it's closed and the rest carry on without it.
+ssize_t
+gpsmerge_service ( gpsmerge_t* m, int i )
+  {
+  gpsmerge_dev_t* dev = &m->dev[i] ;
+  char rxbuf[4096] ;
+  unsigned long sentences ;
+  ssize_t got ;
+  int err ;
+  if ( dev->fd < 0 ) return 0 ;
+  got = read ( dev->fd, rxbuf, sizeof ( rxbuf ) ) ;
+  if ( got < 0 && ( errno == EAGAIN || errno == EINTR ) )
+    {
+    dev->reader.stats.empty++ ;
+    return 0 ;
+    }
+  if ( got <= 0 )
+    {
+    err = got ? errno : EIO ;
+    close ( dev->fd ) ;
+    dev->fd = -1 ;
+    m->live &= ~( 1u << i ) ;
+    // The rest might all be in already.
+    if ( m->pending && ( m->seen & m->live ) == m->live ) gpsmerge_flush ( m ) ;
+    errno = err ;
+    return -1 ;
+    }
+  gpsread_clock ( &dev->reader ) ;
+  dev->reader.stats.reads++ ;
+  sentences = dev->reader.stats.sentences ;
+  gpsread_push ( &dev->reader, rxbuf, got ) ;
+  m->sentences += dev->reader.stats.sentences - sentences ;
+  return got ;
+  }
+
+
+// Wait up to timeout ms, or forever if it's negative, for any of the devices, then read and push everything that's there.
+// Returns how many bytes, 0 if it timed out, a device went or a signal came in, or -1 with errno set once every device has gone.
+ssize_t
+gpsmerge_read ( gpsmerge_t* m, int timeout )
+  {
+  struct pollfd pfd[GPSMERGE_MAX] ;
+  ssize_t got, total ;
+  unsigned live ;
+  int64_t until = timeout < 0 ? 0 : gpsmerge_now ( ) + timeout ;
+  int i, ready, wait, err = EIO ;
+  for ( i = 0 ; i < m->n ; i++ )
+    {
+    pfd[i].fd = m->dev[i].fd ;
+    pfd[i].events = POLLIN ;
+    }
+  while ( m->live )
+    {
+    wait = -1 ;
+    if ( timeout >= 0 && ( wait = until - gpsmerge_now ( ) ) < 0 ) wait = 0 ;
+    ready = poll ( pfd, m->n, gpsmerge_wait ( m, wait ) ) ;
+    // Let the caller see whatever the signal was for.
+    if ( ready < 0 && errno == EINTR ) return 0 ;
+    if ( ready < 0 ) return -1 ;
+    gpsmerge_tick ( m ) ;
+    if ( ready == 0 )
+      {
+      if ( timeout >= 0 && gpsmerge_now ( ) >= until ) return 0 ;
+      continue ;
+      }
+    total = 0 ;
+    live = m->live ;
+    for ( i = 0 ; i < m->n ; i++ )
+      {
+      if ( !pfd[i].revents ) continue ;
+      if ( ( got = gpsmerge_service ( m, i ) ) < 0 )
+        {
+        err = errno ;
+        pfd[i].fd = -1 ;
+        }
+      else total += got ;
+      }
+    if ( total || ( live != m->live && m->live ) ) return total ;
+    }
+  errno = err ;
+  return -1 ;
+  }
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent
@@ -0,0 +1,73 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    RadioHams' Maidenhead grid locators.                                                                                                */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+#include <math.h>
+#include "gpsread.h"
+
+
+// Each pair of characters splits the one before it up. Field, square, subsquare, extended square and extended subsquare.
+// div is how many of the smallest cells each step is, there are 18*10*24*10*24 = 1036800 of them each way.
+static const struct
+  {
+  long div ;
+  int base ;
+  char first ;
+  } mhead_step[MHEAD_MAXLEN/2] =
+  {
+    { 57600L, 18, 'A' },
+    {  5760L, 10, '0' },
+    {   240L, 24, 'a' },
+    {    24L, 10, '0' },
+    {     1L, 24, 'a' },
+  } ;
+
+
+// Converts lat/long to a Maidenhead locator. Lat and Lon are in decimal degrees.
+// chars is the length wanted, 2, 4, 6, 8 or 10. Writes that many characters and a '\0' to loc. Returns the length.
+int
+LLtoMaidenhead ( const double lat, const double lon, int chars, char* loc )
+  {
+  long x, y ;
+  int i ;
+  if ( chars < 2 ) chars = 2 ;
+  if ( chars > MHEAD_MAXLEN ) chars = MHEAD_MAXLEN ;
+  chars &= ~1 ;
+  // Which of the smallest cells, 1/2880th of a degree wide, 1/5760th high.
+  x = (long) floor ( ( lon + 180.0 ) * 2880.0 ) ;
+  y = (long) floor ( ( lat +  90.0 ) * 5760.0 ) ;
+  // The poles and the date line belong to the last cell.
+  if ( x < 0 ) x = 0 ;
+  if ( x > 1036799L ) x = 1036799L ;
+  if ( y < 0 ) y = 0 ;
+  if ( y > 1036799L ) y = 1036799L ;
+  for ( i = 0 ; i < chars / 2 ; i++ )
+    {
+    loc[2*i]   = mhead_step[i].first + ( x / mhead_step[i].div ) % mhead_step[i].base ;
+    loc[2*i+1] = mhead_step[i].first + ( y / mhead_step[i].div ) % mhead_step[i].base ;
+    }
+  loc[chars] = '\0' ;
+  return chars ;
+  }
+
+
+// Converts arrays of lat/long to Maidenhead locators, chars long.
+// loc gets count locators, each followed by a '\0', so it needs count * ( chars + 1 ) bytes.
+void
+LLtoMaidenheadv ( size_t count, const double* lat, const double* lon, int chars, char* loc )
+  {
+  size_t i ;
+  int len ;
+  for ( i = 0 ; i < count ; i++ )
+    {
+    len = LLtoMaidenhead ( lat[i], lon[i], chars, loc ) ;
+    loc += len + 1 ;
+    }
+  }
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent
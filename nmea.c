@@ -0,0 +1,579 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    NMEA sentence framing and parsing for gpsread.                                                                                      */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+#include <string.h>
+// Wide compares and XORs, where there are any.
+#if defined ( __SSE2__ )
+  #include <immintrin.h>
+#endif
+#include "gpsread.h"
+
+
+// Longest sentence body we'll hold, not counting the '$'.
+#define NMEA_MAXLEN 254
+
+
+// Get ready to look for the start of a sentence.
+void
+nmea_reset ( nmea_framer_t* fr )
+  {
+  fr->state = 0 ;
+  fr->len = 0 ;
+  }
+
+
+// Set up a new framer, with how fussy to be about checksums.
+void
+nmea_init ( nmea_framer_t* fr, nmea_check_t check )
+  {
+  fr->check = check ;
+  fr->starts = fr->overflows = fr->badsums = 0 ;
+  nmea_reset ( fr ) ;
+  }
+
+
+// Find the first c in [p, end), or NULL.
+// Compares 32 or 16 bytes at a time where the CPU can, then mops up the rest a byte at a time.
+static const char*
+nmea_find ( const char* p, const char* end, char c )
+  {
+#if defined ( __SSE2__ )
+  int mask ;
+#endif
+#if defined ( __AVX2__ )
+  const __m256i c32 = _mm256_set1_epi8 ( c ) ;
+  for ( ; end - p >= 32 ; p += 32 )
+    {
+    mask = _mm256_movemask_epi8 ( _mm256_cmpeq_epi8 ( _mm256_loadu_si256 ( (const __m256i*) p ), c32 ) ) ;
+    if ( mask ) return p + __builtin_ctz ( mask ) ;
+    }
+#endif
+#if defined ( __SSE2__ )
+  const __m128i c16 = _mm_set1_epi8 ( c ) ;
+  for ( ; end - p >= 16 ; p += 16 )
+    {
+    mask = _mm_movemask_epi8 ( _mm_cmpeq_epi8 ( _mm_loadu_si128 ( (const __m128i*) p ), c16 ) ) ;
+    if ( mask ) return p + __builtin_ctz ( mask ) ;
+    }
+#endif
+  for ( ; p < end ; p++ ) if ( *p == c ) return p ;
+  return NULL ;
+  }
+
+
+// XOR of all the bytes, as used by NMEA checksums.
+// Same again, XOR 32 or 16 bytes at a time, then fold the lanes together.
+static unsigned
+nmea_xor ( const char* p, size_t n )
+  {
+  unsigned x = 0 ;
+#if defined ( __SSE2__ )
+  __m128i acc = _mm_setzero_si128 ( ) ;
+#if defined ( __AVX2__ )
+  __m256i acc32 = _mm256_setzero_si256 ( ) ;
+  for ( ; n >= 32 ; p += 32, n -= 32 ) acc32 = _mm256_xor_si256 ( acc32, _mm256_loadu_si256 ( (const __m256i*) p ) ) ;
+  acc = _mm_xor_si128 ( _mm256_castsi256_si128 ( acc32 ), _mm256_extracti128_si256 ( acc32, 1 ) ) ;
+#endif
+  for ( ; n >= 16 ; p += 16, n -= 16 ) acc = _mm_xor_si128 ( acc, _mm_loadu_si128 ( (const __m128i*) p ) ) ;
+  acc = _mm_xor_si128 ( acc, _mm_srli_si128 ( acc, 8 ) ) ;
+  acc = _mm_xor_si128 ( acc, _mm_srli_si128 ( acc, 4 ) ) ;
+  acc = _mm_xor_si128 ( acc, _mm_srli_si128 ( acc, 2 ) ) ;
+  acc = _mm_xor_si128 ( acc, _mm_srli_si128 ( acc, 1 ) ) ;
+  x = _mm_cvtsi128_si32 ( acc ) & 0xff ;
+#endif
+  for ( ; n > 0 ; p++, n-- ) x ^= (unsigned char) *p ;
+  return x ;
+  }
+
+
+// Value of a hex digit, or -1.
+static int
+nmea_hex ( char c )
+  {
+  if ( c >= '0' && c <= '9' ) return c - '0' ;
+  if ( c >= 'A' && c <= 'F' ) return c - 'A' + 10 ;
+  if ( c >= 'a' && c <= 'f' ) return c - 'a' + 10 ;
+  return -1 ;
+  }
+
+
+// Check the "*hh" on the end of a sentence, as given by nmea_frame().
+// Returns 1 if it's right, 0 if there isn't one, -1 if it's wrong.
+int
+nmea_checksum ( const char* sentence, int slen )
+  {
+  int hi, lo ;
+  if ( slen < 3 || sentence[slen-3] != '*' ) return 0 ;
+  hi = nmea_hex ( sentence[slen-2] ) ;
+  lo = nmea_hex ( sentence[slen-1] ) ;
+  if ( hi < 0 || lo < 0 ) return -1 ;
+  return ( nmea_xor ( sentence, slen - 3 ) == (unsigned) ( hi * 16 + lo ) ) ? 1 : -1 ;
+  }
+
+
+// Pull the next sentence out of a block of bytes.
+// Returns how many bytes were used up. If a whole sentence was found, *sentence points at the text between the '$' and the '\r', and *slen
+// is its length. That's either straight into data, or into the framer's own buffer if it was split over blocks, so it's only good until the
+// next call. Anything left over is kept for next time. Sentences failing the checksum are dropped here.
+size_t
+nmea_frame ( nmea_framer_t* fr, const char* data, size_t len, const char** sentence, int* slen )
+  {
+  const char* p = data ;
+  const char* end = data + len ;
+  const char* cr ;
+  size_t n ;
+  *sentence = NULL ;
+  *slen = 0 ;
+  while ( p < end )
+    {
+    // Don't save until the start of a sentence.
+    if ( fr->state == 0 )
+      {
+      p = nmea_find ( p, end, '$' ) ;
+      if ( p == NULL ) return len ;
+      p++ ;
+      fr->state = 1 ;
+      fr->len = 0 ;
+      fr->starts++ ;
+      continue ;
+      }
+    // Look for the end.
+    cr = nmea_find ( p, end, '\r' ) ;
+    n = ( cr ? cr : end ) - p ;
+    // This has gone on too long, drop the one that didn't fit and give up.
+    if ( fr->len + n > NMEA_MAXLEN )
+      {
+      p += NMEA_MAXLEN - fr->len + 1 ;
+      nmea_reset ( fr ) ;
+      fr->overflows++ ;
+      continue ;
+      }
+    // Not finished yet, save what we've got.
+    if ( cr == NULL )
+      {
+      memcpy ( fr->buffer + fr->len, p, n ) ;
+      fr->len += n ;
+      return len ;
+      }
+    // All in this block, no need to copy.
+    if ( fr->len == 0 )
+      {
+      *sentence = p ;
+      *slen = n ;
+      }
+    // Stitch it together.
+    else
+      {
+      memcpy ( fr->buffer + fr->len, p, n ) ;
+      fr->len += n ;
+      fr->buffer[fr->len] = '\0' ;
+      *sentence = fr->buffer ;
+      *slen = fr->len ;
+      }
+    nmea_reset ( fr ) ;
+    // Corrupt? Try for the next one.
+    if ( fr->check != NMEA_CHECK_OFF && nmea_checksum ( *sentence, *slen ) < ( fr->check == NMEA_CHECK_REQUIRE ? 1 : 0 ) )
+      {
+      *sentence = NULL ;
+      *slen = 0 ;
+      p = cr + 1 ;
+      fr->badsums++ ;
+      continue ;
+      }
+    return cr + 1 - data ;
+    }
+  return len ;
+  }
+
+
+// Find the comma separated fields after the sentence name, up to the '*'.
+// Saves where each one is, rather than copying them. Returns how many there were, at most max.
+int
+nmea_fields ( const char* sentence, int slen, nmea_field_t* field, int max )
+  {
+  int i, n = 0, start ;
+  // Ignore the checksum.
+  if ( slen >= 3 && sentence[slen-3] == '*' ) slen -= 3 ;
+  // Skip the name.
+  for ( i = 0 ; i < slen && sentence[i] != ',' ; i++ ) ;
+  if ( i >= slen ) return 0 ;
+  for ( start = ++i ; n < max ; i++ )
+    {
+    if ( i == slen || sentence[i] == ',' )
+      {
+      field[n].off = start ;
+      field[n].len = i - start ;
+      n++ ;
+      start = i + 1 ;
+      if ( i == slen ) break ;
+      }
+    }
+  return n ;
+  }
+
+
+// Unsigned whole number, with a fixed number of decimal places kept, rounded. -1 if it's empty or not a number.
+static int32_t
+nmea_fixed ( const char* p, int len, int places )
+  {
+  int32_t v = 0 ;
+  int i = 0, seen = 0 ;
+  for ( ; i < len && p[i] >= '0' && p[i] <= '9' ; i++, seen++ )
+    {
+    if ( v > INT32_MAX / 10 - 1 ) return -1 ;
+    v = v * 10 + ( p[i] - '0' ) ;
+    }
+  if ( i < len && p[i] == '.' ) i++ ;
+  for ( ; places > 0 ; places-- )
+    {
+    if ( v > INT32_MAX / 10 - 1 ) return -1 ;
+    v *= 10 ;
+    if ( i < len && p[i] >= '0' && p[i] <= '9' )
+      {
+      v += p[i++] - '0' ;
+      seen++ ;
+      }
+    }
+  // Round on the next digit.
+  if ( i < len && p[i] >= '5' && p[i] <= '9' ) v++ ;
+  for ( ; i < len && p[i] >= '0' && p[i] <= '9' ; i++ ) ;
+  return ( seen && i == len ) ? v : -1 ;
+  }
+
+
+// Signed version of the above. INT32_MIN if it's no good.
+static int32_t
+nmea_signed ( const char* p, int len, int places )
+  {
+  int32_t v ;
+  if ( len > 0 && p[0] == '-' )
+    {
+    v = nmea_fixed ( p + 1, len - 1, places ) ;
+    return ( v < 0 ) ? INT32_MIN : -v ;
+    }
+  v = nmea_fixed ( p, len, places ) ;
+  return ( v < 0 ) ? INT32_MIN : v ;
+  }
+
+
+// The [d]ddmm.mmmmm lat or lon format, and hemisphere, to signed 1/100000ths of a minute. INT32_MIN if it's no good.
+static int32_t
+nmea_coord ( const char* p, int len, char hemi, int maxdeg )
+  {
+  int32_t v = nmea_fixed ( p, len, 5 ) ;
+  int32_t deg, min ;
+  if ( v < 0 ) return INT32_MIN ;
+  // That's degrees * 100 + minutes, scaled up.
+  deg = v / ( 100 * FIX_MINUTE ) ;
+  min = v % ( 100 * FIX_MINUTE ) ;
+  if ( min > 60 * FIX_MINUTE ) return INT32_MIN ;
+  v = deg * FIX_DEGREE + min ;
+  if ( v > maxdeg * FIX_DEGREE ) return INT32_MIN ;
+  if ( hemi == 'S' || hemi == 'W' ) return -v ;
+  if ( hemi == 'N' || hemi == 'E' ) return v ;
+  return INT32_MIN ;
+  }
+
+
+// The hhmmss.sss time format to milliseconds since midnight. -1 if it's no good.
+static int32_t
+nmea_time ( const char* p, int len )
+  {
+  int32_t v = nmea_fixed ( p, len, 3 ) ;
+  int32_t h, m, sec ;
+  if ( v < 0 || len < 6 ) return -1 ;
+  h = v / 10000000 ;
+  m = v / 100000 % 100 ;
+  sec = v % 100000 ;
+  if ( h > 23 || m > 59 || sec > 60999 ) return -1 ;
+  return ( h * 60 + m ) * 60000 + sec ;
+  }
+
+
+// ddmmyy date format to days since 1 Jan 1970. -1 if it's no good.
+static int32_t
+nmea_date ( const char* p, int len )
+  {
+  int32_t v = nmea_fixed ( p, len, 0 ) ;
+  int32_t d, m, y, era, yoe, doy, doe ;
+  if ( v < 0 || len != 6 ) return -1 ;
+  d = v / 10000 ;
+  m = v / 100 % 100 ;
+  y = v % 100 ;
+  if ( d < 1 || d > 31 || m < 1 || m > 12 ) return -1 ;
+  // Two digit years, GPS didn't exist before 1980.
+  y += ( y < 80 ) ? 2000 : 1900 ;
+  // Howard Hinnant's days_from_civil().
+  y -= ( m <= 2 ) ;
+  era = y / 400 ;
+  yoe = y - era * 400 ;
+  doy = ( 153 * ( m + ( m > 2 ? -3 : 9 ) ) + 2 ) / 5 + d - 1 ;
+  doe = yoe * 365 + yoe / 4 - yoe / 100 + doy ;
+  return era * 146097 + doe - 719468 ;
+  }
+
+
+// Keep the date from the last RMC up with a GGA's time. If that's more than 12 hours behind the RMC's, it's gone past midnight since,
+// which happens every day when the GGA comes first in each second. More than 12 hours ahead, the RMC was the one after midnight.
+static void
+nmea_dateutc ( gpsfix_t* fix )
+  {
+  int32_t diff ;
+  if ( fix->date < 0 || fix->dateutc < 0 || fix->utc < 0 ) return ;
+  diff = fix->utc - fix->dateutc ;
+  if ( diff < -43200000 ) fix->date++ ;
+  else if ( diff > 43200000 ) fix->date-- ;
+  fix->dateutc = fix->utc ;
+  }
+
+
+// Where the fields are, for the parsers. Any missing off the end are empty.
+#define F(N) ( sentence + field[N].off ), field[N].len
+#define C(N) ( field[N].len ? sentence[field[N].off] : '\0' )
+#define FIELDS(MIN) \
+  do { n = nmea_fields ( sentence, slen, field, sizeof ( field ) / sizeof ( field[0] ) ) ; \
+       if ( n < (MIN) ) return 0 ; \
+       for ( ; n < (int) ( sizeof ( field ) / sizeof ( field[0] ) ) ; n++ ) field[n].off = field[n].len = 0 ; } while ( 0 )
+
+
+// GGA, position and quality. This is what makes a fix.
+static int
+nmea_parse_gga ( const char* sentence, int slen, gpsfix_t* fix )
+  {
+  nmea_field_t field[14] ;
+  int32_t v ;
+  int n ;
+  /*
+  0    = UTC of Position
+  1    = Latitude
+  2    = N or S
+  3    = Longitude
+  4    = E or W
+  5    = GPS quality indicator (0=invalid; 1=GPS fix; 2=Diff. GPS fix)
+  6    = Number of satellites in use [not those in view]
+  7    = Horizontal dilution of position
+  8    = Antenna altitude above/below mean sea level (geoid)
+  9    = Meters  (Antenna height unit)
+  10   = Geoidal separation (Diff. between WGS-84 earth ellipsoid and
+         mean sea level.  -=geoid is below WGS-84 ellipsoid)
+  11   = Meters  (Units of geoidal separation)
+  12   = Age in seconds since last update from diff. reference station
+  13   = Diff. reference station ID#
+  14   = Checksum
+  */
+  // Need at least up to the quality.
+  FIELDS ( 6 ) ;
+  // Got a good reading?
+  v = nmea_fixed ( F(5), 0 ) ;
+  if ( v <= 0 || v > 255 ) return 0 ;
+  fix->quality = v ;
+  // Save it!
+  fix->lat = nmea_coord ( F(1), C(2), 90 ) ;
+  fix->lon = nmea_coord ( F(3), C(4), 180 ) ;
+  if ( fix->lat == INT32_MIN || fix->lon == INT32_MIN ) return 0 ;
+  fix->utc = nmea_time ( F(0) ) ;
+  nmea_dateutc ( fix ) ;
+  // The rest is nice to have.
+  v = nmea_fixed ( F(6), 0 ) ;
+  fix->sats = ( v < 0 || v > 255 ) ? 0 : v ;
+  v = nmea_fixed ( F(7), 2 ) ;
+  fix->hdop = ( v < 0 || v > INT16_MAX ) ? INT16_MAX : v ;
+  fix->alt = nmea_signed ( F(8), 2 ) ;
+  if ( fix->alt == INT32_MIN ) fix->alt = 0 ;
+  fix->raw = sentence ;
+  fix->rawlen = slen ;
+  return 1 ;
+  }
+
+
+// RMC, the date, speed and course.
+static int
+nmea_parse_rmc ( const char* sentence, int slen, gpsfix_t* fix )
+  {
+  nmea_field_t field[12] ;
+  int32_t v ;
+  int n ;
+  /*
+  0    = UTC of position fix
+  1    = Status A=active or V=void
+  2    = Latitude
+  3    = N or S
+  4    = Longitude
+  5    = E or W
+  6    = Speed over the ground in knots
+  7    = Track angle in degrees, true
+  8    = Date, ddmmyy
+  9    = Magnetic variation
+  10   = E or W
+  11   = Mode (NMEA 2.3 and later), N=not valid
+  */
+  FIELDS ( 9 ) ;
+  if ( C(1) != 'A' || C(11) == 'N' ) return 0 ;
+  fix->date = nmea_date ( F(8) ) ;
+  fix->dateutc = ( fix->date < 0 ) ? -1 : nmea_time ( F(0) ) ;
+  // Knots to cm/s.
+  v = nmea_fixed ( F(6), 3 ) ;
+  fix->speed = ( v < 0 ) ? -1 : (int32_t) ( ( v * 514444LL + 5000000 ) / 10000000 ) ;
+  fix->course = nmea_fixed ( F(7), 2 ) ;
+  return 1 ;
+  }
+
+
+// VTG, speed and course on their own.
+static int
+nmea_parse_vtg ( const char* sentence, int slen, gpsfix_t* fix )
+  {
+  nmea_field_t field[9] ;
+  int32_t v ;
+  int n ;
+  /*
+  0    = Track, degrees true
+  1    = T
+  2    = Track, degrees magnetic
+  3    = M
+  4    = Speed in knots
+  5    = N
+  6    = Speed in km/h
+  7    = K
+  8    = Mode (NMEA 2.3 and later), N=not valid
+  */
+  FIELDS ( 8 ) ;
+  if ( C(8) == 'N' ) return 0 ;
+  // km/h to cm/s, or knots if that's all there is.
+  if ( ( v = nmea_fixed ( F(6), 3 ) ) >= 0 ) fix->speed = ( v + 18 ) / 36 ;
+  else if ( ( v = nmea_fixed ( F(4), 3 ) ) >= 0 ) fix->speed = (int32_t) ( ( v * 514444LL + 5000000 ) / 10000000 ) ;
+  else return 0 ;
+  fix->course = nmea_fixed ( F(0), 2 ) ;
+  return 1 ;
+  }
+
+
+// GSA, 2D or 3D, and the other DOPs.
+static int
+nmea_parse_gsa ( const char* sentence, int slen, gpsfix_t* fix )
+  {
+  nmea_field_t field[17] ;
+  int32_t v ;
+  int n ;
+  /*
+  0    = Selection mode, M=manual or A=automatic
+  1    = Mode, 1=no fix, 2=2D, 3=3D
+  2-13 = PRNs of satellites used
+  14   = PDOP
+  15   = HDOP
+  16   = VDOP
+  */
+  FIELDS ( 17 ) ;
+  v = nmea_fixed ( F(1), 0 ) ;
+  if ( v < 1 || v > 3 ) return 0 ;
+  fix->mode = v ;
+  v = nmea_fixed ( F(14), 2 ) ;
+  fix->pdop = ( v < 0 || v > INT16_MAX ) ? INT16_MAX : v ;
+  v = nmea_fixed ( F(16), 2 ) ;
+  fix->vdop = ( v < 0 || v > INT16_MAX ) ? INT16_MAX : v ;
+  return 1 ;
+  }
+
+#undef F
+#undef C
+#undef FIELDS
+
+
+// Four characters packed into a word, the first in the low byte.
+#define PACK(A,B,C,D) ( (uint32_t) (uint8_t) (A) | (uint32_t) (uint8_t) (B) << 8 | (uint32_t) (uint8_t) (C) << 16 | (uint32_t) (uint8_t) (D) << 24 )
+
+
+// What sort of sentence is it? Talker and type are each one packed compare, without looking at any fields.
+nmea_type_t
+nmea_type ( const char* sentence, int slen )
+  {
+  if ( slen < 6 ) return NMEA_NONE ;
+  // GPS, any GNSS, GLONASS, Galileo, BeiDou (both ways) and QZSS.
+  switch ( PACK ( sentence[0], sentence[1], 0, 0 ) )
+    {
+    case PACK ( 'G', 'P', 0, 0 ) :
+    case PACK ( 'G', 'N', 0, 0 ) :
+    case PACK ( 'G', 'L', 0, 0 ) :
+    case PACK ( 'G', 'A', 0, 0 ) :
+    case PACK ( 'G', 'B', 0, 0 ) :
+    case PACK ( 'B', 'D', 0, 0 ) :
+    case PACK ( 'G', 'Q', 0, 0 ) :
+      break ;
+    default :
+      return NMEA_NONE ;
+    }
+  switch ( PACK ( sentence[2], sentence[3], sentence[4], sentence[5] ) )
+    {
+    case PACK ( 'G', 'G', 'A', ',' ) :
+      return NMEA_GGA ;
+    case PACK ( 'R', 'M', 'C', ',' ) :
+      return NMEA_RMC ;
+    case PACK ( 'G', 'S', 'A', ',' ) :
+      return NMEA_GSA ;
+    case PACK ( 'V', 'T', 'G', ',' ) :
+      return NMEA_VTG ;
+    default :
+      return NMEA_NONE ;
+    }
+  }
+
+#undef PACK
+
+
+// Parser for each type, by nmea_type_t.
+static int ( * const nmea_parsers[] ) ( const char*, int, gpsfix_t* ) =
+  {
+  NULL, nmea_parse_gga, nmea_parse_rmc, nmea_parse_gsa, nmea_parse_vtg
+  } ;
+
+
+// Parse a sentence, as given by nmea_frame(), into the parts of fix it has. Everything else in fix is left alone, so one record can
+// collect all the sentences for an epoch. Types nobody wants are skipped without being split into fields.
+// Returns the type if it was good, NMEA_NONE if it was skipped, or minus the type if it was no good.
+int
+nmea_parse ( const char* sentence, int slen, gpsfix_t* fix )
+  {
+  nmea_type_t type = nmea_type ( sentence, slen ) ;
+  if ( type == NMEA_NONE ) return NMEA_NONE ;
+  return nmea_parsers[type] ( sentence, slen, fix ) ? (int) type : -(int) type ;
+  }
+
+
+// Parse a GGA sentence, as given by nmea_frame(), from any talker.
+// Works straight from the sentence, no copying. Returns 1 and fills in the GGA parts of fix if it's a good reading, 0 otherwise.
+int
+nmea_gga ( const char* sentence, int slen, gpsfix_t* fix )
+  {
+  return nmea_type ( sentence, slen ) == NMEA_GGA && nmea_parse_gga ( sentence, slen, fix ) ;
+  }
+
+
+// Nothing known yet.
+void
+gpsfix_init ( gpsfix_t* fix )
+  {
+  memset ( fix, 0, sizeof ( *fix ) ) ;
+  fix->utc = -1 ;
+  fix->hdop = fix->pdop = fix->vdop = INT16_MAX ;
+  fix->date = fix->dateutc = -1 ;
+  fix->speed = -1 ;
+  fix->course = -1 ;
+  }
+
+
+// Fixed-point lat or lon to decimal degrees.
+double
+fix_degrees ( int32_t v )
+  {
+  int32_t a = ( v < 0 ) ? -v : v ;
+  double d = a / FIX_DEGREE + ( a % FIX_DEGREE ) / (double) FIX_MINUTE / 60.0 ;
+  return ( v < 0 ) ? -d : d ;
+  }
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent
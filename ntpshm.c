@@ -0,0 +1,84 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    Feed fix times to ntpd or chrony, through the NTP shared memory refclock.                                                           */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+// Each sample is the UTC from a GGA, against the system clock when its '$' came in. The segment's a System V one, keyed "NTP0" plus the
+// unit, as the SHM drivers expect. They copy the sample if valid is set and the count didn't change while they did, then clear valid.
+
+#include <string.h>
+#include <errno.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include "gpsread.h"
+
+// About a millisecond, 2^-10 s. GGA only gives the time to that, and serial stamping isn't much better.
+#define NTPSHM_PRECISION ( -10 )
+#define DAY_MS 86400000LL
+
+
+// Attach to the segment for a unit, creating it if the NTP daemon hasn't. Units 0 and 1 are root's only, as ntpd expects, the rest
+// anyone's. Returns NULL with errno set if it can't.
+ntpshm_t*
+ntpshm_open ( int unit )
+  {
+  ntpshm_t* shm ;
+  int id ;
+  if ( unit < 0 || unit > 255 )
+    {
+    errno = EINVAL ;
+    return NULL ;
+    }
+  id = shmget ( NTPSHM_KEY + unit, sizeof ( ntpshm_t ), IPC_CREAT | ( unit < 2 ? 0600 : 0666 ) ) ;
+  if ( id < 0 ) return NULL ;
+  shm = shmat ( id, NULL, 0 ) ;
+  if ( shm == (void*) -1 ) return NULL ;
+  shm->mode = 1 ;
+  shm->precision = NTPSHM_PRECISION ;
+  shm->nsamples = 3 ;
+  return shm ;
+  }
+
+
+// Detach. The segment stays, for next time.
+void
+ntpshm_close ( ntpshm_t* shm )
+  {
+  shmdt ( shm ) ;
+  }
+
+
+// Publish a fix's time, against the system clock when it was heard.
+// The day is the one that puts it nearest the system clock, which has to be within 12 hours anyway. The RMC's date isn't used, as a
+// GPS that sends GGA first would pair 00:00:00 with yesterday's date, a day out, at every midnight.
+// Returns 1 if it did, 0 if the fix has no time, no position, or no stamp.
+int
+ntpshm_publish ( ntpshm_t* shm, const gpsfix_t* fix )
+  {
+  int64_t clock, day ;
+  int64_t real = fix->heardreal ;
+  if ( fix->utc < 0 || fix->quality == 0 || real <= 0 ) return 0 ;
+  day = real / 1000000 - fix->utc + DAY_MS / 2 ;
+  day = ( day >= 0 ) ? day / DAY_MS : ( day - DAY_MS + 1 ) / DAY_MS ;
+  clock = day * DAY_MS + fix->utc ;
+  // Counted before and after, so a reader can tell if it changed under them.
+  __atomic_store_n ( &shm->count, shm->count + 1, __ATOMIC_RELAXED ) ;
+  __atomic_thread_fence ( __ATOMIC_RELEASE ) ;
+  shm->clockTimeStampSec = clock / 1000 ;
+  shm->clockTimeStampUSec = clock % 1000 * 1000 ;
+  shm->clockTimeStampNSec = clock % 1000 * 1000000 ;
+  shm->receiveTimeStampSec = real / 1000000000 ;
+  shm->receiveTimeStampUSec = real % 1000000000 / 1000 ;
+  shm->receiveTimeStampNSec = real % 1000000000 ;
+  shm->leap = 0 ;
+  __atomic_thread_fence ( __ATOMIC_RELEASE ) ;
+  __atomic_store_n ( &shm->count, shm->count + 1, __ATOMIC_RELAXED ) ;
+  __atomic_store_n ( &shm->valid, 1, __ATOMIC_RELEASE ) ;
+  return 1 ;
+  }
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent
@@ -1,4 +1,15 @@
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "gpsread.h"
 
 // Written by Chuck Gantz - chuck.gantz@globalstar.com
 // Compressed for AVR by Bill Hill - bugs@wbh.org
@@ -12,15 +23,235 @@ static const double eccP = 0.006715334668516 ;
 static const double lonOR = -0.034906585039887 ;
 static const double latOR = +0.855211333477221 ;
 
+
+// GPS positions are WGS84, OSGB grid references are OSGB36, on the Airy ellipsoid, about 100m apart around Britain. The shift from
+// one to the other is looked up in a grid of corrections, like the Ordnance Survey's OSTN15 one, and interpolated between the four
+// nodes around a point. The grid is a file, mapped in once, from osgb_datum_open(). Until then, positions are used as they are. It's
+// the one thing in the library shared between threads: it's filled in first, then published with a single atomic store, so a
+// conversion on another thread sees either all of it or none.
+//
+// The file's a header, then rows of nodes from the south, each a lat and lon shift in 1/10000000s of a degree, west to east.
+typedef struct
+  {
+  char magic[8] ;               // "GPSDTM1"
+  int32_t lat0, lon0 ;          // The south-west node, in 1/10000000s of a degree.
+  int32_t step ;                // Between nodes, the same.
+  uint16_t rows, cols ;
+  } osgbgrid_t ;
+
+static const char osgbgrid_magic[8] = "GPSDTM1" ;
+
+// A grid, with what's needed to look things up in it already in degrees.
+typedef struct
+  {
+  void* map ;
+  size_t size ;
+  const int16_t* shift ;
+  double lat0, lon0, per ;
+  int rows, cols ;
+  } osgbdatum_t ;
+
+// The one that's been opened, the one in use, NULL if none, and whether it's been done.
+static osgbdatum_t loaded ;
+static osgbdatum_t* datum = NULL ;
+static int opened = 0 ;
+
+
+// Shift a WGS84 position to OSGB36. Off the grid it's left alone, there's nothing to convert it to there anyway.
+static inline void
+osgb_shift ( const osgbdatum_t* d, double* lat, double* lon )
+  {
+  double r = ( *lat - d->lat0 ) * d->per ;
+  double c = ( *lon - d->lon0 ) * d->per ;
+  double fr, fc ;
+  const int16_t* p ;
+  const int16_t* q ;
+  int i, j ;
+  if ( !( r >= 0 && c >= 0 && r < d->rows - 1 && c < d->cols - 1 ) ) return ;
+  i = (int) r ;
+  j = (int) c ;
+  fr = r - i ;
+  fc = c - j ;
+  p = d->shift + 2 * ( (size_t) i * d->cols + j ) ;
+  q = p + 2 * d->cols ;
+  *lat += 1e-7 * ( ( 1 - fr ) * ( ( 1 - fc ) * p[0] + fc * p[2] ) + fr * ( ( 1 - fc ) * q[0] + fc * q[2] ) ) ;
+  *lon += 1e-7 * ( ( 1 - fr ) * ( ( 1 - fc ) * p[1] + fc * p[3] ) + fr * ( ( 1 - fc ) * q[1] + fc * q[3] ) ) ;
+  }
+
+
+// Map in a correction grid and check it, filling in loaded. Returns 0, or -1 with errno set.
+static int
+osgb_datum_map ( const char* path )
+  {
+  struct stat st ;
+  osgbgrid_t head ;
+  void* map ;
+  int fd ;
+  if ( ( fd = open ( path, O_RDONLY ) ) < 0 ) return -1 ;
+  if ( fstat ( fd, &st ) < 0 )
+    {
+    close ( fd ) ;
+    return -1 ;
+    }
+  if ( (size_t) st.st_size < sizeof ( head ) )
+    {
+    close ( fd ) ;
+    errno = EINVAL ;
+    return -1 ;
+    }
+  map = mmap ( NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0 ) ;
+  close ( fd ) ;
+  if ( map == MAP_FAILED ) return -1 ;
+  memcpy ( &head, map, sizeof ( head ) ) ;
+  if ( memcmp ( head.magic, osgbgrid_magic, sizeof ( head.magic ) ) || head.step <= 0 || head.rows < 2 || head.cols < 2 ||
+       (size_t) st.st_size < sizeof ( head ) + (size_t) head.rows * head.cols * 4 )
+    {
+    munmap ( map, st.st_size ) ;
+    errno = EINVAL ;
+    return -1 ;
+    }
+  loaded.map = map ;
+  loaded.size = st.st_size ;
+  loaded.shift = (const int16_t*) ( (const char*) map + sizeof ( head ) ) ;
+  loaded.lat0 = head.lat0 * 1e-7 ;
+  loaded.lon0 = head.lon0 * 1e-7 ;
+  loaded.per = 1e7 / head.step ;
+  loaded.rows = head.rows ;
+  loaded.cols = head.cols ;
+  return 0 ;
+  }
+
+
+// Map in a correction grid, for LLtoOSGB() and LLtoOSGBv() to use from now on. Only once it's worked, EBUSY after that.
+// Returns 0, or -1 with errno set.
+int
+osgb_datum_open ( const char* path )
+  {
+  if ( __atomic_exchange_n ( &opened, 1, __ATOMIC_ACQ_REL ) )
+    {
+    errno = EBUSY ;
+    return -1 ;
+    }
+  if ( osgb_datum_map ( path ) < 0 )
+    {
+    __atomic_store_n ( &opened, 0, __ATOMIC_RELEASE ) ;
+    return -1 ;
+    }
+  __atomic_store_n ( &datum, &loaded, __ATOMIC_RELEASE ) ;
+  return 0 ;
+  }
+
+
+// Go back to using positions as they are, and unmap the grid. Only once nothing's converting, as a conversion under way on another
+// thread could still be using it.
+void
+osgb_datum_close ( void )
+  {
+  osgbdatum_t* d = __atomic_exchange_n ( &datum, NULL, __ATOMIC_ACQ_REL ) ;
+  if ( d ) munmap ( d->map, d->size ) ;
+  }
+
+
+// WGS84 to OSGB36 the slow way, for working out a grid: to cartesian, a 7 parameter Helmert transform, and back onto Airy 1830.
+// Good to a few metres, which the Ordnance Survey's own grid improves on, if you have it in this format.
+static void
+osgb_helmert ( double lat, double lon, double* olat, double* olon )
+  {
+  const double wa = 6378137.0, wb = 6356752.314245 ;
+  const double oa = 6377563.396, ob = 6356256.909 ;
+  const double tx = -446.448, ty = 125.157, tz = -542.060 ;
+  const double sc = 20.4894e-6 ;
+  const double as = M_PI / 180 / 3600 ;
+  const double rx = -0.1502 * as, ry = -0.2470 * as, rz = -0.8421 * as ;
+  double e2 = 1 - ( wb * wb ) / ( wa * wa ) ;
+  double phi = lat * M_PI / 180, lam = lon * M_PI / 180 ;
+  double nu = wa / sqrt ( 1 - e2 * sin ( phi ) * sin ( phi ) ) ;
+  double x = nu * cos ( phi ) * cos ( lam ) ;
+  double y = nu * cos ( phi ) * sin ( lam ) ;
+  double z = nu * ( 1 - e2 ) * sin ( phi ) ;
+  double x2 = tx + ( 1 + sc ) * x - rz * y + ry * z ;
+  double y2 = ty + rz * x + ( 1 + sc ) * y - rx * z ;
+  double z2 = tz - ry * x + rx * y + ( 1 + sc ) * z ;
+  double p = sqrt ( x2 * x2 + y2 * y2 ) ;
+  int i ;
+  e2 = 1 - ( ob * ob ) / ( oa * oa ) ;
+  phi = atan2 ( z2, p * ( 1 - e2 ) ) ;
+  for ( i = 0 ; i < 10 ; i++ )
+    {
+    nu = oa / sqrt ( 1 - e2 * sin ( phi ) * sin ( phi ) ) ;
+    phi = atan2 ( z2 + e2 * nu * sin ( phi ), p ) ;
+    }
+  *olat = phi * 180 / M_PI ;
+  *olon = atan2 ( y2, x2 ) * 180 / M_PI ;
+  }
+
+
+// Where the grid we work out covers, all of the OSGB grid and a bit, in 1/10000000s of a degree. Every 0.05 degrees, 3-5km, is plenty
+// for something as smooth as a Helmert transform.
+#define OSGB_DATUM_LAT0 490000000
+#define OSGB_DATUM_LON0 ( -100000000 )
+#define OSGB_DATUM_STEP 500000
+#define OSGB_DATUM_ROWS 261
+#define OSGB_DATUM_COLS 261
+
+// Work out a correction grid, and write it to a file. Returns 0, or -1 with errno set.
+int
+osgb_datum_build ( const char* path )
+  {
+  osgbgrid_t head ;
+  int16_t* row ;
+  double lat, lon, olat, olon ;
+  FILE* fp ;
+  int i, j ;
+  memset ( &head, 0, sizeof ( head ) ) ;
+  memcpy ( head.magic, osgbgrid_magic, sizeof ( head.magic ) ) ;
+  head.lat0 = OSGB_DATUM_LAT0 ;
+  head.lon0 = OSGB_DATUM_LON0 ;
+  head.step = OSGB_DATUM_STEP ;
+  head.rows = OSGB_DATUM_ROWS ;
+  head.cols = OSGB_DATUM_COLS ;
+  if ( ( row = malloc ( OSGB_DATUM_COLS * 2 * sizeof ( int16_t ) ) ) == NULL ) return -1 ;
+  if ( ( fp = fopen ( path, "wb" ) ) == NULL )
+    {
+    free ( row ) ;
+    return -1 ;
+    }
+  fwrite ( &head, sizeof ( head ), 1, fp ) ;
+  for ( i = 0 ; i < OSGB_DATUM_ROWS ; i++ )
+    {
+    for ( j = 0 ; j < OSGB_DATUM_COLS ; j++ )
+      {
+      lat = ( OSGB_DATUM_LAT0 + (double) i * OSGB_DATUM_STEP ) * 1e-7 ;
+      lon = ( OSGB_DATUM_LON0 + (double) j * OSGB_DATUM_STEP ) * 1e-7 ;
+      osgb_helmert ( lat, lon, &olat, &olon ) ;
+      row[2*j] = (int16_t) lrint ( ( olat - lat ) * 1e7 ) ;
+      row[2*j+1] = (int16_t) lrint ( ( olon - lon ) * 1e7 ) ;
+      }
+    fwrite ( row, sizeof ( int16_t ), OSGB_DATUM_COLS * 2, fp ) ;
+    }
+  free ( row ) ;
+  if ( ferror ( fp ) )
+    {
+    fclose ( fp ) ;
+    errno = EIO ;
+    return -1 ;
+    }
+  return fclose ( fp ) ;
+  }
+
+
 // Converts lat/long to OSGB coords.
-// Lat and Lon are in decimal degrees.
+// Lat and Lon are in decimal degrees. Points outside the grid get a zone of "??".
 void
 LLtoOSGB ( const double lat, const double lon, char* OSGBz, long* OSGBe, long* OSGBn )
   {
   long posx, posy ;
   double easting, northing ;
-  double latR = lat*0.017453292519943 ;
-  double lonR = lon*0.017453292519943 ;
+  double la = lat, lo = lon ;
+  const osgbdatum_t* d = __atomic_load_n ( &datum, __ATOMIC_ACQUIRE ) ;
+  if ( d ) osgb_shift ( d, &la, &lo ) ;
+  double latR = la*0.017453292519943 ;
+  double lonR = lo*0.017453292519943 ;
   double N = a/sqrt(1-eccS*sin(latR)*sin(latR)) ;
   double T = tan(latR)*tan(latR) ;
   double C = eccP*cos(latR)*cos(latR) ;
@@ -29,12 +260,88 @@ LLtoOSGB ( const double lat, const double lon, char* OSGBz, long* OSGBe, long* O
   easting = 400000.0+(double)(k0*N*(A+(1-T+C)*A*A*A/6+(5-18*T+T*T+72*C-58*eccP)*A*A*A*A*A/120)) ;
   northing = (double)(k0*(M-M0+N*tan(latR)*(A*A/2+(5-T+9*C+4*C*C)*A*A*A*A/24+(61-58*T+T*T+600*C-330*eccP)*A*A*A*A*A*A/720)))-100000.0 ;
   *OSGBe = (long)(easting+0.5) ; *OSGBn = (long)(northing+0.5) ;
-  posx = *OSGBe/500000L ; posy = *OSGBn/500000L ;
-  OSGBz[0] = GridSquare[posx+posy*5+7] ;
-  posx = *OSGBe%500000L ; posx = posx/100000L ;
-  posy = *OSGBn%500000L ; posy = posy/100000L ;
-  OSGBz[1] = GridSquare[posx+posy*5] ;
+  // Off the grid there are no letters, and the table would be read out of bounds.
+  if ( *OSGBe < 0 || *OSGBn < 0 || *OSGBe >= 1000000L || *OSGBn >= 1500000L )
+    {
+    OSGBz[0] = OSGBz[1] = '?' ;
+    }
+  else
+    {
+    posx = *OSGBe/500000L ; posy = *OSGBn/500000L ;
+    OSGBz[0] = GridSquare[posx+posy*5+7] ;
+    posx = *OSGBe%500000L ; posx = posx/100000L ;
+    posy = *OSGBn%500000L ; posy = posy/100000L ;
+    OSGBz[1] = GridSquare[posx+posy*5] ;
+    }
   OSGBz[2] = '\0' ;
   *OSGBn = *OSGBn%500000L ; *OSGBn = *OSGBn%100000L ;
   *OSGBe = *OSGBe%500000L ; *OSGBe = *OSGBe%100000L ;
   }
+
+
+// How many points to do in one go, small enough that the working arrays stay in cache.
+#define OSGB_BLOCK 256
+
+// Converts arrays of lat/long to OSGB coords. Lat and Lon are in decimal degrees.
+// Gives the same results as calling LLtoOSGB() on each point, but only needs one sin() and cos() per point, all the other trig is
+// derived from those. The rest is straight-line arithmetic over arrays that the compiler can vectorise. Points outside the grid get
+// a zone of "??".
+void
+LLtoOSGBv ( size_t count, const double* restrict lat, const double* restrict lon, char (*restrict OSGBz)[3], long* restrict OSGBe, long* restrict OSGBn )
+  {
+  double S[OSGB_BLOCK], Cs[OSGB_BLOCK], La[OSGB_BLOCK], Lo[OSGB_BLOCK] ;
+  const osgbdatum_t* d = __atomic_load_n ( &datum, __ATOMIC_ACQUIRE ) ;
+  size_t i, j, n ;
+  for ( j = 0 ; j < count ; j += n )
+    {
+    n = ( count - j < OSGB_BLOCK ) ? count - j : OSGB_BLOCK ;
+    // Onto OSGB36 first, if there's a grid to do it with.
+    memcpy ( La, lat + j, n * sizeof ( double ) ) ;
+    memcpy ( Lo, lon + j, n * sizeof ( double ) ) ;
+    if ( d ) for ( i = 0 ; i < n ; i++ ) osgb_shift ( d, &La[i], &Lo[i] ) ;
+    // The only library trig.
+    for ( i = 0 ; i < n ; i++ )
+      {
+      double latR = La[i]*0.017453292519943 ;
+      S[i] = sin(latR) ;
+      Cs[i] = cos(latR) ;
+      }
+    // Multiple angles and the projection, no calls or branches.
+    for ( i = 0 ; i < n ; i++ )
+      {
+      double latR = La[i]*0.017453292519943 ;
+      double lonR = Lo[i]*0.017453292519943 ;
+      double s = S[i], c = Cs[i] ;
+      double s2 = 2*s*c, c2 = c*c-s*s ;
+      double s4 = 2*s2*c2, c4 = c2*c2-s2*s2 ;
+      double s6 = s4*c2+c4*s2 ;
+      double t = s/c ;
+      double N = a/sqrt(1-eccS*s*s) ;
+      double T = t*t ;
+      double C = eccP*c*c ;
+      double A = c*(lonR-lonOR) ;
+      double M = a*(0.998330273507751*latR-0.002505636963581*s2+0.000002620236941*s4-0.000000003381659*s6) ;
+      double easting = 400000.0+(double)(k0*N*(A+(1-T+C)*A*A*A/6+(5-18*T+T*T+72*C-58*eccP)*A*A*A*A*A/120)) ;
+      double northing = (double)(k0*(M-M0+N*t*(A*A/2+(5-T+9*C+4*C*C)*A*A*A*A/24+(61-58*T+T*T+600*C-330*eccP)*A*A*A*A*A*A/720)))-100000.0 ;
+      OSGBe[j+i] = (long)(easting+0.5) ;
+      OSGBn[j+i] = (long)(northing+0.5) ;
+      }
+    // Grid letters, from which 100km square we're in.
+    for ( i = j ; i < j + n ; i++ )
+      {
+      long e100 = OSGBe[i]/100000L, n100 = OSGBn[i]/100000L ;
+      if ( OSGBe[i] < 0 || OSGBn[i] < 0 || e100 >= 10 || n100 >= 15 )
+        {
+        OSGBz[i][0] = OSGBz[i][1] = '?' ;
+        }
+      else
+        {
+        OSGBz[i][0] = GridSquare[e100/5+(n100/5)*5+7] ;
+        OSGBz[i][1] = GridSquare[e100%5+(n100%5)*5] ;
+        }
+      OSGBz[i][2] = '\0' ;
+      OSGBe[i] = OSGBe[i]%100000L ;
+      OSGBn[i] = OSGBn[i]%100000L ;
+      }
+    }
+  }
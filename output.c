@@ -0,0 +1,503 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    Format GPS fixes for display.                                                                                                       */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include "gpsread.h"
+
+
+// Names for the position units, in posunit_t order.
+const char* const posunit_names[] = { "INVALID", "TIME", "NMEA", "OSGB", "MHEAD", "LLMINSEC", "LLMINDEC", "LLDECIMAL", "RECORD", "NDJSON",
+                                      "CSV", "GEOJSON" } ;
+
+
+// Convert a string to a posuint_t, INVALID if it isn't one.
+posunit_t
+map_posunit ( const char* value )
+  {
+  if ( !strcasecmp ( value, posunit_names[TIME] ) ) return TIME ;
+  else if ( !strcasecmp ( value, posunit_names[NMEA] ) ) return NMEA ;
+  else if ( !strcasecmp ( value, posunit_names[OSGB] ) ) return OSGB ;
+  else if ( !strcasecmp ( value, posunit_names[MHEAD] ) ) return MHEAD ;
+  else if ( !strcasecmp ( value, posunit_names[LLMINSEC] ) ) return LLMINSEC ;
+  else if ( !strcasecmp ( value, posunit_names[LLMINDEC] ) ) return LLMINDEC ;
+  else if ( !strcasecmp ( value, posunit_names[LLDECIMAL] ) ) return LLDECIMAL ;
+  else if ( !strcasecmp ( value, posunit_names[RECORD] ) ) return RECORD ;
+  else if ( !strcasecmp ( value, posunit_names[NDJSON] ) ) return NDJSON ;
+  else if ( !strcasecmp ( value, posunit_names[CSV] ) ) return CSV ;
+  else if ( !strcasecmp ( value, posunit_names[GEOJSON] ) ) return GEOJSON ;
+  else return INVALID ;
+  }
+
+
+// The formatting is all done by hand, not with printf(), which at thousands of fixes a second was most of the time taken.
+// Each put_ adds to p and returns where it got to.
+
+// Add a string.
+static char*
+put_str ( char* p, const char* s )
+  {
+  while ( *s ) *p++ = *s++ ;
+  return p ;
+  }
+
+
+// Add a number, zero padded to at least width digits.
+static char*
+put_uint ( char* p, uint64_t v, int width )
+  {
+  char digits[20] ;
+  int n = 0 ;
+  do
+    {
+    digits[n++] = '0' + v % 10 ;
+    v /= 10 ;
+    }
+  while ( v ) ;
+  while ( n < width ) digits[n++] = '0' ;
+  while ( n ) *p++ = digits[--n] ;
+  return p ;
+  }
+
+
+// Add a signed number, zero padded to width including the sign, like %0*ld.
+static char*
+put_int ( char* p, int64_t v, int width )
+  {
+  if ( v >= 0 ) return put_uint ( p, v, width ) ;
+  *p++ = '-' ;
+  return put_uint ( p, - (uint64_t) v, width - 1 ) ;
+  }
+
+
+// Add n chars of s, with spaces in front to make it up to width.
+static char*
+put_right ( char* p, const char* s, int n, int width )
+  {
+  while ( width-- > n ) *p++ = ' ' ;
+  memcpy ( p, s, n ) ;
+  return p + n ;
+  }
+
+
+static const uint64_t pow10s[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000 } ;
+
+// Add v / 10^places, with a '-' in front if neg.
+static char*
+put_fixed ( char* p, int neg, uint64_t v, int places )
+  {
+  if ( neg ) *p++ = '-' ;
+  p = put_uint ( p, v / pow10s[places], 1 ) ;
+  *p++ = '.' ;
+  return put_uint ( p, v % pow10s[places], places ) ;
+  }
+
+
+// Add v hundredths.
+static char*
+put_cents ( char* p, int32_t v )
+  {
+  return put_fixed ( p, v < 0, v < 0 ? - (int64_t) v : v, 2 ) ;
+  }
+
+
+// Same, or none if it's unknown.
+static char*
+put_known ( char* p, int32_t v, int32_t unknown, const char* none )
+  {
+  if ( v == unknown ) return put_str ( p, none ) ;
+  return put_cents ( p, v ) ;
+  }
+
+
+// Add a lat or lon to 7 decimal places of a degree, a centimetre or so.
+static char*
+put_degrees ( char* p, int32_t v )
+  {
+  uint64_t a = abs ( v ) ;
+  // 10^7 / FIX_DEGREE is 5/3, rounded.
+  return put_fixed ( p, v < 0, ( a * 5 + 1 ) / 3, 7 ) ;
+  }
+
+
+// Round num/den the way printf() would round d*scale, the double it used to be given for it.
+// Away from a half the two always agree. At one, printf() goes by which side d really fell, or to even if it's spot on.
+static uint64_t
+round_as_printf ( uint64_t num, uint64_t den, double d, double scale )
+  {
+  uint64_t q = num / den, r = num % den ;
+  double off ;
+  if ( 2 * r < den ) return q ;
+  if ( 2 * r > den ) return q + 1 ;
+  off = fma ( d, scale, - ( q + 0.5 ) ) ;
+  if ( off > 0 ) return q + 1 ;
+  if ( off < 0 ) return q ;
+  return q + ( q & 1 ) ;
+  }
+
+
+// Add a lat or lon in degrees, minutes and seconds, like "lat: %3d%c%02d'%06.3f\"\n".
+static char*
+put_minsec ( char* p, const char* name, int32_t v, char pos, char neg )
+  {
+  uint32_t a = abs ( v ) ;
+  // Seconds in ms are a tenth of 6 times this, which never ends in a half.
+  uint32_t ms = ( a % FIX_MINUTE * 6 + 5 ) / 10 ;
+  char num[8] ;
+  p = put_str ( p, name ) ;
+  p = put_right ( p, num, put_int ( num, ( v < 0 ? -1 : +1 ) * (int) ( a / FIX_DEGREE ), 1 ) - num, 3 ) ;
+  *p++ = ( v < 0 ) ? neg : pos ;
+  p = put_uint ( p, a % FIX_DEGREE / FIX_MINUTE, 2 ) ;
+  *p++ = '\'' ;
+  p = put_uint ( p, ms / 1000, 2 ) ;
+  *p++ = '.' ;
+  p = put_uint ( p, ms % 1000, 3 ) ;
+  *p++ = '"' ;
+  *p++ = '\n' ;
+  return p ;
+  }
+
+
+// Add a lat or lon in degrees and decimal minutes, like "lat: %3d%c%8.4f'\n".
+static char*
+put_mindec ( char* p, const char* name, int32_t v, char pos, char neg )
+  {
+  uint32_t a = abs ( v ) ;
+  uint32_t m = a % FIX_DEGREE ;
+  uint64_t t = round_as_printf ( m, 10, m / (double) FIX_MINUTE, 1e4 ) ;
+  char num[16] ;
+  p = put_str ( p, name ) ;
+  p = put_right ( p, num, put_uint ( num, a / FIX_DEGREE, 1 ) - num, 3 ) ;
+  *p++ = ( v < 0 ) ? neg : pos ;
+  p = put_right ( p, num, put_fixed ( num, 0, t, 4 ) - num, 8 ) ;
+  *p++ = '\'' ;
+  *p++ = '\n' ;
+  return p ;
+  }
+
+
+// Add a lat or lon in decimal degrees, like "lat: %+10.5f\n".
+static char*
+put_decimal ( char* p, const char* name, int32_t v )
+  {
+  uint32_t a = abs ( v ) ;
+  uint64_t t = round_as_printf ( a, FIX_DEGREE / 100000, fabs ( fix_degrees ( v ) ), 1e5 ) ;
+  char num[16] ;
+  num[0] = ( v < 0 ) ? '-' : '+' ;
+  p = put_str ( p, name ) ;
+  p = put_right ( p, num, put_fixed ( num + 1, 0, t, 5 ) - num, 10 ) ;
+  *p++ = '\n' ;
+  return p ;
+  }
+
+
+// Add the time of a fix, ISO 8601 in UTC if there's a date, or just the time of day if not.
+static char*
+put_time ( char* p, const gpsfix_t* fix )
+  {
+  int32_t z, era, doe, yoe, doy, mp, y, m, d ;
+  if ( fix->date >= 0 )
+    {
+    // Howard Hinnant's civil_from_days(), the other way from nmea.c.
+    z = fix->date + 719468 ;
+    era = z / 146097 ;
+    doe = z - era * 146097 ;
+    yoe = ( doe - doe / 1460 + doe / 36524 - doe / 146096 ) / 365 ;
+    doy = doe - ( 365 * yoe + yoe / 4 - yoe / 100 ) ;
+    mp = ( 5 * doy + 2 ) / 153 ;
+    d = doy - ( 153 * mp + 2 ) / 5 + 1 ;
+    m = mp < 10 ? mp + 3 : mp - 9 ;
+    y = yoe + era * 400 + ( m <= 2 ) ;
+    p = put_uint ( p, y, 4 ) ;
+    *p++ = '-' ;
+    p = put_uint ( p, m, 2 ) ;
+    *p++ = '-' ;
+    p = put_uint ( p, d, 2 ) ;
+    *p++ = 'T' ;
+    }
+  p = put_uint ( p, fix->utc / 3600000, 2 ) ;
+  *p++ = ':' ;
+  p = put_uint ( p, fix->utc / 60000 % 60, 2 ) ;
+  *p++ = ':' ;
+  p = put_uint ( p, fix->utc / 1000 % 60, 2 ) ;
+  *p++ = '.' ;
+  p = put_uint ( p, fix->utc % 1000, 3 ) ;
+  if ( fix->date >= 0 ) *p++ = 'Z' ;
+  return p ;
+  }
+
+
+// Add the fields the machine formats have besides the position, as JSON members, or CSV with empty ones for unknowns.
+static char*
+put_extras ( char* p, const gpsfix_t* fix, int json )
+  {
+  p = put_str ( p, json ? ",\"quality\":" : "," ) ;
+  p = put_uint ( p, fix->quality, 1 ) ;
+  p = put_str ( p, json ? ",\"sats\":" : "," ) ;
+  p = put_uint ( p, fix->sats, 1 ) ;
+  p = put_str ( p, json ? ",\"hdop\":" : "," ) ;
+  p = put_known ( p, fix->hdop, INT16_MAX, json ? "null" : "" ) ;
+  // Speed in m/s.
+  p = put_str ( p, json ? ",\"speed\":" : "," ) ;
+  p = put_known ( p, fix->speed, -1, json ? "null" : "" ) ;
+  p = put_str ( p, json ? ",\"course\":" : "," ) ;
+  p = put_known ( p, fix->course, -1, json ? "null" : "" ) ;
+  return p ;
+  }
+
+
+// Add a JSON time member, null if not known.
+static char*
+put_json_time ( char* p, const gpsfix_t* fix )
+  {
+  p = put_str ( p, "\"time\":" ) ;
+  if ( fix->utc < 0 ) return put_str ( p, "null" ) ;
+  *p++ = '"' ;
+  p = put_time ( p, fix ) ;
+  *p++ = '"' ;
+  return p ;
+  }
+
+
+// Finish off like snprintf(), copying from scratch if that's where it went. Returns the length.
+static int
+format_done ( char* buf, size_t size, const char* from, const char* end )
+  {
+  size_t len = end - from ;
+  if ( from != buf && size ) memcpy ( buf, from, len < size ? len : size - 1 ) ;
+  if ( len < size ) buf[len] = '\0' ;
+  else if ( size ) buf[size-1] = '\0' ;
+  return (int) len ;
+  }
+
+
+// Add an OSGB grid reference, like "[%s][%05ld][%05ld]\n".
+static char*
+put_osgb ( char* p, const char* z, long e, long n )
+  {
+  *p++ = '[' ;
+  p = put_str ( p, z ) ;
+  p = put_str ( p, "][" ) ;
+  p = put_int ( p, e, 5 ) ;
+  p = put_str ( p, "][" ) ;
+  p = put_int ( p, n, 5 ) ;
+  *p++ = ']' ;
+  *p++ = '\n' ;
+  return p ;
+  }
+
+
+// Format an OSGB grid reference, with a trailing newline.
+int
+format_osgb ( char* buf, size_t size, const char* z, long e, long n )
+  {
+  char scratch[64] ;
+  char* p = ( size >= sizeof ( scratch ) ) ? buf : scratch ;
+  return format_done ( buf, size, p, put_osgb ( p, z, e, n ) ) ;
+  }
+
+
+// Format a fix in the given units, with a trailing newline. RECORD is a binary fixrec_t instead, with no '\0' after it.
+// Text goes straight into buf if there's FORMAT_MAX of it, or through scratch to be cut short if not.
+// Returns the length it needed, like snprintf().
+int
+format_fix ( char* buf, size_t size, const gpsfix_t* fix, const format_t* fmt )
+  {
+  char scratch[FORMAT_MAX] ;
+  char* start = ( size >= FORMAT_MAX ) ? buf : scratch ;
+  char* p = start ;
+  char z[3] ;
+  long e, n ;
+  fixrec_t rec ;
+  switch ( fmt->posunit )
+    {
+    case TIME :
+      if ( fix->utc < 0 ) p = put_str ( p, "--:--:--" ) ;
+      else
+        {
+        p = put_uint ( p, fix->utc / 3600000, 2 ) ;
+        *p++ = ':' ;
+        p = put_uint ( p, fix->utc / 60000 % 60, 2 ) ;
+        *p++ = ':' ;
+        p = put_uint ( p, fix->utc / 1000 % 60, 2 ) ;
+        }
+      *p++ = '\n' ;
+      break ;
+    case NMEA :
+      *p++ = '$' ;
+      memcpy ( p, fix->raw, fix->rawlen ) ;
+      p += fix->rawlen ;
+      *p++ = '\n' ;
+      break ;
+    case OSGB :
+      LLtoOSGB ( fix_degrees ( fix->lat ), fix_degrees ( fix->lon ), z, &e, &n ) ;
+      p = put_osgb ( p, z, e, n ) ;
+      break ;
+    case MHEAD :
+      p += LLtoMaidenhead ( fix_degrees ( fix->lat ), fix_degrees ( fix->lon ), fmt->mheadlen, p ) ;
+      *p++ = '\n' ;
+      break ;
+    case LLMINSEC :
+      p = put_minsec ( p, "lat: ", fix->lat, 'N', 'S' ) ;
+      p = put_minsec ( p, "lon: ", fix->lon, 'E', 'W' ) ;
+      break ;
+    case LLMINDEC :
+      p = put_mindec ( p, "lat: ", fix->lat, 'N', 'S' ) ;
+      p = put_mindec ( p, "lon: ", fix->lon, 'E', 'W' ) ;
+      break ;
+    case LLDECIMAL :
+      p = put_decimal ( p, "lat: ", fix->lat ) ;
+      p = put_decimal ( p, "lon: ", fix->lon ) ;
+      break ;
+    case RECORD :
+      fixrec_pack ( &rec, fix ) ;
+      if ( size >= sizeof ( rec ) ) memcpy ( buf, &rec, sizeof ( rec ) ) ;
+      return sizeof ( rec ) ;
+    case NDJSON :
+      *p++ = '{' ;
+      p = put_json_time ( p, fix ) ;
+      p = put_str ( p, ",\"lat\":" ) ;
+      p = put_degrees ( p, fix->lat ) ;
+      p = put_str ( p, ",\"lon\":" ) ;
+      p = put_degrees ( p, fix->lon ) ;
+      p = put_str ( p, ",\"alt\":" ) ;
+      p = put_cents ( p, fix->alt ) ;
+      p = put_extras ( p, fix, 1 ) ;
+      *p++ = '}' ;
+      *p++ = '\n' ;
+      break ;
+    case CSV :
+      if ( fix->utc >= 0 ) p = put_time ( p, fix ) ;
+      *p++ = ',' ;
+      p = put_degrees ( p, fix->lat ) ;
+      *p++ = ',' ;
+      p = put_degrees ( p, fix->lon ) ;
+      *p++ = ',' ;
+      p = put_cents ( p, fix->alt ) ;
+      p = put_extras ( p, fix, 0 ) ;
+      *p++ = '\n' ;
+      break ;
+    case GEOJSON :
+      // One Feature a line, as RFC 8142 GeoJSON text sequences and most loaders take them, less the RS.
+      p = put_str ( p, "{\"type\":\"Feature\",\"geometry\":{\"type\":\"Point\",\"coordinates\":[" ) ;
+      p = put_degrees ( p, fix->lon ) ;
+      *p++ = ',' ;
+      p = put_degrees ( p, fix->lat ) ;
+      *p++ = ',' ;
+      p = put_cents ( p, fix->alt ) ;
+      p = put_str ( p, "]},\"properties\":{" ) ;
+      p = put_json_time ( p, fix ) ;
+      p = put_extras ( p, fix, 1 ) ;
+      p = put_str ( p, "}}\n" ) ;
+      break ;
+    default :
+      // What happend here?
+      break ;
+    }
+  return format_done ( buf, size, start, p ) ;
+  }
+
+
+// A line to go before the first fix, naming the columns. Returns the length like snprintf(), 0 for units without one.
+int
+format_header ( char* buf, size_t size, const format_t* fmt )
+  {
+  static const char csv[] = "time,lat,lon,alt,quality,sats,hdop,speed,course\n" ;
+  if ( fmt->posunit != CSV )
+    {
+    if ( size ) buf[0] = '\0' ;
+    return 0 ;
+    }
+  return format_done ( buf, size, csv, csv + sizeof ( csv ) - 1 ) ;
+  }
+
+
+// Set up to write fixes to fd, through a buffer of size. Returns 0, or -1 with errno set.
+int
+fixout_init ( fixout_t* out, int fd, size_t size )
+  {
+  if ( size < FORMAT_MAX ) size = FORMAT_MAX ;
+  if ( ( out->buf = malloc ( size ) ) == NULL ) return -1 ;
+  out->fd = fd ;
+  out->len = 0 ;
+  out->size = size ;
+  return 0 ;
+  }
+
+
+// Write out everything buffered, in as few writes as it takes. Returns 0, or -1 with errno set and the rest still buffered.
+int
+fixout_flush ( fixout_t* out )
+  {
+  size_t done = 0 ;
+  ssize_t put ;
+  while ( done < out->len )
+    {
+    put = write ( out->fd, out->buf + done, out->len - done ) ;
+    if ( put < 0 )
+      {
+      if ( errno == EINTR ) continue ;
+      memmove ( out->buf, out->buf + done, out->len - done ) ;
+      out->len -= done ;
+      return -1 ;
+      }
+    done += put ;
+    }
+  out->len = 0 ;
+  return 0 ;
+  }
+
+
+// Add some text. Returns 0, or -1 with errno set if writing out to make room failed.
+int
+fixout_text ( fixout_t* out, const char* text, size_t len )
+  {
+  size_t n ;
+  while ( len > 0 )
+    {
+    if ( out->len == out->size && fixout_flush ( out ) < 0 ) return -1 ;
+    n = ( len < out->size - out->len ) ? len : out->size - out->len ;
+    memcpy ( out->buf + out->len, text, n ) ;
+    out->len += n ;
+    text += n ;
+    len -= n ;
+    }
+  return 0 ;
+  }
+
+
+// Add a fix, formatted straight into the buffer. Returns 0, or -1 with errno set if writing out to make room failed.
+int
+fixout_fix ( fixout_t* out, const gpsfix_t* fix, const format_t* fmt )
+  {
+  if ( out->size - out->len < FORMAT_MAX && fixout_flush ( out ) < 0 ) return -1 ;
+  out->len += format_fix ( out->buf + out->len, out->size - out->len, fix, fmt ) ;
+  return 0 ;
+  }
+
+
+// Write out what's left and free the buffer, but leave the fd open. Returns 0, or -1 with errno set if the write failed.
+int
+fixout_close ( fixout_t* out )
+  {
+  int ret = fixout_flush ( out ) ;
+  int err = errno ;
+  free ( out->buf ) ;
+  out->buf = NULL ;
+  out->size = out->len = 0 ;
+  errno = err ;
+  return ret ;
+  }
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent
@@ -0,0 +1,149 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    Turn a stream of bytes from a GPS into fixes.                                                                                       */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+// Everything here works on a gpsread_t the caller owns. No globals, signals or exits, so it's safe to embed, and to run several at once.
+
+// Needs clock_gettime().
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include "gpsread.h"
+
+
+// Set up a reader. onfix gets called with each good fix, and user.
+void
+gpsread_init ( gpsread_t* ctx, gpsread_fix_cb onfix, void* user )
+  {
+  memset ( ctx, 0, sizeof ( *ctx ) ) ;
+  nmea_init ( &ctx->framer, NMEA_CHECK_PRESENT ) ;
+  gpsfix_init ( &ctx->fix ) ;
+  ctx->onfix = onfix ;
+  ctx->user = user ;
+  }
+
+
+// Note when the bytes about to be pushed were read. Both clocks, one straight after the other.
+void
+gpsread_clock ( gpsread_t* ctx )
+  {
+  struct timespec mono, real ;
+  clock_gettime ( CLOCK_MONOTONIC, &mono ) ;
+  clock_gettime ( CLOCK_REALTIME, &real ) ;
+  ctx->now = (int64_t) mono.tv_sec * 1000000000 + mono.tv_nsec ;
+  ctx->nowreal = (int64_t) real.tv_sec * 1000000000 + real.tv_nsec ;
+  }
+
+
+// When the byte at p came in. The last byte of the block ending at end came in when it was read, near enough, and each before that
+// a byte's time on the line earlier. Stamps of 0 stay 0, for not known.
+static void
+gpsread_heard ( const gpsread_t* ctx, const char* p, const char* end, int64_t* mono, int64_t* real )
+  {
+  int64_t back = ctx->bytens * ( end - p - 1 ) ;
+  *mono = ctx->now ? ctx->now - back : 0 ;
+  *real = ctx->nowreal ? ctx->nowreal - back : 0 ;
+  }
+
+
+// Feed it some bytes, in whatever size lumps they came in.
+// Complete sentences are parsed into the fix record, and each good GGA passes it to the callback before this returns. The fix is heard
+// when its '$' came in, worked back from the gpsread_clock() for the push it was in.
+// Returns how many fixes there were.
+int
+gpsread_push ( gpsread_t* ctx, const char* data, size_t len )
+  {
+  const char* end = data + len ;
+  const char* sentence ;
+  int slen, type, fixes = 0 ;
+  unsigned long starts ;
+  size_t used ;
+  ctx->stats.bytes += len ;
+  while ( len > 0 )
+    {
+    starts = ctx->framer.starts ;
+    used = nmea_frame ( &ctx->framer, data, len, &sentence, &slen ) ;
+    data += used ;
+    len -= used ;
+    // Started one here that's not finished? What's kept of it is the end of this block, with the '$' just before.
+    if ( ctx->framer.state && ctx->framer.starts != starts )
+      {
+      gpsread_heard ( ctx, end - ctx->framer.len - 1, end, &ctx->begun, &ctx->begunreal ) ;
+      }
+    if ( sentence == NULL ) continue ;
+    ctx->stats.sentences++ ;
+    type = nmea_parse ( sentence, slen, &ctx->fix ) ;
+    if ( type != NMEA_GGA )
+      {
+      if ( type == -NMEA_GGA ) ctx->stats.invalid++ ;
+      else ctx->stats.other++ ;
+      continue ;
+      }
+    ctx->stats.fixes++ ;
+    fixes++ ;
+    if ( sentence != ctx->framer.buffer ) gpsread_heard ( ctx, sentence - 1, end, &ctx->fix.heard, &ctx->fix.heardreal ) ;
+    else
+      {
+      ctx->fix.heard = ctx->begun ;
+      ctx->fix.heardreal = ctx->begunreal ;
+      }
+    if ( ctx->onfix ) ctx->onfix ( &ctx->fix, ctx->user ) ;
+    }
+  return fixes ;
+  }
+
+
+// Wait up to timeout ms, or forever if it's negative, for fd to have data, then read and push everything that's there.
+// Returns how many bytes it got, 0 if it timed out, or -1 with errno set. A device that's gone away gives EIO.
+ssize_t
+gpsread_read ( gpsread_t* ctx, int fd, int timeout )
+  {
+  struct pollfd pfd = { fd, POLLIN, 0 } ;
+  char rxbuf[4096] ;
+  ssize_t got ;
+  int ready ;
+  while ( 1 )
+    {
+    ready = poll ( &pfd, 1, timeout ) ;
+    if ( ready < 0 && errno == EINTR ) continue ;
+    if ( ready <= 0 ) return ready ;
+    got = read ( fd, rxbuf, sizeof ( rxbuf ) ) ;
+    if ( got < 0 && ( errno == EAGAIN || errno == EINTR ) )
+      {
+      ctx->stats.empty++ ;
+      continue ;
+      }
+    if ( got == 0 ) errno = EIO ;
+    if ( got <= 0 ) return -1 ;
+    gpsread_clock ( ctx ) ;
+    ctx->stats.reads++ ;
+    gpsread_push ( ctx, rxbuf, got ) ;
+    return got ;
+    }
+  }
+
+
+// Add a reader's counts, and its framer's, to st.
+void
+gpsread_stats ( const gpsread_t* ctx, gpsstats_t* st )
+  {
+  st->reads += ctx->stats.reads ;
+  st->empty += ctx->stats.empty ;
+  st->bytes += ctx->stats.bytes ;
+  st->sentences += ctx->stats.sentences ;
+  st->badsums += ctx->framer.badsums ;
+  st->overflows += ctx->framer.overflows ;
+  st->other += ctx->stats.other ;
+  st->invalid += ctx->stats.invalid ;
+  st->fixes += ctx->stats.fixes ;
+  }
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent
@@ -0,0 +1,226 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    Serial comms with the GPS.                                                                                                          */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+// Needs clock_gettime().
+#define _GNU_SOURCE
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <time.h>
+#include <poll.h>
+#include "gpsread.h"
+
+// Auto-baud: sentences with good checksums to believe a speed, ms and bytes of nothing good before giving up on it, and goes round
+// all the speeds.
+#define AUTOBAUD_LOCK 2
+#define AUTOBAUD_DWELL 1200
+#define AUTOBAUD_JUNK 1024
+#define AUTOBAUD_PASSES 2
+
+
+// Every baud rate termios knows, and its number. The fast ones aren't everywhere, mostly Linux.
+static const struct
+  {
+  int speed ;
+  int baud ;
+  } bauds[] =
+  {
+    { B50, 50 }, { B75, 75 }, { B110, 110 }, { B134, 134 }, { B150, 150 }, { B200, 200 }, { B300, 300 }, { B600, 600 },
+    { B1200, 1200 }, { B1800, 1800 }, { B2400, 2400 }, { B4800, 4800 }, { B9600, 9600 }, { B19200, 19200 }, { B38400, 38400 },
+#ifdef B57600
+    { B57600, 57600 },
+#endif
+#ifdef B115200
+    { B115200, 115200 },
+#endif
+#ifdef B230400
+    { B230400, 230400 },
+#endif
+#ifdef B460800
+    { B460800, 460800 },
+#endif
+#ifdef B500000
+    { B500000, 500000 },
+#endif
+#ifdef B576000
+    { B576000, 576000 },
+#endif
+#ifdef B921600
+    { B921600, 921600 },
+#endif
+#ifdef B1000000
+    { B1000000, 1000000 },
+#endif
+#ifdef B1152000
+    { B1152000, 1152000 },
+#endif
+#ifdef B1500000
+    { B1500000, 1500000 },
+#endif
+#ifdef B2000000
+    { B2000000, 2000000 },
+#endif
+  } ;
+#define NBAUDS ( sizeof ( bauds ) / sizeof ( bauds[0] ) )
+
+// Rates to try when looking for a GPS, most likely first.
+static const int autobauds[] = { 4800, 9600, 115200, 38400, 57600, 19200, 230400, 460800, 921600 } ;
+#define NAUTOBAUDS ( sizeof ( autobauds ) / sizeof ( autobauds[0] ) )
+
+
+// Map a baudrate to a number.
+int
+map_baud ( int br )
+  {
+  size_t i ;
+  for ( i = 0 ; i < NBAUDS ; i++ )
+    {
+    if ( bauds[i].speed == br ) return bauds[i].baud ;
+    }
+  return -1 ;
+  }
+
+
+// Convert and check the baud rate is OK.
+int
+valid_baud ( int br )
+  {
+  size_t i ;
+  for ( i = 0 ; i < NBAUDS ; i++ )
+    {
+    if ( bauds[i].baud == br ) return bauds[i].speed ;
+    }
+  return -1 ;
+  }
+
+
+// Milliseconds on the monotonic clock.
+static int64_t
+serial_now ( void )
+  {
+  struct timespec ts ;
+  clock_gettime ( CLOCK_MONOTONIC, &ts ) ;
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000 ;
+  }
+
+
+// Switch an open tty to another speed, throwing away anything already read at the old one.
+static int
+gps_speed ( int tty, int speed )
+  {
+  struct termios gpsio ;
+  if ( tcgetattr ( tty, &gpsio ) < 0 ) return -1 ;
+  cfsetospeed ( &gpsio, speed ) ;
+  cfsetispeed ( &gpsio, speed ) ;
+  if ( tcsetattr ( tty, TCSANOW, &gpsio ) < 0 ) return -1 ;
+  tcflush ( tty, TCIFLUSH ) ;
+  return 0 ;
+  }
+
+
+// Listen at one speed, for up to AUTOBAUD_DWELL ms or AUTOBAUD_JUNK bytes, for AUTOBAUD_LOCK sentences with good checksums.
+// Returns 1 if they turned up, 0 if not, -1 with errno set if the tty's no good.
+static int
+gps_tryspeed ( int tty, int speed )
+  {
+  nmea_framer_t framer ;
+  struct pollfd pfd = { tty, POLLIN, 0 } ;
+  char rxbuf[256] ;
+  const char* sentence ;
+  int64_t until = serial_now ( ) + AUTOBAUD_DWELL ;
+  int64_t left ;
+  size_t used, junk = 0 ;
+  ssize_t got, i ;
+  int slen, good = 0 ;
+  if ( gps_speed ( tty, speed ) < 0 ) return -1 ;
+  nmea_init ( &framer, NMEA_CHECK_REQUIRE ) ;
+  while ( ( left = until - serial_now ( ) ) > 0 && junk < AUTOBAUD_JUNK )
+    {
+    if ( poll ( &pfd, 1, (int) left ) <= 0 ) continue ;
+    got = read ( tty, rxbuf, sizeof ( rxbuf ) ) ;
+    if ( got < 0 && ( errno == EAGAIN || errno == EINTR ) ) continue ;
+    if ( got == 0 ) errno = EIO ;
+    if ( got <= 0 ) return -1 ;
+    junk += got ;
+    for ( i = 0 ; i < got ; i += used )
+      {
+      used = nmea_frame ( &framer, rxbuf + i, got - i, &sentence, &slen ) ;
+      if ( sentence && ++good >= AUTOBAUD_LOCK ) return 1 ;
+      // A good one, so these bytes weren't junk.
+      if ( sentence ) junk = 0 ;
+      }
+    }
+  return 0 ;
+  }
+
+
+// Find the speed a GPS is sending at, by trying the likely ones in turn. Leaves the tty at that speed and returns it, or -1 with errno
+// set, ETIMEDOUT if none of them work after AUTOBAUD_PASSES goes round.
+int
+gps_autobaud ( int tty )
+  {
+  size_t i ;
+  int pass, speed, found ;
+  for ( pass = 0 ; pass < AUTOBAUD_PASSES ; pass++ )
+    {
+    for ( i = 0 ; i < NAUTOBAUDS ; i++ )
+      {
+      if ( ( speed = valid_baud ( autobauds[i] ) ) == -1 ) continue ;
+      if ( ( found = gps_tryspeed ( tty, speed ) ) < 0 ) return -1 ;
+      if ( found ) return speed ;
+      }
+    }
+  errno = ETIMEDOUT ;
+  return -1 ;
+  }
+
+
+// Open a GPS tty and set it up for speed, as given by valid_baud(), or GPSBAUD_AUTO to go and find it with gps_autobaud().
+// Returns the file descriptor, or -1 with errno set.
+int
+gps_open ( const char* term, int speed )
+  {
+  int tty, err ;
+  struct termios gpsio ;
+  // Default to zero.
+  memset ( &gpsio, 0, sizeof ( gpsio ) ) ;
+  // Set for GPS comms.
+  gpsio.c_iflag = 0 ;
+  gpsio.c_oflag = 0 ;
+  gpsio.c_cflag = CS8 | CREAD | CLOCAL ;
+  gpsio.c_lflag = 0 ;
+  gpsio.c_cc[VMIN] = 1 ;
+  gpsio.c_cc[VTIME] = 5 ;
+  // Open the tty device.
+  tty = open ( term, O_RDWR | O_NONBLOCK | O_NOCTTY ) ;
+  if ( tty < 0 ) return -1 ;
+  // Set baud rate. Any will do to start with if it's to be found.
+  cfsetospeed ( &gpsio, speed == GPSBAUD_AUTO ? GPSBAUD : speed ) ;
+  cfsetispeed ( &gpsio, speed == GPSBAUD_AUTO ? GPSBAUD : speed ) ;
+  // Set properties.
+  if ( tcsetattr ( tty, TCSANOW, &gpsio ) < 0 )
+    {
+    err = errno ;
+    close ( tty ) ;
+    errno = err ;
+    return -1 ;
+    }
+  if ( speed == GPSBAUD_AUTO && gps_autobaud ( tty ) < 0 )
+    {
+    err = errno ;
+    close ( tty ) ;
+    errno = err ;
+    return -1 ;
+    }
+  return tty ;
+  }
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent
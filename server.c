@@ -0,0 +1,423 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    Stream fixes to any number of clients over a Unix domain socket.                                                                    */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+// One epoll loop owns the GPS ttys, the listening socket and every client. Each client says which units it wants by sending the name,
+// eg. "OSGB\n", and gets every fix from then on. Clients have a fixed size output buffer. If one can't keep up, the oldest fixes waiting
+// for it are thrown away to make room for the latest, and if it never catches up it gets dropped. Nothing a client does can hold up the GPS.
+
+// For accept4() and MSG_NOSIGNAL
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#if defined ( __linux )
+  #include <sys/epoll.h>
+#endif
+#include "gpsread.h"
+
+
+#if defined ( __linux )
+
+// Per client output buffer, and most fixes queued in it.
+#define SERVE_BUFSIZE 4096
+#define SERVE_QUEUED 256
+// Drop a client after it's lost fixes this many times without once catching up.
+#define SERVE_STALLS 64
+// Most clients at once.
+#define SERVE_CLIENTS 1024
+
+// A connected client.
+typedef struct client_s
+  {
+  int fd ;
+  format_t fmt ;
+  char out[SERVE_BUFSIZE] ;
+  size_t off ;                  // Sent up to here.
+  size_t len ;                  // Queued up to here.
+  uint16_t starts[SERVE_QUEUED] ;  // Where each queued fix starts, the first maybe partly sent.
+  int queued ;
+  int stalls ;
+  uint32_t events ;              // What epoll's watching it for.
+  int eof ;                     // Sent all it's going to, but still listening.
+  int header ;                  // The units' header line goes out with the next fix.
+  char in[64] ;
+  size_t inlen ;
+  struct client_s* next ;
+  } client_t ;
+
+// Everything the loop needs.
+typedef struct
+  {
+  int epfd ;
+  int nclients ;
+  client_t* clients ;
+  client_t* dead ;              // Dropped, but maybe still in this batch of events.
+  } server_t ;
+
+
+// Get rid of a client. It's only freed by serve_reap(), after the events that might mention it.
+static void
+serve_drop ( server_t* srv, client_t* c )
+  {
+  client_t** pp ;
+  if ( c->fd < 0 ) return ;
+  for ( pp = &srv->clients ; *pp ; pp = &(*pp)->next )
+    {
+    if ( *pp == c )
+      {
+      *pp = c->next ;
+      break ;
+      }
+    }
+  epoll_ctl ( srv->epfd, EPOLL_CTL_DEL, c->fd, NULL ) ;
+  close ( c->fd ) ;
+  c->fd = -1 ;
+  c->next = srv->dead ;
+  srv->dead = c ;
+  srv->nclients-- ;
+  }
+
+
+// Free the dropped clients.
+static void
+serve_reap ( server_t* srv )
+  {
+  client_t* c ;
+  while ( ( c = srv->dead ) != NULL )
+    {
+    srv->dead = c->next ;
+    free ( c ) ;
+    }
+  }
+
+
+// Send as much as the client will take. Returns -1 if it's gone.
+static int
+serve_flush ( server_t* srv, client_t* c )
+  {
+  struct epoll_event ev ;
+  ssize_t sent ;
+  uint32_t events ;
+  int done ;
+  while ( c->off < c->len )
+    {
+    sent = send ( c->fd, c->out + c->off, c->len - c->off, MSG_NOSIGNAL | MSG_DONTWAIT ) ;
+    if ( sent < 0 && errno == EINTR ) continue ;
+    if ( sent < 0 && ( errno == EAGAIN || errno == EWOULDBLOCK ) ) break ;
+    if ( sent <= 0 ) return -1 ;
+    c->off += sent ;
+    }
+  // Only all sent counts as caught up. A client taking a few bytes at a time still gets dropped.
+  if ( c->off == c->len )
+    {
+    c->off = c->len = 0 ;
+    c->queued = c->stalls = 0 ;
+    }
+  else
+    {
+    // Forget the fixes that have all gone.
+    for ( done = 1 ; done < c->queued && c->starts[done] <= c->off ; done++ ) ;
+    done-- ;
+    if ( done > 0 )
+      {
+      memmove ( c->starts, c->starts + done, ( c->queued - done ) * sizeof ( c->starts[0] ) ) ;
+      c->queued -= done ;
+      }
+    }
+  // Only ask to hear about space when there's something waiting, and about requests until it's said there are no more.
+  events = ( c->eof ? 0 : EPOLLIN ) | ( c->len > 0 ? EPOLLOUT : 0 ) ;
+  if ( events != c->events )
+    {
+    ev.events = events ;
+    ev.data.ptr = c ;
+    epoll_ctl ( srv->epfd, EPOLL_CTL_MOD, c->fd, &ev ) ;
+    c->events = events ;
+    }
+  return 0 ;
+  }
+
+
+// Where queued fix i ends.
+static size_t
+serve_end ( const client_t* c, int i )
+  {
+  return ( i + 1 < c->queued ) ? c->starts[i+1] : c->len ;
+  }
+
+
+// Queue a fix for a client, squeezing out the oldest ones if there's no room.
+static void
+serve_queue ( client_t* c, const char* msg, size_t len )
+  {
+  // A fix that's partly gone has to be finished, the rest can go.
+  int keep = ( c->queued > 0 && c->off > c->starts[0] ) ;
+  int i, last, lost ;
+  size_t cut, end ;
+  // Tidy up what's sent to make room.
+  if ( c->off > 0 && ( c->len + len > SERVE_BUFSIZE || c->queued == SERVE_QUEUED ) )
+    {
+    memmove ( c->out, c->out + c->off, c->len - c->off ) ;
+    for ( i = 0 ; i < c->queued ; i++ ) c->starts[i] = ( c->starts[i] > c->off ) ? c->starts[i] - c->off : 0 ;
+    c->len -= c->off ;
+    c->off = 0 ;
+    }
+  // Behind? Lose the oldest whole fixes, just enough for this one.
+  if ( ( c->len + len > SERVE_BUFSIZE || c->queued == SERVE_QUEUED ) && keep < c->queued )
+    {
+    c->stalls++ ;
+    cut = c->starts[keep] ;
+    for ( last = keep ; last < c->queued - 1 ; last++ )
+      {
+      end = serve_end ( c, last ) ;
+      if ( c->len - ( end - cut ) + len <= SERVE_BUFSIZE && c->queued - ( last + 1 - keep ) < SERVE_QUEUED ) break ;
+      }
+    end = serve_end ( c, last ) ;
+    lost = last + 1 - keep ;
+    memmove ( c->out + cut, c->out + end, c->len - end ) ;
+    c->len -= end - cut ;
+    for ( i = last + 1 ; i < c->queued ; i++ ) c->starts[i-lost] = c->starts[i] - ( end - cut ) ;
+    c->queued -= lost ;
+    }
+  if ( c->len + len > SERVE_BUFSIZE || c->queued == SERVE_QUEUED ) return ;
+  memcpy ( c->out + c->len, msg, len ) ;
+  c->starts[c->queued++] = c->len ;
+  c->len += len ;
+  }
+
+
+// Send a fix to everyone, in their own units.
+static void
+serve_fix ( const gpsfix_t* fix, void* user )
+  {
+  server_t* srv = user ;
+  client_t* c ;
+  client_t* next ;
+  char msg[FORMAT_MAX+128] ;
+  int len ;
+  for ( c = srv->clients ; c ; c = next )
+    {
+    next = c->next ;
+    // Along with the fix, so it can't be squeezed out on its own.
+    len = c->header ? format_header ( msg, sizeof ( msg ), &c->fmt ) : 0 ;
+    c->header = 0 ;
+    len += format_fix ( msg + len, sizeof ( msg ) - len, fix, &c->fmt ) ;
+    if ( len <= 0 || len >= (int) sizeof ( msg ) ) continue ;
+    serve_queue ( c, msg, len ) ;
+    if ( c->stalls > SERVE_STALLS || serve_flush ( srv, c ) < 0 ) serve_drop ( srv, c ) ;
+    }
+  }
+
+
+// Read what a client's sent, a line at a time. The end of what it sends, like a half-close from socat or nc -N, only means no more
+// requests, it still gets fixes. Returns -1 if it's gone.
+static int
+serve_read ( client_t* c )
+  {
+  char buf[256] ;
+  ssize_t got ;
+  posunit_t unit ;
+  char* nl ;
+  size_t i ;
+  while ( ( got = recv ( c->fd, buf, sizeof ( buf ), MSG_DONTWAIT ) ) != 0 )
+    {
+    if ( got < 0 && errno == EINTR ) continue ;
+    if ( got < 0 ) return ( errno == EAGAIN || errno == EWOULDBLOCK ) ? 0 : -1 ;
+    for ( i = 0 ; i < (size_t) got ; i++ )
+      {
+      if ( buf[i] == '\r' ) continue ;
+      if ( buf[i] != '\n' )
+        {
+        if ( c->inlen < sizeof ( c->in ) - 1 ) c->in[c->inlen++] = buf[i] ;
+        continue ;
+        }
+      // A whole line, is it units?
+      c->in[c->inlen] = '\0' ;
+      nl = c->in ;
+      while ( *nl == ' ' ) nl++ ;
+      unit = map_posunit ( nl ) ;
+      if ( unit != INVALID )
+        {
+        c->fmt.posunit = unit ;
+        c->header = 1 ;
+        }
+      c->inlen = 0 ;
+      }
+    }
+  c->eof = 1 ;
+  return 0 ;
+  }
+
+
+// Take on any new clients.
+static void
+serve_accept ( server_t* srv, int lfd, const format_t* fmt )
+  {
+  struct epoll_event ev ;
+  client_t* c ;
+  int fd ;
+  while ( ( fd = accept4 ( lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC ) ) >= 0 )
+    {
+    if ( srv->nclients >= SERVE_CLIENTS || ( c = calloc ( 1, sizeof ( client_t ) ) ) == NULL )
+      {
+      close ( fd ) ;
+      continue ;
+      }
+    c->fd = fd ;
+    c->fmt = *fmt ;
+    c->header = 1 ;
+    c->events = ev.events = EPOLLIN ;
+    ev.data.ptr = c ;
+    if ( epoll_ctl ( srv->epfd, EPOLL_CTL_ADD, fd, &ev ) < 0 )
+      {
+      close ( fd ) ;
+      free ( c ) ;
+      continue ;
+      }
+    c->next = srv->clients ;
+    srv->clients = c ;
+    srv->nclients++ ;
+    }
+  }
+
+
+// Milliseconds on the monotonic clock.
+static int64_t
+serve_now ( void )
+  {
+  struct timespec ts ;
+  clock_gettime ( CLOCK_MONOTONIC, &ts ) ;
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000 ;
+  }
+
+
+// Serve the merged fixes from ntty GPS ttys to clients connecting to the socket at path, in fmt unless they ask otherwise. The ttys are
+// closed when it's done. Runs until every GPS goes away, or they send nothing for timeout seconds (0 for never). Always returns -1 with
+// errno set, ETIMEDOUT for the timeout.
+int
+gps_serve ( const int* tty, int ntty, const char* path, const format_t* fmt, int timeout )
+  {
+  struct sockaddr_un addr ;
+  struct epoll_event ev, events[64] ;
+  server_t srv ;
+  gpsmerge_t merge ;
+  gpsmerge_dev_t* dev ;
+  int64_t deadline = 0 ;
+  unsigned long sentences ;
+  struct stat st ;
+  int lfd, n, i, err, wait, bound = 0 ;
+  memset ( &srv, 0, sizeof ( srv ) ) ;
+  srv.epfd = -1 ;
+  if ( gpsmerge_init ( &merge, tty, ntty, serve_fix, &srv ) < 0 ) return -1 ;
+  // The socket.
+  memset ( &addr, 0, sizeof ( addr ) ) ;
+  addr.sun_family = AF_UNIX ;
+  if ( strlen ( path ) >= sizeof ( addr.sun_path ) )
+    {
+    gpsmerge_close ( &merge ) ;
+    errno = ENAMETOOLONG ;
+    return -1 ;
+    }
+  strcpy ( addr.sun_path, path ) ;
+  if ( ( lfd = socket ( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 ) ) < 0 )
+    {
+    err = errno ;
+    gpsmerge_close ( &merge ) ;
+    errno = err ;
+    return -1 ;
+    }
+  // Only clear away an old socket. Anything else there, bind() says so.
+  if ( lstat ( path, &st ) == 0 && S_ISSOCK ( st.st_mode ) ) unlink ( path ) ;
+  if ( bind ( lfd, (struct sockaddr*) &addr, sizeof ( addr ) ) < 0 ) goto fail ;
+  bound = 1 ;
+  if ( listen ( lfd, 64 ) < 0 ) goto fail ;
+  // The loop.
+  if ( ( srv.epfd = epoll_create1 ( EPOLL_CLOEXEC ) ) < 0 ) goto fail ;
+  ev.events = EPOLLIN ;
+  for ( i = 0 ; i < ntty ; i++ )
+    {
+    ev.data.ptr = &merge.dev[i] ;
+    if ( epoll_ctl ( srv.epfd, EPOLL_CTL_ADD, tty[i], &ev ) < 0 ) goto fail ;
+    }
+  ev.data.ptr = &srv ;
+  if ( epoll_ctl ( srv.epfd, EPOLL_CTL_ADD, lfd, &ev ) < 0 ) goto fail ;
+  if ( timeout ) deadline = serve_now ( ) + timeout * 1000LL ;
+  while ( 1 )
+    {
+    wait = -1 ;
+    if ( timeout )
+      {
+      if ( ( wait = deadline - serve_now ( ) ) <= 0 )
+        {
+        errno = ETIMEDOUT ;
+        goto fail ;
+        }
+      }
+    n = epoll_wait ( srv.epfd, events, 64, gpsmerge_wait ( &merge, wait ) ) ;
+    if ( n < 0 && errno == EINTR ) continue ;
+    if ( n < 0 ) goto fail ;
+    sentences = merge.sentences ;
+    for ( i = 0 ; i < n ; i++ )
+      {
+      dev = events[i].data.ptr ;
+      // A GPS, the reason we're here. Losing one is fine, as long as there's another.
+      if ( dev >= merge.dev && dev < merge.dev + ntty )
+        {
+        if ( gpsmerge_service ( &merge, dev - merge.dev ) < 0 && !merge.live ) goto fail ;
+        }
+      // Someone new.
+      else if ( events[i].data.ptr == &srv ) serve_accept ( &srv, lfd, fmt ) ;
+      // A client, talking or with room to send.
+      else
+        {
+        client_t* c = events[i].data.ptr ;
+        if ( c->fd < 0 ) continue ;
+        // Hung up altogether, there's no one to send to.
+        if ( events[i].events & ( EPOLLHUP | EPOLLERR ) ) serve_drop ( &srv, c ) ;
+        else if ( ( events[i].events & EPOLLIN ) && serve_read ( c ) < 0 ) serve_drop ( &srv, c ) ;
+        // Sends anything waiting, and stops watching for requests after the last.
+        else if ( serve_flush ( &srv, c ) < 0 ) serve_drop ( &srv, c ) ;
+        }
+      }
+    gpsmerge_tick ( &merge ) ;
+    if ( timeout && merge.sentences != sentences ) deadline = serve_now ( ) + timeout * 1000LL ;
+    serve_reap ( &srv ) ;
+    }
+fail :
+  err = errno ;
+  while ( srv.clients ) serve_drop ( &srv, srv.clients ) ;
+  serve_reap ( &srv ) ;
+  if ( srv.epfd >= 0 ) close ( srv.epfd ) ;
+  gpsmerge_close ( &merge ) ;
+  close ( lfd ) ;
+  if ( bound ) unlink ( path ) ;
+  errno = err ;
+  return -1 ;
+  }
+
+#else
+
+// No epoll, no server.
+int
+gps_serve ( const int* tty, int ntty, const char* path, const format_t* fmt, int timeout )
+  {
+  tty = tty ; ntty = ntty ; path = path ; fmt = fmt ; timeout = timeout ;
+  errno = ENOSYS ;
+  return -1 ;
+  }
+
+#endif
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent
@@ -0,0 +1,130 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    Publish fixes in shared memory, for any number of local readers.                                                                    */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+// One writer, protected by a sequence lock. The writer makes the count odd, changes the record, then makes it even again. Readers copy
+// the record, and try again if the count was odd or changed while they did. Nobody waits for anyone, and reading is just memory.
+
+// For ftruncate()
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "gpsread.h"
+
+// A reader spins this many times on a record that's being written, then sleeps a millisecond between tries, up to a second in all.
+// Far longer than a publish takes, even one that's been preempted.
+#define FIXSHM_SPINS 1000
+#define FIXSHM_TRIES ( FIXSHM_SPINS + 1000 )
+
+
+// Map a segment, creating it if writing.
+static fixshm_t*
+fixshm_map ( const char* name, int write )
+  {
+  char shmname[256] ;
+  fixshm_t* shm ;
+  int fd, err ;
+  // Names want a leading '/'.
+  if ( snprintf ( shmname, sizeof ( shmname ), "%s%s", ( name[0] == '/' ) ? "" : "/", name ) >= (int) sizeof ( shmname ) )
+    {
+    errno = ENAMETOOLONG ;
+    return NULL ;
+    }
+  fd = shm_open ( shmname, write ? O_RDWR | O_CREAT : O_RDONLY, 0644 ) ;
+  if ( fd < 0 ) return NULL ;
+  if ( write && ftruncate ( fd, sizeof ( fixshm_t ) ) < 0 )
+    {
+    err = errno ;
+    close ( fd ) ;
+    errno = err ;
+    return NULL ;
+    }
+  shm = mmap ( NULL, sizeof ( fixshm_t ), write ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0 ) ;
+  err = errno ;
+  close ( fd ) ;
+  errno = err ;
+  return ( shm == MAP_FAILED ) ? NULL : shm ;
+  }
+
+
+// Create, or reuse, a segment to publish fixes in. Returns NULL with errno set if it can't.
+fixshm_t*
+fixshm_create ( const char* name )
+  {
+  fixshm_t* shm = fixshm_map ( name, 1 ) ;
+  uint32_t seq ;
+  if ( shm == NULL ) return NULL ;
+  // A writer that died mid-publish left it odd. Even it up, or every publish from here on would look half done.
+  seq = __atomic_load_n ( &shm->seq, __ATOMIC_RELAXED ) ;
+  if ( seq & 1 ) __atomic_store_n ( &shm->seq, seq + 1, __ATOMIC_RELEASE ) ;
+  return shm ;
+  }
+
+
+// Attach to a segment to read fixes from. Returns NULL with errno set if it can't.
+const fixshm_t*
+fixshm_open ( const char* name )
+  {
+  return fixshm_map ( name, 0 ) ;
+  }
+
+
+// Done with a segment.
+void
+fixshm_close ( const fixshm_t* shm )
+  {
+  munmap ( (void*) shm, sizeof ( fixshm_t ) ) ;
+  }
+
+
+// Publish a fix. Only one writer per segment.
+void
+fixshm_publish ( fixshm_t* shm, const gpsfix_t* fix )
+  {
+  fixcache_t rec ;
+  uint32_t seq ;
+  // Do the slow bit before taking the lock.
+  fixcache_pack ( &rec, fix ) ;
+  seq = __atomic_load_n ( &shm->seq, __ATOMIC_RELAXED ) ;
+  __atomic_store_n ( &shm->seq, seq + 1, __ATOMIC_RELAXED ) ;
+  __atomic_thread_fence ( __ATOMIC_RELEASE ) ;
+  memcpy ( &shm->rec, &rec, sizeof ( rec ) ) ;
+  __atomic_store_n ( &shm->seq, seq + 2, __ATOMIC_RELEASE ) ;
+  }
+
+
+// Get the latest fix. fix->raw points into rec. No system calls unless the writer's stuck.
+// Returns 1 if there was one, 0 if nothing's been published yet, or -1 with errno EAGAIN if it was being written every time it was
+// tried, as it will be for good if the writer died half way through.
+int
+fixshm_read ( const fixshm_t* shm, fixcache_t* rec, gpsfix_t* fix )
+  {
+  uint32_t before, after ;
+  int tries ;
+  struct timespec ms = { 0, 1000000 } ;
+  for ( tries = 0 ; tries < FIXSHM_TRIES ; tries++ )
+    {
+    if ( tries >= FIXSHM_SPINS ) nanosleep ( &ms, NULL ) ;
+    before = __atomic_load_n ( &shm->seq, __ATOMIC_ACQUIRE ) ;
+    if ( before & 1 ) continue ;
+    memcpy ( rec, (const void*) &shm->rec, sizeof ( *rec ) ) ;
+    __atomic_thread_fence ( __ATOMIC_ACQUIRE ) ;
+    after = __atomic_load_n ( &shm->seq, __ATOMIC_RELAXED ) ;
+    if ( before == after ) return ( before != 0 && fixcache_unpack ( rec, fix ) == 0 ) ;
+    }
+  errno = EAGAIN ;
+  return -1 ;
+  }
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent
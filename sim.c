@@ -0,0 +1,526 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    Pretend to be a serial GPS on a pseudo-terminal, for testing gpsread without one.                                                   */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+// Makes a pty, prints the name of its terminal end, and writes NMEA down it: a log file replayed by the times in its GGA and RMC
+// sentences, or a made up track at so many fixes a second. That's in real time, or sped up, or as fast as it'll go. Bytes are paced to
+// the baud rate, as a real serial line would, and if whatever opens the tty sets a different speed, it gets mangled bytes, so autobaud
+// can be tested. Noise, garbage between sentences, and dropouts can be thrown in.
+//
+// With --timing, the time each epoch's first byte went out is logged, to line up against when gpsread showed the fix.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <termios.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include "gpsread.h"
+
+
+// How a line's doing.
+typedef struct
+  {
+  int master ;                  // Our end.
+  int slave ;                   // Theirs, kept open so it stays set up between readers.
+  int baud ;                    // As a number.
+  speed_t speed ;               // And for termios.
+  double speedup ;              // Times real time, 0 for as fast as possible.
+  int64_t start ;               // Monotonic ns at the start of the stream.
+  int64_t simtime ;             // Milliseconds into the stream.
+  int64_t due ;                 // Monotonic ns when the line's free for the next byte.
+  double noise ;                // Chance of a sentence getting a byte changed.
+  double garbage ;              // Chance of junk before a sentence.
+  double dropchance ;           // Chance of an epoch starting a dropout.
+  int64_t dropms ;              // How long those last.
+  int64_t dropuntil ;           // Stream time the current one ends.
+  int epochstart ;              // Nothing written yet this epoch.
+  FILE* timing ;
+  unsigned long sentences, epochs, lost ;
+  } sim_t ;
+
+// The symlink to the tty, to tidy away at the end.
+static char* linkname ;
+
+
+// Monotonic nanoseconds.
+static int64_t
+sim_now ( void )
+  {
+  struct timespec ts ;
+  clock_gettime ( CLOCK_MONOTONIC, &ts ) ;
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec ;
+  }
+
+
+// Wait for a monotonic time.
+static void
+sim_wait ( int64_t when )
+  {
+  struct timespec ts ;
+  ts.tv_sec = when / 1000000000 ;
+  ts.tv_nsec = when % 1000000000 ;
+  while ( clock_nanosleep ( CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL ) == EINTR ) ;
+  }
+
+
+// Maybe, with this chance.
+static int
+sim_chance ( double p )
+  {
+  return p > 0 && rand ( ) < p * ( (double) RAND_MAX + 1 ) ;
+  }
+
+
+// Make the pty, raw at the baud rate. Returns 0, or -1 with errno set.
+static int
+sim_open ( sim_t* sim, const char* link )
+  {
+  struct termios tio ;
+  const char* name ;
+  if ( ( sim->master = posix_openpt ( O_RDWR | O_NOCTTY ) ) < 0 ) return -1 ;
+  if ( grantpt ( sim->master ) < 0 || unlockpt ( sim->master ) < 0 || ( name = ptsname ( sim->master ) ) == NULL ) return -1 ;
+  if ( ( sim->slave = open ( name, O_RDWR | O_NOCTTY ) ) < 0 ) return -1 ;
+  memset ( &tio, 0, sizeof ( tio ) ) ;
+  tio.c_cflag = CS8 | CREAD | CLOCAL ;
+  tio.c_cc[VMIN] = 1 ;
+  cfsetospeed ( &tio, sim->speed ) ;
+  cfsetispeed ( &tio, sim->speed ) ;
+  if ( tcsetattr ( sim->slave, TCSANOW, &tio ) < 0 ) return -1 ;
+  // Nobody reading is like nobody listening on a real line, bytes are lost, not held up.
+  fcntl ( sim->master, F_SETFL, fcntl ( sim->master, F_GETFL ) | O_NONBLOCK ) ;
+  if ( link )
+    {
+    unlink ( link ) ;
+    if ( symlink ( name, link ) < 0 ) return -1 ;
+    linkname = strdup ( link ) ;
+    }
+  printf ( "%s\n", link ? link : name ) ;
+  fflush ( stdout ) ;
+  return 0 ;
+  }
+
+
+// Send bytes at the baud rate. If the other end's at a different speed, they'd come out as rubbish, so they do here. Bytes nobody's
+// reading fast enough for are lost, like on a real line.
+static void
+sim_send ( sim_t* sim, const char* data, size_t len )
+  {
+  struct termios tio ;
+  char buf[1024] ;
+  struct pollfd pfd = { sim->master, POLLOUT, 0 } ;
+  size_t i, n, done ;
+  ssize_t put ;
+  int64_t now ;
+  while ( len > 0 )
+    {
+    n = ( len < sizeof ( buf ) ) ? len : sizeof ( buf ) ;
+    memcpy ( buf, data, n ) ;
+    if ( tcgetattr ( sim->slave, &tio ) == 0 && cfgetispeed ( &tio ) != sim->speed )
+      {
+      for ( i = 0 ; i < n ; i++ ) buf[i] = (char) ( ( buf[i] * 7 ) ^ rand ( ) ) ;
+      }
+    if ( sim->speedup > 0 )
+      {
+      sim_wait ( sim->due ) ;
+      now = sim_now ( ) ;
+      if ( sim->due < now ) sim->due = now ;
+      // 10 bits a byte, with the start and stop bits.
+      sim->due += (int64_t) n * 10000000000LL / sim->baud ;
+      }
+    // Flat out, only as fast as it's read, unless nothing's reading.
+    for ( done = 0 ; done < n ; done += put )
+      {
+      if ( ( put = write ( sim->master, buf + done, n - done ) ) > 0 ) continue ;
+      put = 0 ;
+      if ( sim->speedup > 0 || poll ( &pfd, 1, 1000 ) <= 0 ) break ;
+      }
+    sim->lost += n - done ;
+    data += n ;
+    len -= n ;
+    }
+  }
+
+
+// Wait up to ms milliseconds for the reader to take everything sent.
+static void
+sim_drain ( sim_t* sim, int ms )
+  {
+  int waiting ;
+  for ( ; ms > 0 ; ms -= 10 )
+    {
+    if ( ioctl ( sim->slave, FIONREAD, &waiting ) < 0 || waiting == 0 ) return ;
+    usleep ( 10000 ) ;
+    }
+  }
+
+
+// Start an epoch, so far into the stream. Waits for its time, and decides on dropouts.
+static void
+sim_epoch ( sim_t* sim, int64_t simtime )
+  {
+  int64_t when ;
+  sim->simtime = simtime ;
+  sim->epochs++ ;
+  sim->epochstart = 1 ;
+  if ( sim->speedup > 0 )
+    {
+    when = sim->start + (int64_t) ( simtime * 1e6 / sim->speedup ) ;
+    sim_wait ( when ) ;
+    if ( sim->due < when ) sim->due = when ;
+    }
+  if ( simtime >= sim->dropuntil && sim_chance ( sim->dropchance ) ) sim->dropuntil = simtime + sim->dropms ;
+  }
+
+
+// Send a sentence, from its '$' up to, but not including, its line ending. Maybe spoil it first.
+static void
+sim_sentence ( sim_t* sim, const char* line, size_t len )
+  {
+  static const char junk[] = "\x00\xff$GP*,\r\n\x80\x13\x11~" ;
+  char buf[1024] ;
+  char noise[16] ;
+  struct timespec rt ;
+  size_t i, n ;
+  if ( sim->simtime < sim->dropuntil ) return ;
+  if ( len > sizeof ( buf ) - 2 ) len = sizeof ( buf ) - 2 ;
+  memcpy ( buf, line, len ) ;
+  buf[len++] = '\r' ;
+  buf[len++] = '\n' ;
+  if ( sim_chance ( sim->noise ) && len > 3 )
+    {
+    i = 1 + rand ( ) % ( len - 3 ) ;
+    buf[i] ^= 1 << ( rand ( ) % 7 ) ;
+    }
+  if ( sim_chance ( sim->garbage ) )
+    {
+    n = 1 + rand ( ) % sizeof ( noise ) ;
+    for ( i = 0 ; i < n ; i++ ) noise[i] = ( rand ( ) % 2 ) ? junk[rand()%(sizeof(junk)-1)] : (char) rand ( ) ;
+    sim_send ( sim, noise, n ) ;
+    }
+  if ( sim->epochstart && sim->timing )
+    {
+    clock_gettime ( CLOCK_REALTIME, &rt ) ;
+    fprintf ( sim->timing, "%.10s %ld.%09ld %lld\n", line + 7, (long) rt.tv_sec, rt.tv_nsec, (long long) sim_now ( ) ) ;
+    fflush ( sim->timing ) ;
+    }
+  sim->epochstart = 0 ;
+  sim->sentences++ ;
+  sim_send ( sim, buf, len ) ;
+  }
+
+
+// Milliseconds since midnight from a GGA or RMC sentence, -1 if it's not one or has no time.
+static int64_t
+sim_time ( const char* line, size_t len )
+  {
+  int h, m, s, ms = 0, i ;
+  if ( len < 14 || line[0] != '$' || ( memcmp ( line + 3, "GGA,", 4 ) && memcmp ( line + 3, "RMC,", 4 ) ) ) return -1 ;
+  for ( i = 7 ; i < 13 ; i++ ) if ( line[i] < '0' || line[i] > '9' ) return -1 ;
+  h = ( line[7] - '0' ) * 10 + line[8] - '0' ;
+  m = ( line[9] - '0' ) * 10 + line[10] - '0' ;
+  s = ( line[11] - '0' ) * 10 + line[12] - '0' ;
+  if ( line[13] == '.' )
+    {
+    for ( i = 14 ; i < 17 && i < (int) len && line[i] >= '0' && line[i] <= '9' ; i++ ) ms = ms * 10 + line[i] - '0' ;
+    for ( ; i < 17 ; i++ ) ms *= 10 ;
+    }
+  return ( ( h * 60 + m ) * 60 + s ) * 1000LL + ms ;
+  }
+
+
+// Replay a log file, with the gaps between its epochs. Returns 0, or -1 with errno set.
+static int
+sim_replay ( sim_t* sim, const char* path, int loop )
+  {
+  FILE* fp = strcmp ( path, "-" ) ? fopen ( path, "r" ) : stdin ;
+  char* line = NULL ;
+  size_t size = 0 ;
+  ssize_t len ;
+  int64_t t, last = -1, gap, simtime = 0 ;
+  if ( fp == NULL ) return -1 ;
+  do
+    {
+    while ( ( len = getline ( &line, &size, fp ) ) >= 0 )
+      {
+      while ( len > 0 && ( line[len-1] == '\n' || line[len-1] == '\r' ) ) len-- ;
+      if ( len == 0 ) continue ;
+      // A new time is a new epoch. Long gaps, or going backwards other than over midnight, aren't waited for.
+      if ( ( t = sim_time ( line, len ) ) >= 0 && t != last )
+        {
+        gap = ( last < 0 ) ? 0 : t - last ;
+        if ( gap < 0 ) gap += 86400000 ;
+        if ( gap > 3600000 ) gap = 0 ;
+        simtime += gap ;
+        sim_epoch ( sim, simtime ) ;
+        last = t ;
+        }
+      sim_sentence ( sim, line, len ) ;
+      }
+    // Round again, carrying on a second later.
+    if ( loop && fp != stdin )
+      {
+      rewind ( fp ) ;
+      last = -1 ;
+      simtime += 1000 ;
+      }
+    }
+  while ( loop && fp != stdin ) ;
+  free ( line ) ;
+  if ( fp != stdin ) fclose ( fp ) ;
+  return 0 ;
+  }
+
+
+// Add a sentence's checksum, and send it.
+static void
+sim_make ( sim_t* sim, char* buf, size_t size )
+  {
+  unsigned x = 0 ;
+  size_t i, len = strlen ( buf ) ;
+  for ( i = 1 ; i < len ; i++ ) x ^= (unsigned char) buf[i] ;
+  len += snprintf ( buf + len, size - len, "*%02X", x ) ;
+  sim_sentence ( sim, buf, len ) ;
+  }
+
+
+// Make up a track, from now, at rate fixes a second, going north-east at about 10m/s. count epochs, or forever if it's 0.
+static void
+sim_track ( sim_t* sim, double rate, long count )
+  {
+  char buf[256] ;
+  time_t now = time ( NULL ) ;
+  struct tm tm ;
+  int64_t step = (int64_t) ( 1000 / rate ), t0 = ( now % 86400 ) * 1000LL, t ;
+  double lat, lon, alat, alon ;
+  long i ;
+  for ( i = 0 ; count == 0 || i < count ; i++ )
+    {
+    sim_epoch ( sim, i * step ) ;
+    t = ( t0 + i * step ) % 86400000 ;
+    lat = 51.5 + i * step * 6.4e-8 ;
+    lon = -0.12 + i * step * 1.0e-7 ;
+    alat = fabs ( lat ) ;
+    alon = fabs ( lon ) ;
+    snprintf ( buf, sizeof ( buf ), "$GPGGA,%02d%02d%02d.%03d,%02d%08.5f,%c,%03d%08.5f,%c,1,%02d,0.9,%.1f,M,47.0,M,,",
+               (int) ( t / 3600000 ), (int) ( t / 60000 % 60 ), (int) ( t / 1000 % 60 ), (int) ( t % 1000 ), (int) alat,
+               ( alat - (int) alat ) * 60, lat < 0 ? 'S' : 'N', (int) alon, ( alon - (int) alon ) * 60, lon < 0 ? 'W' : 'E',
+               8 + (int) ( i % 5 ), 30.0 + i % 50 / 10.0 ) ;
+    sim_make ( sim, buf, sizeof ( buf ) ) ;
+    gmtime_r ( &now, &tm ) ;
+    snprintf ( buf, sizeof ( buf ), "$GPRMC,%02d%02d%02d.%03d,A,%02d%08.5f,%c,%03d%08.5f,%c,19.4,38.0,%02d%02d%02d,,,A",
+               (int) ( t / 3600000 ), (int) ( t / 60000 % 60 ), (int) ( t / 1000 % 60 ), (int) ( t % 1000 ), (int) alat,
+               ( alat - (int) alat ) * 60, lat < 0 ? 'S' : 'N', (int) alon, ( alon - (int) alon ) * 60, lon < 0 ? 'W' : 'E',
+               tm.tm_mday, tm.tm_mon + 1, tm.tm_year % 100 ) ;
+    sim_make ( sim, buf, sizeof ( buf ) ) ;
+    snprintf ( buf, sizeof ( buf ), "$GPGSA,A,3,04,05,09,12,17,20,23,28,,,,,1.6,0.9,1.3" ) ;
+    sim_make ( sim, buf, sizeof ( buf ) ) ;
+    }
+  }
+
+
+// Tidy up the link.
+static void
+sim_unlink ( void )
+  {
+  if ( linkname ) unlink ( linkname ) ;
+  }
+
+
+// Stopped, so go through atexit().
+static void
+sim_signal ( int sig )
+  {
+  sig = sig ;
+  exit ( EXIT_SUCCESS ) ;
+  }
+
+
+// Show usage info.
+static void
+usage ( const char* appname )
+  {
+  printf ( "Usage: %s [-b baud] [-f log [-L]] [-r rate] [-c count] [-x speed] [-l link] [-N chance] [-G chance] [-O chance:seconds] [-T timing]\n",
+           appname ) ;
+  printf ( "\t-b,--baudrate Line speed, bytes are paced to it. Default %d\n", map_baud ( GPSBAUD ) ) ;
+  printf ( "\t-f,--file     NMEA log to replay, or - for stdin. Default a made up track\n" ) ;
+  printf ( "\t-L,--loop     Replay the log over and over.\n" ) ;
+  printf ( "\t-r,--rate     Fixes a second in the made up track. Default 1\n" ) ;
+  printf ( "\t-c,--count    Epochs in the made up track. Default 0, forever\n" ) ;
+  printf ( "\t-x,--speed    Times real time, 0 for as fast as possible. Default 1\n" ) ;
+  printf ( "\t-l,--link     Symlink to make to the tty, eg. /tmp/gps0\n" ) ;
+  printf ( "\t-N,--noise    Chance of a byte of a sentence getting changed, 0 to 1\n" ) ;
+  printf ( "\t-G,--garbage  Chance of junk before a sentence, 0 to 1\n" ) ;
+  printf ( "\t-O,--dropout  Chance of an epoch starting a dropout, and how many seconds it lasts\n" ) ;
+  printf ( "\t-T,--timing   File to log each epoch's UTC and when its first byte went, realtime and monotonic ns\n" ) ;
+  printf ( "\t-s,--seed     For the chances. Default 1\n" ) ;
+  }
+
+
+// Read a chance, 0 to 1, or die.
+static double
+sim_parse_chance ( const char* s )
+  {
+  char* end ;
+  double p = strtod ( s, &end ) ;
+  if ( *end || !( p >= 0 && p <= 1 ) )
+    {
+    fprintf ( stderr, "Invalid chance: %s\n", s ) ;
+    exit ( EXIT_FAILURE ) ;
+    }
+  return p ;
+  }
+
+
+// Make the pty, then feed it.
+int
+main ( int argc, char* argv[] )
+  {
+  static struct option long_options[] =
+    {
+      { "help",      no_argument,       0,  'h' },
+      { "baudrate",  required_argument, 0,  'b' },
+      { "file",      required_argument, 0,  'f' },
+      { "loop",      no_argument,       0,  'L' },
+      { "rate",      required_argument, 0,  'r' },
+      { "count",     required_argument, 0,  'c' },
+      { "speed",     required_argument, 0,  'x' },
+      { "link",      required_argument, 0,  'l' },
+      { "noise",     required_argument, 0,  'N' },
+      { "garbage",   required_argument, 0,  'G' },
+      { "dropout",   required_argument, 0,  'O' },
+      { "timing",    required_argument, 0,  'T' },
+      { "seed",      required_argument, 0,  's' },
+      { 0, 0, 0, 0 }
+    } ;
+  sim_t sim ;
+  const char* logfile = NULL ;
+  const char* link = NULL ;
+  double rate = 1, secs ;
+  long count = 0 ;
+  int loop = 0, opt ;
+  char* end ;
+  memset ( &sim, 0, sizeof ( sim ) ) ;
+  sim.speed = GPSBAUD ;
+  sim.speedup = 1 ;
+  srand ( 1 ) ;
+  while ( ( opt = getopt_long ( argc, argv, "hb:f:Lr:c:x:l:N:G:O:T:s:", long_options, NULL ) ) != -1 )
+    {
+    switch ( opt )
+      {
+      case 'b' :
+        if ( ( sim.speed = valid_baud ( (int) strtol ( optarg, NULL, 10 ) ) ) == (speed_t) -1 )
+          {
+          fprintf ( stderr, "Invalid baudrate: %s\n", optarg ) ;
+          exit ( EXIT_FAILURE ) ;
+          }
+        break ;
+      case 'f' :
+        logfile = optarg ;
+        break ;
+      case 'L' :
+        loop = 1 ;
+        break ;
+      case 'r' :
+        rate = strtod ( optarg, NULL ) ;
+        if ( !( rate > 0 && rate <= 1000 ) )
+          {
+          fprintf ( stderr, "Invalid rate: %s\n", optarg ) ;
+          exit ( EXIT_FAILURE ) ;
+          }
+        break ;
+      case 'c' :
+        count = strtol ( optarg, NULL, 10 ) ;
+        break ;
+      case 'x' :
+        sim.speedup = strtod ( optarg, NULL ) ;
+        if ( sim.speedup < 0 )
+          {
+          fprintf ( stderr, "Invalid speed: %s\n", optarg ) ;
+          exit ( EXIT_FAILURE ) ;
+          }
+        break ;
+      case 'l' :
+        link = optarg ;
+        break ;
+      case 'N' :
+        sim.noise = sim_parse_chance ( optarg ) ;
+        break ;
+      case 'G' :
+        sim.garbage = sim_parse_chance ( optarg ) ;
+        break ;
+      case 'O' :
+        if ( ( end = strchr ( optarg, ':' ) ) == NULL || ( secs = strtod ( end + 1, NULL ) ) <= 0 )
+          {
+          fprintf ( stderr, "Invalid dropout, want chance:seconds: %s\n", optarg ) ;
+          exit ( EXIT_FAILURE ) ;
+          }
+        *end = '\0' ;
+        sim.dropchance = sim_parse_chance ( optarg ) ;
+        sim.dropms = (int64_t) ( secs * 1000 ) ;
+        break ;
+      case 'T' :
+        if ( ( sim.timing = fopen ( optarg, "w" ) ) == NULL )
+          {
+          perror ( optarg ) ;
+          exit ( EXIT_FAILURE ) ;
+          }
+        break ;
+      case 's' :
+        srand ( (unsigned) strtoul ( optarg, NULL, 10 ) ) ;
+        break ;
+      case 'h' :
+        usage ( basename ( argv[0] ) ) ;
+        exit ( EXIT_SUCCESS ) ;
+      default :
+        usage ( basename ( argv[0] ) ) ;
+        exit ( EXIT_FAILURE ) ;
+      }
+    }
+  if ( optind != argc )
+    {
+    usage ( basename ( argv[0] ) ) ;
+    exit ( EXIT_FAILURE ) ;
+    }
+  sim.baud = map_baud ( sim.speed ) ;
+  atexit ( sim_unlink ) ;
+  signal ( SIGINT, sim_signal ) ;
+  signal ( SIGTERM, sim_signal ) ;
+  signal ( SIGHUP, sim_signal ) ;
+  if ( sim_open ( &sim, link ) < 0 )
+    {
+    perror ( "Making the pty" ) ;
+    exit ( EXIT_FAILURE ) ;
+    }
+  sim.start = sim.due = sim_now ( ) ;
+  if ( logfile )
+    {
+    if ( sim_replay ( &sim, logfile, loop ) < 0 )
+      {
+      perror ( logfile ) ;
+      exit ( EXIT_FAILURE ) ;
+      }
+    }
+  else sim_track ( &sim, rate, count ) ;
+  // Let the last of it be read before the pty goes, for a while.
+  if ( sim.speedup > 0 ) sim_wait ( sim.due ) ;
+  sim_drain ( &sim, 2000 ) ;
+  fprintf ( stderr, "%lu epochs, %lu sentences, %lu bytes lost\n", sim.epochs, sim.sentences, sim.lost ) ;
+  return EXIT_SUCCESS ;
+  }
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent
@@ -0,0 +1,125 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    Simplify a track as it arrives, dropping fixes that add nothing to its shape.                                                       */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+// An opening window version of Douglas-Peucker. The last fix passed on is the anchor. Fixes after it wait in the window for as long as
+// a straight line from the anchor to the newest one passes within the tolerance of all of them. When one strays too far, the fix before
+// it is passed on and becomes the new anchor. A parked car's fixes all sit within the tolerance of the anchor, so they all go, bar the
+// last. The window is a fixed size, and a full one is passed on the same way, so memory and the work per fix are bounded.
+
+#include <string.h>
+#include <math.h>
+#include "gpsread.h"
+
+
+// Metres in a 1/100000th of a minute of latitude, on a sphere the size of the WGS84 one.
+#define SIMPLIFY_UNIT ( 6371008.8 * 3.14159265358979323846 / 180.0 / FIX_DEGREE )
+
+
+// East-west difference, the short way round.
+static int64_t
+gpssimplify_dlon ( int32_t lon, int32_t from )
+  {
+  int64_t d = (int64_t) lon - from ;
+  if ( d > 180LL * FIX_DEGREE ) d -= 360LL * FIX_DEGREE ;
+  if ( d < -180LL * FIX_DEGREE ) d += 360LL * FIX_DEGREE ;
+  return d ;
+  }
+
+
+// Set up a simplifier. Fixes further than tolerance metres from the simplified track get passed to onfix, with user.
+void
+gpssimplify_init ( gpssimplify_t* s, double tolerance, gpsread_fix_cb onfix, void* user )
+  {
+  memset ( s, 0, sizeof ( *s ) ) ;
+  s->tolerance = tolerance ;
+  s->onfix = onfix ;
+  s->user = user ;
+  }
+
+
+// Pass a fix on, and make it the anchor.
+static void
+gpssimplify_keep ( gpssimplify_t* s, const gpsfix_t* fix )
+  {
+  s->anchored = 1 ;
+  s->lat = fix->lat ;
+  s->lon = fix->lon ;
+  // Near enough flat, this close to the anchor.
+  s->xscale = SIMPLIFY_UNIT * cos ( fix_degrees ( fix->lat ) * 3.14159265358979323846 / 180.0 ) ;
+  s->kept++ ;
+  if ( s->onfix ) s->onfix ( fix, s->user ) ;
+  }
+
+
+// Add a fix to the end of the window, with its own copy of the sentence.
+static void
+gpssimplify_add ( gpssimplify_t* s, const gpsfix_t* fix )
+  {
+  int i = s->n++ ;
+  int len = ( fix->rawlen < GPSSIMPLIFY_RAW ) ? fix->rawlen : GPSSIMPLIFY_RAW - 1 ;
+  s->win[i] = *fix ;
+  memcpy ( s->raw[i], fix->raw, len ) ;
+  s->raw[i][len] = '\0' ;
+  s->win[i].raw = s->raw[i] ;
+  s->win[i].rawlen = len ;
+  s->x[i] = gpssimplify_dlon ( fix->lon, s->lon ) * s->xscale ;
+  s->y[i] = (double) ( fix->lat - s->lat ) * SIMPLIFY_UNIT ;
+  }
+
+
+// Take a fix. It, or the ones before it, may get passed on.
+// Fits gpsread_fix_cb, with the simplifier as user, so it can go straight after a reader.
+void
+gpssimplify_push ( const gpsfix_t* fix, void* user )
+  {
+  gpssimplify_t* s = user ;
+  double x, y, len2, t, dx, dy, tol2 ;
+  int i ;
+  s->seen++ ;
+  // The very first is always kept.
+  if ( !s->anchored )
+    {
+    gpssimplify_keep ( s, fix ) ;
+    return ;
+    }
+  x = gpssimplify_dlon ( fix->lon, s->lon ) * s->xscale ;
+  y = (double) ( fix->lat - s->lat ) * SIMPLIFY_UNIT ;
+  len2 = x * x + y * y ;
+  tol2 = s->tolerance * s->tolerance ;
+  // Does the line from the anchor to here pass close enough to everything in between? Distance to the segment, not the line, so
+  // turning back on itself counts.
+  for ( i = 0 ; i < s->n ; i++ )
+    {
+    t = ( len2 > 0 ) ? ( s->x[i] * x + s->y[i] * y ) / len2 : 0 ;
+    if ( t < 0 ) t = 0 ;
+    if ( t > 1 ) t = 1 ;
+    dx = s->x[i] - t * x ;
+    dy = s->y[i] - t * y ;
+    if ( dx * dx + dy * dy > tol2 ) break ;
+    }
+  // Too far, or full up, so the one before this is where the track bent.
+  if ( i < s->n || s->n == GPSSIMPLIFY_WINDOW )
+    {
+    gpssimplify_keep ( s, &s->win[s->n-1] ) ;
+    s->n = 0 ;
+    }
+  gpssimplify_add ( s, fix ) ;
+  }
+
+
+// Pass on the last fix, if it's waiting, so the track ends where it should. Carry on from there.
+void
+gpssimplify_flush ( gpssimplify_t* s )
+  {
+  if ( s->n == 0 ) return ;
+  gpssimplify_keep ( s, &s->win[s->n-1] ) ;
+  s->n = 0 ;
+  }
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent
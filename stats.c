@@ -0,0 +1,91 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    Counts and latency histograms, for seeing what a GPS has been up to.                                                                */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+// The counting is done as things go by, in the reader and framer. This just times things, and writes the results out.
+
+// Needs clock_gettime().
+#define _GNU_SOURCE
+#include <string.h>
+#include <time.h>
+#include "gpsread.h"
+
+
+// Nanoseconds on the monotonic clock.
+int64_t
+gpsstats_now ( void )
+  {
+  struct timespec ts ;
+  clock_gettime ( CLOCK_MONOTONIC, &ts ) ;
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec ;
+  }
+
+
+// Count a fix shown ns after it was heard, in the bucket for the next power of 2 microseconds up.
+void
+gpsstats_latency ( gpsstats_t* st, int64_t ns )
+  {
+  uint64_t us = ( ns > 0 ) ? ns / 1000 : 0 ;
+  int bucket = us ? 64 - __builtin_clzll ( us ) : 0 ;
+  st->latency[bucket < GPSSTATS_BUCKETS ? bucket : GPSSTATS_BUCKETS - 1]++ ;
+  }
+
+
+// Add a line, "name value\n", to p, if it fits before end. Always returns where it would have got to.
+static char*
+stats_line ( char* p, const char* end, const char* name, uint64_t bound, unsigned long value )
+  {
+  char line[96] ;
+  char digits[24] ;
+  char* q = line ;
+  int n ;
+  while ( *name ) *q++ = *name++ ;
+  // Latency buckets have their bound on the name.
+  if ( bound )
+    {
+    for ( n = 0 ; bound ; bound /= 10 ) digits[n++] = '0' + bound % 10 ;
+    while ( n ) *q++ = digits[--n] ;
+    }
+  *q++ = ' ' ;
+  n = 0 ;
+  do digits[n++] = '0' + value % 10 ; while ( value /= 10 ) ;
+  while ( n ) *q++ = digits[--n] ;
+  *q++ = '\n' ;
+  if ( end - p >= q - line ) memcpy ( p, line, q - line ) ;
+  return p + ( q - line ) ;
+  }
+
+
+// Format the counts as "name value" lines, then the latency buckets that have anything in them, named for the microseconds they're
+// under. Nothing here uses stdio or locks, so it can go in a signal handler. Returns the length, like snprintf().
+int
+gpsstats_format ( char* buf, size_t size, const gpsstats_t* st )
+  {
+  const char* end = buf + ( size ? size - 1 : 0 ) ;
+  char* p = buf ;
+  int i ;
+  p = stats_line ( p, end, "bytes", 0, st->bytes ) ;
+  p = stats_line ( p, end, "reads", 0, st->reads ) ;
+  p = stats_line ( p, end, "empty_reads", 0, st->empty ) ;
+  p = stats_line ( p, end, "sentences", 0, st->sentences ) ;
+  p = stats_line ( p, end, "checksum_failures", 0, st->badsums ) ;
+  p = stats_line ( p, end, "overflows", 0, st->overflows ) ;
+  p = stats_line ( p, end, "other_sentences", 0, st->other ) ;
+  p = stats_line ( p, end, "invalid_fixes", 0, st->invalid ) ;
+  p = stats_line ( p, end, "fixes", 0, st->fixes ) ;
+  for ( i = 0 ; i < GPSSTATS_BUCKETS ; i++ )
+    {
+    if ( !st->latency[i] ) continue ;
+    if ( i < GPSSTATS_BUCKETS - 1 ) p = stats_line ( p, end, "latency_us_under_", 1ULL << i, st->latency[i] ) ;
+    else p = stats_line ( p, end, "latency_us_over_", 1ULL << ( i - 1 ), st->latency[i] ) ;
+    }
+  if ( size ) *( p < end ? p : (char*) end ) = '\0' ;
+  return (int) ( p - buf ) ;
+  }
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent
@@ -0,0 +1,461 @@
+/****************************************************************************************************************************************************/
+/*  Purpose:    Binary fix records, and compressed track archives of them.                                                                          */
+/*  Author:     Copyright (c) 2014, W.B.Hill <mail@wbh.org> All rights reserved.                                                                    */
+/*  License:    GPLv2 - see file LICENSE or http://www.gnu.org                                                                                      */
+/*  License:    BSD - see http://opensource.org/licenses/BSD-2-Clause                                                                               */
+/****************************************************************************************************************************************************/
+
+// An archive is a header, then blocks of up to TRACK_BLOCK fixes, then an index of the blocks and a footer. Each block has a fixed header
+// with its time range, then its fixes as differences from the one before, zigzagged and varint coded. Time and position are predicted
+// to change as much as they did last time, and only the error is kept, so a fix from something moving steadily is about six bytes.
+// Blocks and the index are 8 byte aligned, so a mapped file can be used in place. Appending to an archive drops its index, and a new
+// one is written on closing. If that never happens, readers find the blocks by walking their headers instead.
+
+// For pread() and pwrite()
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "gpsread.h"
+
+
+// What the parts of the file start with.
+static const char track_magic[8] = "GPSTRK2" ;
+static const char track_endmagic[8] = "GPSTRKX" ;
+#define TRACK_BLOCKMAGIC 0x4b4c4254u
+
+// Before each block.
+typedef struct
+  {
+  uint32_t magic ;
+  uint32_t len ;                // Coded bytes after this, a multiple of 8.
+  uint32_t count ;
+  uint32_t pad ;
+  int64_t first, last ;         // Earliest and latest time in it.
+  } trackblock_t ;
+
+// The last thing in a closed archive.
+typedef struct
+  {
+  char magic[8] ;
+  uint64_t index ;              // Where the index starts.
+  uint64_t count ;              // How many entries it has.
+  } trackfoot_t ;
+
+
+// Milliseconds since 1970 for a fix. If there's been no date, it's -2 less milliseconds since midnight, so it can't be taken for a
+// time on the first of January 1970, and a query for any real times leaves it out. -1 if there's no time.
+static int64_t
+fixrec_time ( const gpsfix_t* fix )
+  {
+  if ( fix->utc < 0 ) return -1 ;
+  if ( fix->date < 0 ) return -2 - fix->utc ;
+  return (int64_t) fix->date * 86400000LL + fix->utc ;
+  }
+
+
+// Fill a record from a fix.
+void
+fixrec_pack ( fixrec_t* rec, const gpsfix_t* fix )
+  {
+  memset ( rec, 0, sizeof ( *rec ) ) ;
+  rec->time = fixrec_time ( fix ) ;
+  rec->lat = fix->lat ;
+  rec->lon = fix->lon ;
+  rec->alt = fix->alt ;
+  rec->hdop = fix->hdop ;
+  rec->quality = fix->quality ;
+  rec->sats = fix->sats ;
+  }
+
+
+// Get a fix back out of a record. There's no sentence, so raw is empty.
+void
+fixrec_unpack ( const fixrec_t* rec, gpsfix_t* fix )
+  {
+  gpsfix_init ( fix ) ;
+  if ( rec->time >= 0 )
+    {
+    fix->date = (int32_t) ( rec->time / 86400000LL ) ;
+    fix->utc = (int32_t) ( rec->time % 86400000LL ) ;
+    }
+  else if ( rec->time < -1 ) fix->utc = (int32_t) ( -2 - rec->time ) ;
+  fix->lat = rec->lat ;
+  fix->lon = rec->lon ;
+  fix->alt = rec->alt ;
+  fix->hdop = rec->hdop ;
+  fix->quality = rec->quality ;
+  fix->sats = rec->sats ;
+  fix->raw = "" ;
+  }
+
+
+// Add a signed number to a block, zigzagged so small either way is short, 7 bits a byte.
+static uint8_t*
+track_put ( uint8_t* p, int64_t v )
+  {
+  uint64_t u = ( (uint64_t) v << 1 ) ^ (uint64_t) ( v >> 63 ) ;
+  while ( u >= 0x80 )
+    {
+    *p++ = (uint8_t) u | 0x80 ;
+    u >>= 7 ;
+    }
+  *p++ = (uint8_t) u ;
+  return p ;
+  }
+
+
+// Take one back out. NULL if it runs off the end.
+static const uint8_t*
+track_get ( const uint8_t* p, const uint8_t* end, int64_t* v )
+  {
+  uint64_t u = 0 ;
+  int shift ;
+  for ( shift = 0 ; p < end && shift < 64 ; shift += 7 )
+    {
+    u |= (uint64_t) ( *p & 0x7f ) << shift ;
+    if ( !( *p++ & 0x80 ) )
+      {
+      *v = (int64_t) ( u >> 1 ) ^ -(int64_t) ( u & 1 ) ;
+      return p ;
+      }
+    }
+  return NULL ;
+  }
+
+
+// Code a record as the difference from the one before, or from where it was heading for time and position. step has the last changes.
+static uint8_t*
+track_encode ( uint8_t* p, const fixrec_t* rec, const fixrec_t* prev, int64_t* step )
+  {
+  int64_t d[3] = { rec->time - prev->time, (int64_t) rec->lat - prev->lat, (int64_t) rec->lon - prev->lon } ;
+  int i ;
+  for ( i = 0 ; i < 3 ; i++ )
+    {
+    p = track_put ( p, d[i] - step[i] ) ;
+    step[i] = d[i] ;
+    }
+  p = track_put ( p, (int64_t) rec->alt - prev->alt ) ;
+  p = track_put ( p, (int64_t) rec->hdop - prev->hdop ) ;
+  p = track_put ( p, (int64_t) rec->quality - prev->quality ) ;
+  p = track_put ( p, (int64_t) rec->sats - prev->sats ) ;
+  return p ;
+  }
+
+
+// And back, on top of the one before. NULL if it's no good.
+static const uint8_t*
+track_decode ( const uint8_t* p, const uint8_t* end, fixrec_t* rec, int64_t* step )
+  {
+  int64_t d[7] ;
+  int i ;
+  for ( i = 0 ; i < 7 ; i++ ) if ( ( p = track_get ( p, end, &d[i] ) ) == NULL ) return NULL ;
+  for ( i = 0 ; i < 3 ; i++ ) step[i] = d[i] += step[i] ;
+  rec->time += d[0] ;
+  rec->lat += (int32_t) d[1] ;
+  rec->lon += (int32_t) d[2] ;
+  rec->alt += (int32_t) d[3] ;
+  rec->hdop += (int16_t) d[4] ;
+  rec->quality += (uint8_t) d[5] ;
+  rec->sats += (uint8_t) d[6] ;
+  return p ;
+  }
+
+
+// Round up to the next 8 bytes.
+#define ALIGN8(N) ( ( (N) + 7 ) & ~(uint64_t) 7 )
+
+
+// Is there a good block header at off? Returns where the next one would be, or 0 if there isn't.
+static uint64_t
+track_block_at ( const trackblock_t* b, uint64_t off, uint64_t size )
+  {
+  if ( off + sizeof ( *b ) > size ) return 0 ;
+  if ( b->magic != TRACK_BLOCKMAGIC || b->len % 8 || b->count == 0 || b->count > TRACK_BLOCK ) return 0 ;
+  if ( b->len > size - off - sizeof ( *b ) ) return 0 ;
+  return off + sizeof ( *b ) + b->len ;
+  }
+
+
+// Add an index entry. Returns 0, or -1 if it ran out of memory.
+static int
+track_index_add ( trackindex_t** index, size_t* n, size_t* size, const trackblock_t* b, uint64_t off )
+  {
+  trackindex_t* bigger ;
+  if ( *n == *size )
+    {
+    bigger = realloc ( *index, ( *size * 2 + 64 ) * sizeof ( trackindex_t ) ) ;
+    if ( bigger == NULL ) return -1 ;
+    *index = bigger ;
+    *size = *size * 2 + 64 ;
+    }
+  (*index)[*n].first = b->first ;
+  (*index)[*n].last = b->last ;
+  (*index)[*n].off = off ;
+  (*index)[*n].count = b->count ;
+  (*index)[*n].pad = 0 ;
+  (*n)++ ;
+  return 0 ;
+  }
+
+
+// Open an archive to add to, creating it if it's not there. Returns 0, or -1 with errno set.
+int
+trackfile_open ( trackfile_t* tf, const char* path )
+  {
+  struct stat st ;
+  trackfoot_t foot ;
+  trackblock_t b ;
+  char magic[8] ;
+  uint64_t off, next ;
+  int err ;
+  memset ( tf, 0, sizeof ( *tf ) ) ;
+  tf->fd = open ( path, O_RDWR | O_CREAT, 0644 ) ;
+  if ( tf->fd < 0 ) return -1 ;
+  if ( fstat ( tf->fd, &st ) < 0 ) goto fail ;
+  // New, so start it off.
+  if ( st.st_size == 0 )
+    {
+    if ( pwrite ( tf->fd, track_magic, sizeof ( track_magic ), 0 ) != sizeof ( track_magic ) ) goto fail ;
+    tf->end = sizeof ( track_magic ) ;
+    return 0 ;
+    }
+  if ( pread ( tf->fd, magic, sizeof ( magic ), 0 ) != sizeof ( magic ) || memcmp ( magic, track_magic, sizeof ( magic ) ) )
+    {
+    errno = EINVAL ;
+    goto fail ;
+    }
+  // Closed properly, the index says where the blocks end.
+  if ( (uint64_t) st.st_size >= sizeof ( magic ) + sizeof ( foot ) &&
+       pread ( tf->fd, &foot, sizeof ( foot ), st.st_size - sizeof ( foot ) ) == sizeof ( foot ) &&
+       !memcmp ( foot.magic, track_endmagic, sizeof ( foot.magic ) ) &&
+       foot.index + foot.count * sizeof ( trackindex_t ) + sizeof ( foot ) == (uint64_t) st.st_size )
+    {
+    tf->nindex = tf->sizeindex = foot.count ;
+    tf->index = malloc ( foot.count * sizeof ( trackindex_t ) + 1 ) ;
+    if ( tf->index == NULL ) goto fail ;
+    if ( pread ( tf->fd, tf->index, foot.count * sizeof ( trackindex_t ), foot.index ) != (ssize_t) ( foot.count * sizeof ( trackindex_t ) ) )
+      {
+      goto fail ;
+      }
+    tf->end = foot.index ;
+    }
+  // Otherwise walk the blocks, and forget anything after the last good one.
+  else
+    {
+    for ( off = sizeof ( magic ) ; pread ( tf->fd, &b, sizeof ( b ), off ) == sizeof ( b ) ; off = next )
+      {
+      if ( ( next = track_block_at ( &b, off, st.st_size ) ) == 0 ) break ;
+      if ( track_index_add ( &tf->index, &tf->nindex, &tf->sizeindex, &b, off ) < 0 ) goto fail ;
+      }
+    tf->end = off ;
+    }
+  // The old index goes, so a crash before closing leaves something readers can walk.
+  if ( ftruncate ( tf->fd, tf->end ) < 0 ) goto fail ;
+  return 0 ;
+fail :
+  err = errno ;
+  close ( tf->fd ) ;
+  free ( tf->index ) ;
+  tf->index = NULL ;
+  tf->fd = -1 ;
+  errno = ( err == 0 ) ? EIO : err ;
+  return -1 ;
+  }
+
+
+// Write out the block so far. Returns 0, or -1 with errno set.
+int
+trackfile_flush ( trackfile_t* tf )
+  {
+  trackblock_t b ;
+  size_t len ;
+  if ( tf->count == 0 ) return 0 ;
+  len = ALIGN8 ( tf->len ) ;
+  memset ( tf->buf + tf->len, 0, len - tf->len ) ;
+  b.magic = TRACK_BLOCKMAGIC ;
+  b.len = len - sizeof ( b ) ;
+  b.count = tf->count ;
+  b.pad = 0 ;
+  b.first = tf->first ;
+  b.last = tf->last ;
+  memcpy ( tf->buf, &b, sizeof ( b ) ) ;
+  if ( pwrite ( tf->fd, tf->buf, len, tf->end ) != (ssize_t) len )
+    {
+    if ( errno == 0 ) errno = EIO ;
+    return -1 ;
+    }
+  if ( track_index_add ( &tf->index, &tf->nindex, &tf->sizeindex, &b, tf->end ) < 0 ) return -1 ;
+  tf->end += len ;
+  tf->count = 0 ;
+  return 0 ;
+  }
+
+
+// Add a fix, writing out a block when there's a full one. Returns 0, or -1 with errno set.
+int
+trackfile_add ( trackfile_t* tf, const gpsfix_t* fix )
+  {
+  fixrec_t rec ;
+  fixrec_pack ( &rec, fix ) ;
+  // Each block starts from nothing, so it can be read on its own.
+  if ( tf->count == 0 )
+    {
+    memset ( &tf->prev, 0, sizeof ( tf->prev ) ) ;
+    memset ( tf->step, 0, sizeof ( tf->step ) ) ;
+    tf->len = sizeof ( trackblock_t ) ;
+    tf->first = tf->last = rec.time ;
+    }
+  tf->len = track_encode ( tf->buf + tf->len, &rec, &tf->prev, tf->step ) - tf->buf ;
+  // Nothing to go on for the second.
+  if ( tf->count == 0 ) memset ( tf->step, 0, sizeof ( tf->step ) ) ;
+  tf->prev = rec ;
+  if ( rec.time < tf->first ) tf->first = rec.time ;
+  if ( rec.time > tf->last ) tf->last = rec.time ;
+  return ( ++tf->count == TRACK_BLOCK ) ? trackfile_flush ( tf ) : 0 ;
+  }
+
+
+// Write out what's left, and the index, and close it. Returns 0, or -1 with errno set.
+int
+trackfile_close ( trackfile_t* tf )
+  {
+  trackfoot_t foot ;
+  size_t len = tf->nindex * sizeof ( trackindex_t ) ;
+  int ret = 0, err = 0 ;
+  if ( tf->fd < 0 ) return 0 ;
+  if ( trackfile_flush ( tf ) < 0 ) ret = -1 ;
+  memset ( &foot, 0, sizeof ( foot ) ) ;
+  memcpy ( foot.magic, track_endmagic, sizeof ( foot.magic ) ) ;
+  foot.index = tf->end ;
+  foot.count = tf->nindex ;
+  if ( ret == 0 && ( pwrite ( tf->fd, tf->index, len, tf->end ) != (ssize_t) len ||
+                     pwrite ( tf->fd, &foot, sizeof ( foot ), tf->end + len ) != sizeof ( foot ) ) ) ret = -1 ;
+  if ( ret < 0 ) err = errno ? errno : EIO ;
+  if ( close ( tf->fd ) < 0 && ret == 0 )
+    {
+    err = errno ;
+    ret = -1 ;
+    }
+  free ( tf->index ) ;
+  tf->index = NULL ;
+  tf->fd = -1 ;
+  if ( ret < 0 ) errno = err ;
+  return ret ;
+  }
+
+
+// Map an archive to read. Returns 0, or -1 with errno set.
+int
+trackmap_open ( trackmap_t* tm, const char* path )
+  {
+  struct stat st ;
+  const trackfoot_t* foot ;
+  uint64_t off, next ;
+  size_t size = 0 ;
+  int fd, err ;
+  memset ( tm, 0, sizeof ( *tm ) ) ;
+  if ( ( fd = open ( path, O_RDONLY ) ) < 0 ) return -1 ;
+  if ( fstat ( fd, &st ) < 0 ) goto fail ;
+  if ( (uint64_t) st.st_size < sizeof ( track_magic ) )
+    {
+    errno = EINVAL ;
+    goto fail ;
+    }
+  tm->size = st.st_size ;
+  tm->map = mmap ( NULL, tm->size, PROT_READ, MAP_SHARED, fd, 0 ) ;
+  if ( tm->map == MAP_FAILED ) goto fail ;
+  close ( fd ) ;
+  fd = -1 ;
+  if ( memcmp ( tm->map, track_magic, sizeof ( track_magic ) ) )
+    {
+    errno = EINVAL ;
+    goto fail ;
+    }
+  // Use the index in place if it's there.
+  foot = ( tm->size >= sizeof ( track_magic ) + sizeof ( *foot ) ) ? (const trackfoot_t*) ( tm->map + tm->size - sizeof ( *foot ) ) : NULL ;
+  if ( foot && tm->size % 8 == 0 && !memcmp ( foot->magic, track_endmagic, sizeof ( foot->magic ) ) &&
+       foot->index + foot->count * sizeof ( trackindex_t ) + sizeof ( *foot ) == tm->size )
+    {
+    tm->index = (const trackindex_t*) ( tm->map + foot->index ) ;
+    tm->nindex = foot->count ;
+    return 0 ;
+    }
+  // If not, build one.
+  for ( off = sizeof ( track_magic ) ; ( next = track_block_at ( (const trackblock_t*) ( tm->map + off ), off, tm->size ) ) ; off = next )
+    {
+    if ( track_index_add ( &tm->built, &tm->nindex, &size, (const trackblock_t*) ( tm->map + off ), off ) < 0 ) goto fail ;
+    }
+  tm->index = tm->built ;
+  return 0 ;
+fail :
+  err = errno ;
+  if ( fd >= 0 ) close ( fd ) ;
+  if ( tm->map && tm->map != MAP_FAILED ) munmap ( (void*) tm->map, tm->size ) ;
+  free ( tm->built ) ;
+  memset ( tm, 0, sizeof ( *tm ) ) ;
+  errno = err ;
+  return -1 ;
+  }
+
+
+// Done with it.
+void
+trackmap_close ( trackmap_t* tm )
+  {
+  if ( tm->map ) munmap ( (void*) tm->map, tm->size ) ;
+  free ( tm->built ) ;
+  memset ( tm, 0, sizeof ( *tm ) ) ;
+  }
+
+
+// Pass every record timed from first to last, inclusive, to onrec. Only blocks whose range overlaps are decoded.
+// Returns how many there were, or -1 with errno set if a block is corrupt.
+long
+trackmap_query ( const trackmap_t* tm, int64_t first, int64_t last, trackmap_cb onrec, void* user )
+  {
+  const trackblock_t* b ;
+  const uint8_t* p ;
+  const uint8_t* end ;
+  fixrec_t rec ;
+  int64_t step[3] ;
+  size_t i ;
+  uint32_t j ;
+  long n = 0 ;
+  for ( i = 0 ; i < tm->nindex ; i++ )
+    {
+    if ( tm->index[i].last < first || tm->index[i].first > last ) continue ;
+    b = (const trackblock_t*) ( tm->map + tm->index[i].off ) ;
+    if ( track_block_at ( b, tm->index[i].off, tm->size ) == 0 )
+      {
+      errno = EINVAL ;
+      return -1 ;
+      }
+    p = (const uint8_t*) ( b + 1 ) ;
+    end = p + b->len ;
+    memset ( &rec, 0, sizeof ( rec ) ) ;
+    memset ( step, 0, sizeof ( step ) ) ;
+    for ( j = 0 ; j < b->count ; j++ )
+      {
+      if ( ( p = track_decode ( p, end, &rec, step ) ) == NULL )
+        {
+        errno = EINVAL ;
+        return -1 ;
+        }
+      if ( j == 0 ) memset ( step, 0, sizeof ( step ) ) ;
+      if ( rec.time < first || rec.time > last ) continue ;
+      n++ ;
+      if ( onrec ) onrec ( &rec, user ) ;
+      }
+    }
+  return n ;
+  }
+
+
+// VIM formatting info.
+// vim:ts=2:sw=2:tw=150:fo=tcnq2b:foldmethod=indent